@@ -31,8 +31,10 @@
  * license (including the GNU public license).
  */
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdarg.h>
+#include <sys/uio.h>
 #include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <openssl/aes.h>
@@ -63,21 +65,118 @@ unsigned char zero[AES_BLOCK_SIZE] = {
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 };
 
+/*
+ * the AES is done with EVP so we get whatever the hardware has to offer.
+ * There's one context for the CBC-MAC in S2V and one for CTR, they get
+ * keyed with whatever siv_ctx is being used each time a MAC or an
+ * encryption starts, so an siv_ctx stays a plain struct that needs no
+ * freeing and several of them can be in use at once.
+ */
+#define CBC_CHUNK       512
+
+static EVP_CIPHER_CTX *s2v_evp = NULL, *ctr_evp = NULL;
+static unsigned char s2v_evp_key[AES_256_BYTES], ctr_evp_key[AES_256_BYTES];
+static int s2v_evp_bits = 0, ctr_evp_bits = 0;
+
+static const EVP_CIPHER *
+aes_cipher (int bits, int ctr)
+{
+    switch (bits) {
+        case 128:
+            return ctr ? EVP_aes_128_ctr() : EVP_aes_128_cbc();
+        case 192:
+            return ctr ? EVP_aes_192_ctr() : EVP_aes_192_cbc();
+        case 256:
+            return ctr ? EVP_aes_256_ctr() : EVP_aes_256_cbc();
+    }
+    return NULL;
+}
+
+/*
+ * key_evp()
+ *	make sure an EVP context is keyed with key, only do the
+ *	key schedule if it isn't already
+ */
+static int
+key_evp (EVP_CIPHER_CTX **evp, unsigned char *evpkey, int *evpbits,
+         const unsigned char *key, int bits, int ctr)
+{
+    if ((*evp == NULL) && ((*evp = EVP_CIPHER_CTX_new()) == NULL)) {
+        return -1;
+    }
+    if ((*evpbits == bits) && (memcmp(evpkey, key, bits/8) == 0)) {
+        return 1;
+    }
+    if (!EVP_EncryptInit_ex(*evp, aes_cipher(bits, ctr), NULL, key, zero)) {
+        *evpbits = 0;
+        return -1;
+    }
+    EVP_CIPHER_CTX_set_padding(*evp, 0);
+    memcpy(evpkey, key, bits/8);
+    *evpbits = bits;
+    return 1;
+}
+
+static int
+key_siv (siv_ctx *ctx)
+{
+    if ((key_evp(&s2v_evp, s2v_evp_key, &s2v_evp_bits, ctx->s2v_key, ctx->keybits, 0) < 0) ||
+        (key_evp(&ctr_evp, ctr_evp_key, &ctr_evp_bits, ctx->ctr_key, ctx->keybits, 1) < 0)) {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * cbc_start()
+ *	begin a CBC-MAC with ctx's S2V key, the chaining value is zero
+ */
+static int
+cbc_start (siv_ctx *ctx)
+{
+    if (key_evp(&s2v_evp, s2v_evp_key, &s2v_evp_bits, ctx->s2v_key, ctx->keybits, 0) < 0) {
+        return -1;
+    }
+    EVP_EncryptInit_ex(s2v_evp, NULL, NULL, NULL, zero);
+    return 1;
+}
+
+/*
+ * cbc_blocks()
+ *	continue a CBC-MAC over len bytes (a multiple of the block
+ *	size), the chaining value after the last block goes in C
+ */
+static void
+cbc_blocks (const unsigned char *in, int len, unsigned char *C)
+{
+    unsigned char out[CBC_CHUNK];
+    int n = 0, outl;
+
+    while (len > 0) {
+        n = len > CBC_CHUNK ? CBC_CHUNK : len;
+        EVP_EncryptUpdate(s2v_evp, out, &outl, in, n);
+        in += n;
+        len -= n;
+    }
+    if (n) {
+        memcpy(C, out + n - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+    }
+}
+
 /*
  * xor()
- *	output ^= input
+ *	output ^= input, 128 bits at a time
  */
 static void
 xor (unsigned char *output, const unsigned char *input)
 {
-    int i;
+    uint64_t o[2], i[2];
 
-    i = AES_BLOCK_SIZE - 1;
-    do {
-	output[i] ^= input[i];
-	i--;
-    } while (i >= 0);
-    return;
+    memcpy(o, output, AES_BLOCK_SIZE);
+    memcpy(i, input, AES_BLOCK_SIZE);
+    o[0] ^= i[0];
+    o[1] ^= i[1];
+    memcpy(output, o, AES_BLOCK_SIZE);
 }
 
 /*
@@ -128,7 +227,7 @@ pad (unsigned char *buf, int len)
 void
 aes_cmac (siv_ctx *ctx, const unsigned char *msg, int mlen, unsigned char *C)
 {
-    int n, i, slop;
+    int n, slop;
     unsigned char Mn[AES_BLOCK_SIZE], *ptr;
 
     memcpy(C, zero, AES_BLOCK_SIZE);
@@ -142,10 +241,12 @@ aes_cmac (siv_ctx *ctx, const unsigned char *msg, int mlen, unsigned char *C)
      * CBC mode for first n-1 blocks
      */
     ptr = (unsigned char *)msg;
-    for (i = 0; i < (n-1); i++) {
-	xor(C, ptr);
-	AES_encrypt(C, C, &ctx->s2v_sched);
-	ptr += AES_BLOCK_SIZE;
+    if (cbc_start(ctx) < 0) {
+        return;
+    }
+    if (n > 1) {
+        cbc_blocks(ptr, (n-1) * AES_BLOCK_SIZE, C);
+        ptr += (n-1) * AES_BLOCK_SIZE;
     }
 
     /*
@@ -169,21 +270,20 @@ aes_cmac (siv_ctx *ctx, const unsigned char *msg, int mlen, unsigned char *C)
     /*
      * and do CBC with that xor'd and possibly padded block
      */
-    xor(C, Mn);
-    AES_encrypt(C, C, &ctx->s2v_sched);
+    cbc_blocks(Mn, AES_BLOCK_SIZE, C);
     return;
 }
 
 /*
- * s2v_final()
- *	input the last chunk into the s2v, output the digest
+ * s2v_finalv()
+ *	input the last chunk, scattered across iovecs, into the s2v,
+ *	output the digest
  */
-int
-s2v_final (siv_ctx *ctx, const unsigned char *X, int xlen, unsigned char *digest)
+static void
+s2v_finalv (siv_ctx *ctx, const struct iovec *iov, int niov, int xlen, unsigned char *digest)
 {
-    unsigned char T[AES_BLOCK_SIZE], C[AES_BLOCK_SIZE];
-    unsigned char padX[AES_BLOCK_SIZE], *ptr;
-    int blocks, i, slop;
+    unsigned char T[AES_BLOCK_SIZE], C[AES_BLOCK_SIZE], *ptr;
+    int i, n, len, have, pos, tail, last;
 
     if (xlen < AES_BLOCK_SIZE) {
 	/*
@@ -191,89 +291,84 @@ s2v_final (siv_ctx *ctx, const unsigned char *X, int xlen, unsigned char *digest
 	 * do another x2 of our running total and pad the
 	 * input before the final xor and sPRF.
 	 */
-	memcpy(padX, X, xlen);
-	pad(padX, xlen);
-	
-	times_two(T, ctx->T);
-	xor(T, padX);
-	aes_cmac(ctx, T, AES_BLOCK_SIZE, digest);
-    } else {
-        if (xlen == AES_BLOCK_SIZE) {
-            /*
-             * the final buffer is exactly the block size
-             */
-            memcpy(T, X, AES_BLOCK_SIZE);
-            xor(T, ctx->T);
-            aes_cmac(ctx, T, AES_BLOCK_SIZE, digest);
-        } else {
-            /*
-             * -1 because the last 2 blocks get special treatment
-             * and there's another -1 in the for loop below where
-             * we AES-CMAC the buffer.
-             */
-            blocks = (xlen+(AES_BLOCK_SIZE-1))/AES_BLOCK_SIZE - 1;
-            ptr = (unsigned char *)X;
-            memcpy(C, zero, AES_BLOCK_SIZE);
-            if (blocks > 1) {
-                /*
-                 * do AES-CMAC on all the buffers up to the last 2 blocks
-                 */
-                for (i = 0; i < (blocks-1); i++) {
-                    xor(C, ptr);
-                    AES_encrypt(C, C, &ctx->s2v_sched);
-                    ptr += AES_BLOCK_SIZE;
+        for (i = 0, have = 0; i < niov; i++) {
+            memcpy(T + have, iov[i].iov_base, iov[i].iov_len);
+            have += iov[i].iov_len;
+        }
+	pad(T, xlen);
+	times_two(C, ctx->T);
+	xor(C, T);
+	aes_cmac(ctx, C, AES_BLOCK_SIZE, digest);
+        return;
+    }
+    /*
+     * otherwise it's AES-CMAC over the input with T xor'd onto the
+     * end of it. Whole blocks that come before the xor-end go right
+     * into CBC, the rest gets assembled a block at a time.
+     */
+    tail = xlen - AES_BLOCK_SIZE;                               /* where xor-end starts */
+    last = ((xlen - 1)/AES_BLOCK_SIZE) * AES_BLOCK_SIZE;        /* where the last block starts */
+    have = pos = 0;
+    memcpy(C, zero, AES_BLOCK_SIZE);
+    if (cbc_start(ctx) < 0) {
+        memset(digest, 0, AES_BLOCK_SIZE);
+        return;
+    }
+    for (i = 0; i < niov; i++) {
+        ptr = (unsigned char *)iov[i].iov_base;
+        len = iov[i].iov_len;
+        while (len > 0) {
+            if ((have == 0) && (len >= AES_BLOCK_SIZE) &&
+                ((n = ((tail - pos)/AES_BLOCK_SIZE) * AES_BLOCK_SIZE) > 0)) {
+                if (n > (len/AES_BLOCK_SIZE) * AES_BLOCK_SIZE) {
+                    n = (len/AES_BLOCK_SIZE) * AES_BLOCK_SIZE;
                 }
+                cbc_blocks(ptr, n, C);
+                ptr += n;
+                pos += n;
+                len -= n;
+                continue;
             }
-            memcpy(T, ptr, AES_BLOCK_SIZE);
-            slop = xlen % AES_BLOCK_SIZE;
-            if (slop) {
-                /*
-                 * if there's slop then do the xor-end onto this block
-                 */
-                for (i = 0; i < AES_BLOCK_SIZE - slop; i++) {
-                    T[i + slop] ^= ctx->T[i];
-                }
-                /*
-                 * continue with AES-CMAC on this partially xor'd buffer
-                 */
-                xor(C, T);
-                AES_encrypt(C, C, &ctx->s2v_sched);
-                ptr += AES_BLOCK_SIZE;
-                /*
-                 * now the final block is small so xor the end then pad and xor
-                 */
-                memset(T, 0, AES_BLOCK_SIZE);
-                memcpy(T, ptr, slop);
-                for (i = 0; i < slop; i++) {
-                    T[i] ^= ctx->T[(AES_BLOCK_SIZE-slop)+i];
-                }
-                pad(T, slop);
-                xor(T, ctx->K2);
-            } else {
-                /*
-                 * otherwise there's no slop so just AES-CMAC the next whole block
-                 */
-                xor(C, ptr);
-                AES_encrypt(C, C, &ctx->s2v_sched);
-                ptr += AES_BLOCK_SIZE;
-                /*
-                 * xor-end the entire last block...
-                 */
-                memcpy(T, ptr, AES_BLOCK_SIZE);
-                xor(T, ctx->T);
-                /*
-                 * and treat it as the last (whole) block in AES-CMAC
-                 */
-                xor(T, ctx->K1);
+            T[have] = *ptr++;
+            if (pos >= tail) {
+                T[have] ^= ctx->T[pos - tail];
+            }
+            have++;
+            pos++;
+            len--;
+            if ((have == AES_BLOCK_SIZE) && (pos <= last)) {
+                cbc_blocks(T, AES_BLOCK_SIZE, C);
+                have = 0;
             }
-            /*
-             * a final CBC finishes AES-CMAC
-             */
-            xor(C, T);
-            AES_encrypt(C, digest, &ctx->s2v_sched);
         }
-        
     }
+    /*
+     * the last block is either whole or gets padded
+     */
+    if (have == AES_BLOCK_SIZE) {
+        xor(T, ctx->K1);
+    } else {
+        pad(T, have);
+        xor(T, ctx->K2);
+    }
+    /*
+     * a final CBC finishes AES-CMAC
+     */
+    cbc_blocks(T, AES_BLOCK_SIZE, digest);
+}
+
+/*
+ * s2v_final()
+ *	input the last chunk into the s2v, output the digest
+ */
+int
+s2v_final (siv_ctx *ctx, const unsigned char *X, int xlen, unsigned char *digest)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)X;
+    iov.iov_len = xlen;
+    s2v_finalv(ctx, &iov, 1, xlen, digest);
     return 0;
 }
 
@@ -316,25 +411,26 @@ siv_init (siv_ctx *ctx, const unsigned char *key, int keylen)
     memset((char *)ctx, 0, sizeof(siv_ctx));
     switch (keylen) {
         case SIV_512:   /* a pair of 256 bit keys */
-            AES_set_encrypt_key(key, 256, &ctx->s2v_sched);
-            AES_set_encrypt_key(key+AES_256_BYTES, 256, &ctx->ctr_sched);
-            break;
         case SIV_384:   /* a pair of 192 bit keys */
-            AES_set_encrypt_key(key, 192, &ctx->s2v_sched);
-            AES_set_encrypt_key(key+AES_192_BYTES, 192, &ctx->ctr_sched);
-            break;
         case SIV_256:   /* a pair of 128 bit keys */
-            AES_set_encrypt_key(key, 128, &ctx->s2v_sched);
-            AES_set_encrypt_key(key+AES_128_BYTES, 128, &ctx->ctr_sched);
+            ctx->keybits = keylen/2;
+            memcpy(ctx->s2v_key, key, ctx->keybits/8);
+            memcpy(ctx->ctr_key, key + ctx->keybits/8, ctx->keybits/8);
             break;
         default:
             return -1;
     }
+    if (key_siv(ctx) < 0) {
+        return -1;
+    }
 
     /*
      * compute CMAC subkeys
      */
-    AES_encrypt(zero, L, &ctx->s2v_sched);
+    if (cbc_start(ctx) < 0) {
+        return -1;
+    }
+    cbc_blocks(zero, AES_BLOCK_SIZE, L);
     times_two(ctx->K1, L);
     times_two(ctx->K2, ctx->K1);
 
@@ -352,6 +448,7 @@ siv_init (siv_ctx *ctx, const unsigned char *key, int keylen)
 void
 siv_restart (siv_ctx *ctx)
 {
+    ctx->benchmarked = 0;
     memset(ctx->benchmark, 0, AES_BLOCK_SIZE);
     memset(ctx->T, 0, AES_BLOCK_SIZE);
     aes_cmac(ctx, zero, AES_BLOCK_SIZE, ctx->T);
@@ -365,6 +462,7 @@ void
 s2v_benchmark (siv_ctx *ctx)
 {
     memcpy(ctx->benchmark, ctx->T, AES_BLOCK_SIZE);
+    ctx->benchmarked = 1;
 }
 
 /*
@@ -378,38 +476,128 @@ s2v_reset (siv_ctx *ctx)
 }
 
 /*
- * siv_aes_ctr()
- *      aes in CTR mode for SIV
+ * siv_done()
+ *	the only part of the context that is carried along with
+ *	subsequent encryptions and decryptions are the keys and a
+ *	benchmark, if there is one, so reset everything else.
  */
-void
-siv_aes_ctr (siv_ctx *ctx, const unsigned char *p, const int lenp,
-             unsigned char *c, const unsigned char *iv)
+static void
+siv_done (siv_ctx *ctx)
 {
-    int i, j;
-    unsigned char ctr[AES_BLOCK_SIZE], ecr[AES_BLOCK_SIZE];
-    unsigned long inc;
+    if (ctx->benchmarked) {
+        s2v_reset(ctx);
+    } else {
+        siv_restart(ctx);
+    }
+}
+
+/*
+ * siv_aes_ctrv()
+ *      aes in CTR mode for SIV over iovecs. If c is NULL it's done
+ *      in place, otherwise the output is contiguous in c.
+ */
+static void
+siv_aes_ctrv (siv_ctx *ctx, const struct iovec *iov, int niov,
+              unsigned char *c, const unsigned char *iv)
+{
+    unsigned char ctr[AES_BLOCK_SIZE], *out;
+    int i, outl;
 
     memcpy(ctr, iv, AES_BLOCK_SIZE);
     /*
      * zero out the high order bits of the last two 32-bit words.
-     * This allows ctr mode to be implemented mod sizeof(ulong)
-     * or sizeof(longlong).
-     *
-     * we're just doing addition modulo 2^32 though....
+     * With bit 31 clear the last word can't carry into the rest of
+     * the counter for any length we'd see so the 128-bit increment
+     * done by EVP is the same as the 32-bit increment SIV expects.
      */
     ctr[12] &= 0x7f; ctr[8] &= 0x7f;
-    inc = GETU32(ctr + 12);
-    for (i = 0; i < lenp; i+=AES_BLOCK_SIZE) {
-        AES_encrypt(ctr, ecr, &ctx->ctr_sched);
-        for (j = 0; j < AES_BLOCK_SIZE; j++) {
-            if ((i + j) == lenp) {
-                return;
+    EVP_EncryptInit_ex(ctr_evp, NULL, NULL, NULL, ctr);
+    for (i = 0; i < niov; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        out = (c == NULL) ? (unsigned char *)iov[i].iov_base : c;
+        EVP_EncryptUpdate(ctr_evp, out, &outl, iov[i].iov_base, iov[i].iov_len);
+        if (c != NULL) {
+            c += iov[i].iov_len;
+        }
+    }
+}
+
+/*
+ * siv_aes_ctr()
+ *      aes in CTR mode for SIV
+ */
+void
+siv_aes_ctr (siv_ctx *ctx, const unsigned char *p, const int lenp,
+             unsigned char *c, const unsigned char *iv)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)p;
+    iov.iov_len = lenp;
+    siv_aes_ctrv(ctx, &iov, 1, c, iv);
+}
+
+static int
+iov_len (const struct iovec *iov, int niov)
+{
+    int i, len = 0;
+
+    for (i = 0; i < niov; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/*
+ * siv_seal()
+ *      S2V and CTR on the plaintext once the AD is in
+ */
+static void
+siv_seal (siv_ctx *ctx, const struct iovec *pt, int npt, unsigned char *c,
+          unsigned char *counter)
+{
+    unsigned char ctr[AES_BLOCK_SIZE];
+
+    s2v_finalv(ctx, pt, npt, iov_len(pt, npt), ctr);
+    memcpy(counter, ctr, AES_BLOCK_SIZE);
+    siv_aes_ctrv(ctx, pt, npt, c, ctr);
+    siv_done(ctx);
+}
+
+/*
+ * siv_open()
+ *      CTR on the ciphertext then verify S2V, once the AD is in
+ */
+static int
+siv_open (siv_ctx *ctx, const struct iovec *ct, int nct, unsigned char *p,
+          unsigned char *counter)
+{
+    unsigned char ctr[AES_BLOCK_SIZE];
+    struct iovec piov;
+    int i, len = iov_len(ct, nct);
+
+    siv_aes_ctrv(ctx, ct, nct, p, counter);
+    if (p != NULL) {
+        piov.iov_base = p;
+        piov.iov_len = len;
+        s2v_finalv(ctx, &piov, 1, len, ctr);
+    } else {
+        s2v_finalv(ctx, ct, nct, len, ctr);
+    }
+    siv_done(ctx);
+    if (memcmp(ctr, counter, AES_BLOCK_SIZE)) {
+        if (p != NULL) {
+            memset(p, 0, len);
+        } else {
+            for (i = 0; i < nct; i++) {
+                memset(ct[i].iov_base, 0, ct[i].iov_len);
             }
-            c[i+j] = p[i+j] ^ ecr[j];
         }
-        inc++; inc &= 0xffffffff;
-        PUTU32(ctr + 12, inc);
+        return -1;      /* FAIL */
     }
+    return 1;
 }
 
 /*
@@ -428,8 +616,11 @@ siv_encrypt (siv_ctx *ctx, const unsigned char *p, unsigned char *c,
     va_list ap;
     unsigned char *ad;
     int adlen, numad = nad;
-    unsigned char ctr[AES_BLOCK_SIZE];
+    struct iovec iov;
 
+    if (key_siv(ctx) < 0) {
+        return -1;
+    }
     if (numad) {
         va_start(ap, nad);
         while (numad) {
@@ -438,16 +629,11 @@ siv_encrypt (siv_ctx *ctx, const unsigned char *p, unsigned char *c,
             s2v_update(ctx, ad, adlen);
             numad--;
         }
+        va_end(ap);
     }
-    s2v_final(ctx, p, len, ctr);
-    memcpy(counter, ctr, AES_BLOCK_SIZE);
-    siv_aes_ctr(ctx, p, len, c, ctr);
-    /*
-     * the only part of the context that is carried along with 
-     * subsequent calls to siv_encrypt() are the keys, so reset
-     * everything else.
-     */
-    siv_restart(ctx);
+    iov.iov_base = (void *)p;
+    iov.iov_len = len;
+    siv_seal(ctx, &iov, 1, c, counter);
     return 1;
 }
 
@@ -467,10 +653,11 @@ siv_decrypt (siv_ctx *ctx, const unsigned char *c, unsigned char *p,
     va_list ap;
     unsigned char *ad;
     int adlen, numad = nad;
-    unsigned char ctr[AES_BLOCK_SIZE];
+    struct iovec iov;
 
-    memcpy(ctr, counter, AES_BLOCK_SIZE);
-    siv_aes_ctr(ctx, c, len, p, ctr);
+    if (key_siv(ctx) < 0) {
+        return -1;
+    }
     if (numad) {
         va_start(ap, nad);
         while (numad) {
@@ -479,19 +666,53 @@ siv_decrypt (siv_ctx *ctx, const unsigned char *c, unsigned char *p,
             s2v_update(ctx, ad, adlen);
             numad--;
         }
+        va_end(ap);
     }
-    s2v_final(ctx, p, len, ctr);
+    iov.iov_base = (void *)c;
+    iov.iov_len = len;
+    return siv_open(ctx, &iov, 1, p, counter);
+}
 
-    /*
-     * the only part of the context that is carried along with 
-     * subsequent calls to siv_decrypt() are the keys, so reset
-     * everything else.
-     */
-    siv_restart(ctx);
-    if (memcmp(ctr, counter, AES_BLOCK_SIZE)) {
-        memset(p, 0, len);
-        return -1;      /* FAIL */
-    } else {
-        return 1;
+/*
+ * siv_encryptv()
+ *      siv_encrypt() with the AD and the plaintext in iovecs, each AD
+ *      iovec is a separate string to S2V. If c is NULL the plaintext
+ *      is encrypted where it lies, otherwise the ciphertext is put,
+ *      contiguous, in c.
+ */
+int
+siv_encryptv (siv_ctx *ctx, const struct iovec *ad, int nad,
+              const struct iovec *pt, int npt, unsigned char *c, unsigned char *counter)
+{
+    int i;
+
+    if (key_siv(ctx) < 0) {
+        return -1;
+    }
+    for (i = 0; i < nad; i++) {
+        s2v_update(ctx, ad[i].iov_base, ad[i].iov_len);
+    }
+    siv_seal(ctx, pt, npt, c, counter);
+    return 1;
+}
+
+/*
+ * siv_decryptv()
+ *      siv_decrypt() with the AD and the ciphertext in iovecs. If p
+ *      is NULL the ciphertext is decrypted where it lies, otherwise
+ *      the plaintext is put, contiguous, in p.
+ */
+int
+siv_decryptv (siv_ctx *ctx, const struct iovec *ad, int nad,
+              const struct iovec *ct, int nct, unsigned char *p, unsigned char *counter)
+{
+    int i;
+
+    if (key_siv(ctx) < 0) {
+        return -1;
+    }
+    for (i = 0; i < nad; i++) {
+        s2v_update(ctx, ad[i].iov_base, ad[i].iov_len);
     }
+    return siv_open(ctx, ct, nct, p, counter);
 }
@@ -38,6 +38,7 @@
 #ifndef _SIV_H_
 #define _SIV_H_
 
+#include <sys/uio.h>
 #include <openssl/aes.h>
 
 /*
@@ -64,8 +65,10 @@ typedef struct _siv_ctx {
     unsigned char K2[AES_BLOCK_SIZE];
     unsigned char T[AES_BLOCK_SIZE];
     unsigned char benchmark[AES_BLOCK_SIZE];
-    AES_KEY ctr_sched;
-    AES_KEY s2v_sched;
+    int benchmarked;
+    unsigned char ctr_key[32];
+    unsigned char s2v_key[32];
+    int keybits;
 } siv_ctx;
 
 #define AES_128_BYTES	16
@@ -79,9 +82,7 @@ typedef struct _siv_ctx {
  * non-exported APIs needed for a more full-throated SIV implementation
 void aes_cmac (siv_ctx *, const unsigned char *, int, unsigned char *);
 void siv_reset(siv_ctx *);
-void s2v_benchmark(siv_ctx *);
 void s2v_add(siv_ctx *, const unsigned char *);
-void s2v_update(siv_ctx *, const unsigned char *, int);
 int s2v_final(siv_ctx *, const unsigned char *, int, unsigned char *);
 void siv_restart(siv_ctx *);
 void siv_aes_ctr(siv_ctx *, const unsigned char *, const int, unsigned char *, 
@@ -96,5 +97,16 @@ int siv_encrypt(siv_ctx *, const unsigned char *, unsigned char *,
                 const int, unsigned char *, const int, ... );
 int siv_decrypt(siv_ctx *, const unsigned char *, unsigned char *,
                 const int, unsigned char *, const int, ... );
+int siv_encryptv(siv_ctx *, const struct iovec *, int, const struct iovec *, int,
+                 unsigned char *, unsigned char *);
+int siv_decryptv(siv_ctx *, const struct iovec *, int, const struct iovec *, int,
+                 unsigned char *, unsigned char *);
+/*
+ * for a fixed AD prefix: s2v_update() it, s2v_benchmark(), and then
+ * each encryption/decryption starts from there instead of scratch
+ */
+void s2v_update(siv_ctx *, const unsigned char *, int);
+void s2v_benchmark(siv_ctx *);
+void s2v_reset(siv_ctx *);
 
 #endif /* _SIV_H_ */
@@ -0,0 +1,399 @@
+/*
+ * (c) Copyright 2016-2020 Hewlett Packard Enterprise Development LP
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+#include "service.h"
+#include "hkdf.h"
+#include "bskeys.h"
+
+#define BSKEY_BUCKETS   4096            /* power of 2 */
+#define BSKEY_LINE      2048
+
+static char bsfile[80];
+static struct bskey *by_idx[BSKEY_BUCKETS];
+static struct bskey *by_hash[BSKEY_BUCKETS];
+static struct bskey *by_chirp[BSKEY_BUCKETS];
+static int nkeys = 0, maxidx = 0;
+static off_t consumed = 0;      /* how much of the file is in the tables */
+static int watchfd = -1, watch = -1;
+
+static unsigned int
+hash_bucket (unsigned char *hash)
+{
+    /*
+     * it's a SHA256, any 4 octets will do
+     */
+    return ((hash[0] << 24) | (hash[1] << 16) | (hash[2] << 8) | hash[3]) & (BSKEY_BUCKETS - 1);
+}
+
+static void
+flush_keys (void)
+{
+    struct bskey *bk, *next;
+    int i;
+
+    for (i = 0; i < BSKEY_BUCKETS; i++) {
+        for (bk = by_idx[i]; bk != NULL; bk = next) {
+            next = bk->next_idx;
+            if (bk->key != NULL) {
+                EC_KEY_free(bk->key);
+            }
+            free(bk->b64);
+            free(bk);
+        }
+        by_idx[i] = by_hash[i] = by_chirp[i] = NULL;
+    }
+    nkeys = maxidx = 0;
+    consumed = 0;
+}
+
+/*
+ * parse one line of the bootstrapping file and put it in the tables
+ */
+static int
+add_line (char *line)
+{
+    struct bskey *bk;
+    char mac[20], b64[1024];
+    unsigned char der[1024];
+    unsigned int mdlen = SHA256_DIGEST_LENGTH;
+    int idx, opclass, channel, derlen, pad, i, ok;
+    EVP_MD_CTX *mdctx;
+
+    if (sscanf(line, "%d %d %d %19s %1023s", &idx, &opclass, &channel, mac, b64) != 5) {
+        return -1;
+    }
+    if ((bk = (struct bskey *)malloc(sizeof(struct bskey))) == NULL) {
+        return -1;
+    }
+    memset(bk, 0, sizeof(struct bskey));
+    bk->idx = idx;
+    bk->opclass = opclass;
+    bk->channel = channel;
+    for (i = 0; i < 6; i++) {
+        if ((strlen(mac) != 12) || (sscanf(&mac[i*2], "%2hhx", &bk->mac[i]) != 1)) {
+            fprintf(stderr, "bad MAC address %s for key %d\n", mac, idx);
+            memset(bk->mac, 0xff, 6);
+            break;
+        }
+    }
+    /*
+     * EVP_DecodeBlock() doesn't account for the padding, take it off
+     */
+    if ((derlen = EVP_DecodeBlock(der, (unsigned char *)b64, strlen(b64))) < 0) {
+        fprintf(stderr, "bad bootstrapping key %d\n", idx);
+        free(bk);
+        return -1;
+    }
+    for (pad = strlen(b64); (pad > 0) && (b64[pad-1] == '='); pad--) {
+        derlen--;
+    }
+    if (!EVP_Digest(der, derlen, bk->hash, &mdlen, EVP_sha256(), NULL) ||
+        ((mdctx = scratch_md_ctx()) == NULL)) {
+        free(bk);
+        return -1;
+    }
+    /*
+     * work out what this peer will chirp now, not when it chirps
+     */
+    ok = EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL) &&
+        EVP_DigestUpdate(mdctx, "chirp", strlen("chirp")) &&
+        EVP_DigestUpdate(mdctx, der, derlen) &&
+        EVP_DigestFinal_ex(mdctx, bk->chirp, &mdlen);
+    if (!ok || ((bk->b64 = strdup(b64)) == NULL)) {
+        free(bk);
+        return -1;
+    }
+
+    bk->next_idx = by_idx[idx & (BSKEY_BUCKETS - 1)];
+    by_idx[idx & (BSKEY_BUCKETS - 1)] = bk;
+    bk->next_hash = by_hash[hash_bucket(bk->hash)];
+    by_hash[hash_bucket(bk->hash)] = bk;
+    bk->next_chirp = by_chirp[hash_bucket(bk->chirp)];
+    by_chirp[hash_bucket(bk->chirp)] = bk;
+    if (idx > maxidx) {
+        maxidx = idx;
+    }
+    nkeys++;
+    return idx;
+}
+
+/*
+ * read whatever has been added to the file since last time. A line
+ * that's still being written (no newline yet) is left for next time, a
+ * line too long to be a key is skipped. If the file got shorter it was
+ * rewritten so start over.
+ */
+void
+bskeys_refresh (void)
+{
+    FILE *fp;
+    struct stat st;
+    char line[BSKEY_LINE];
+    int len, skip;
+
+    if ((fp = fopen(bsfile, "r")) == NULL) {
+        return;
+    }
+    if (fstat(fileno(fp), &st) < 0) {
+        fclose(fp);
+        return;
+    }
+    if (st.st_size < consumed) {
+        printf("%s has been rewritten, reloading\n", bsfile);
+        flush_keys();
+    }
+    if ((st.st_size == consumed) || (fseeko(fp, consumed, SEEK_SET) < 0)) {
+        fclose(fp);
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        len = strlen(line);
+        if (line[len-1] == '\n') {
+            consumed += len;
+            (void)add_line(line);
+            continue;
+        }
+        if (len < (int)sizeof(line) - 1) {
+            break;
+        }
+        /*
+         * fgets() filled the buffer, go find the end of the line
+         */
+        skip = len;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            len = strlen(line);
+            skip += len;
+            if (line[len-1] == '\n') {
+                break;
+            }
+        }
+        if (line[len-1] != '\n') {
+            break;
+        }
+        fprintf(stderr, "skipping %d character line in %s\n", skip, bsfile);
+        consumed += skip;
+    }
+    fclose(fp);
+}
+
+#ifdef __linux__
+static void
+watch_file (void)
+{
+    if ((watch = inotify_add_watch(watchfd, bsfile,
+                                   IN_MODIFY|IN_CLOSE_WRITE|IN_DELETE_SELF|IN_MOVE_SELF)) < 0) {
+        perror("inotify_add_watch");
+    }
+}
+
+static void
+bskeys_changed (int fd, void *data)
+{
+    char buf[4096];
+    struct inotify_event *ev;
+    int len, off, replaced = 0;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < len; off += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)&buf[off];
+            if ((ev->wd == watch) && (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED))) {
+                replaced = 1;
+            }
+        }
+    }
+    if (replaced) {
+        /*
+         * the file was replaced (editors do that), watch the new one and
+         * read it from the beginning
+         */
+        inotify_rm_watch(fd, watch);
+        flush_keys();
+        watch_file();
+    }
+    bskeys_refresh();
+}
+#endif  /* __linux__ */
+
+/*
+ * lookups refresh the tables themselves when there's no one telling us
+ * the file changed
+ */
+static void
+check_file (void)
+{
+    if (watch < 0) {
+        bskeys_refresh();
+    }
+}
+
+struct bskey *
+bskeys_by_index (int idx)
+{
+    struct bskey *bk;
+
+    check_file();
+    for (bk = by_idx[idx & (BSKEY_BUCKETS - 1)]; bk != NULL; bk = bk->next_idx) {
+        if (bk->idx == idx) {
+            break;
+        }
+    }
+    return bk;
+}
+
+struct bskey *
+bskeys_by_hash (unsigned char *hash)
+{
+    struct bskey *bk;
+
+    check_file();
+    for (bk = by_hash[hash_bucket(hash)]; bk != NULL; bk = bk->next_hash) {
+        if (memcmp(bk->hash, hash, SHA256_DIGEST_LENGTH) == 0) {
+            break;
+        }
+    }
+    return bk;
+}
+
+/*
+ * who, if anyone, sent this chirp?
+ */
+struct bskey *
+bskeys_by_chirp (unsigned char *hash)
+{
+    struct bskey *bk;
+
+    check_file();
+    for (bk = by_chirp[hash_bucket(hash)]; bk != NULL; bk = bk->next_chirp) {
+        if (memcmp(bk->chirp, hash, SHA256_DIGEST_LENGTH) == 0) {
+            break;
+        }
+    }
+    return bk;
+}
+
+EC_KEY *
+bskeys_ec_key (struct bskey *bk)
+{
+    unsigned char der[1024];
+    const unsigned char *ptr;
+    int derlen;
+
+    if (bk->key == NULL) {
+        if ((derlen = EVP_DecodeBlock(der, (unsigned char *)bk->b64, strlen(bk->b64))) < 0) {
+            return NULL;
+        }
+        ptr = der;
+        if ((bk->key = d2i_EC_PUBKEY(NULL, &ptr, derlen)) == NULL) {
+            return NULL;
+        }
+        /*
+         * peers share this key so set it up the way DPP wants it once
+         */
+        EC_KEY_set_conv_form(bk->key, POINT_CONVERSION_COMPRESSED);
+        EC_KEY_set_asn1_flag(bk->key, OPENSSL_EC_NAMED_CURVE);
+    }
+    return bk->key;
+}
+
+/*
+ * append a new key to the file with the next index and return that index
+ */
+int
+bskeys_add (int opclass, int channel, unsigned char *mac, char *b64)
+{
+    FILE *fp;
+    int idx;
+
+    bskeys_refresh();
+    if ((fp = fopen(bsfile, "a")) == NULL) {
+        fprintf(stderr, "unable to open %s to add bootstrapping key\n", bsfile);
+        return -1;
+    }
+    idx = maxidx + 1;
+    fprintf(fp, "%d %d %d %02x%02x%02x%02x%02x%02x %s\n", idx, opclass, channel,
+            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], b64);
+    fclose(fp);
+    /*
+     * don't wait for inotify, the caller may want it right now
+     */
+    bskeys_refresh();
+    return idx;
+}
+
+int
+bskeys_count (void)
+{
+    return nkeys;
+}
+
+int
+bskeys_load (char *file, service_context srvctx)
+{
+    if (strlen(file) >= sizeof(bsfile)) {
+        return -1;
+    }
+    strcpy(bsfile, file);
+    flush_keys();
+    if (access(bsfile, R_OK) < 0) {
+        fprintf(stderr, "unable to read bootstrapping file %s\n", bsfile);
+        return -1;
+    }
+    bskeys_refresh();
+#ifdef __linux__
+    if (watchfd < 0) {
+        if ((watchfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0) {
+            perror("inotify_init");
+        } else {
+            srv_add_input(srvctx, watchfd, NULL, bskeys_changed);
+        }
+    } else if (watch >= 0) {
+        inotify_rm_watch(watchfd, watch);
+    }
+    if (watchfd >= 0) {
+        watch_file();
+    }
+#endif  /* __linux__ */
+    printf("%d bootstrapping keys in %s\n", nkeys, bsfile);
+    return nkeys;
+}
@@ -0,0 +1,72 @@
+/*
+ * (c) Copyright 2016-2020 Hewlett Packard Enterprise Development LP
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _BSKEYS_H_
+#define _BSKEYS_H_
+
+#include <openssl/ec.h>
+#include <openssl/sha.h>
+#include "service.h"
+
+/*
+ * the bootstrapping key file is lines of
+ *
+ *      index opclass channel macaddr base64-DER-of-key
+ *
+ * it's read once into memory and indexed by index, the SHA256 of the
+ * DER of the key, and the chirp hash (the SHA256 with "chirp" in
+ * front). Lines appended to the file after that are picked up as
+ * they're written.
+ */
+struct bskey {
+    struct bskey *next_idx;
+    struct bskey *next_hash;
+    struct bskey *next_chirp;
+    int idx;
+    int opclass;
+    int channel;
+    unsigned char mac[6];
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    unsigned char chirp[SHA256_DIGEST_LENGTH];
+    char *b64;                  /* as it is in the file */
+    EC_KEY *key;                /* decoded on first use, see bskeys_ec_key() */
+};
+
+int bskeys_load (char *file, service_context srvctx);
+void bskeys_refresh (void);
+struct bskey *bskeys_by_index (int idx);
+struct bskey *bskeys_by_hash (unsigned char *hash);
+struct bskey *bskeys_by_chirp (unsigned char *hash);
+EC_KEY *bskeys_ec_key (struct bskey *bk);
+int bskeys_add (int opclass, int channel, unsigned char *mac, char *b64);
+int bskeys_count (void);
+
+#endif  /* _BSKEYS_H_ */
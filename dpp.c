@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/types.h>
@@ -114,15 +115,20 @@
 #define P521_COORD_LEN          66
 
 /*
- * a list of BSSIDs and frequencies to chirp on
+ * a list of BSSIDs and frequencies to chirp on, each round goes through
+ * them in order of how often a configurator has answered there
  */
 struct chirpdest {
     TAILQ_ENTRY(chirpdest) entry;
     char bssid[ETH_ALEN];
     unsigned long freq;
+    unsigned int answers;
 };
 TAILQ_HEAD(fubar, chirpdest) chirpdests;
 
+#define CHIRP_DWELL             5       /* seconds spent on each channel */
+#define CHIRP_MAX_CHANNELS      64
+
 struct cpolicy {
     TAILQ_ENTRY(cpolicy) entry;
     char akm[10];        // "psk" or "sae" or "dpp"
@@ -137,6 +143,8 @@ struct candidate {
     unsigned char version;
 
     struct chirpdest *chirpto;
+    unsigned long chirpfreq;            /* where the last chirp went */
+    int chirpround;                     /* rounds without an answer */
     EC_KEY *peer_bootstrap;
     /*
      * DPP auth stuff
@@ -144,6 +152,8 @@ struct candidate {
     EC_KEY *my_proto;
     EC_POINT *peer_proto;
     unsigned char dialog_token;
+    unsigned long poolgets;     /* scratch point counts when we started */
+    unsigned long poolallocs;
     timerid t0;                           
 #define DPP_FAILED              0
 #define DPP_NOTHING             5
@@ -206,9 +216,21 @@ struct candidate {
 static EC_KEY *netaccesskey;
 static char *connector = NULL;
 static int connector_len = 0;
-static unsigned char discovery_transaction = 0;
+static unsigned char discovery_transaction = 0;        /* last one handed out */
 static EC_KEY *configurator_signkey;   /* we're an enrollee, this isn't ours */
 static unsigned char csign_kid[KID_LENGTH];
+/*
+ * the key type the configurator's CSR Attributes asked for last time,
+ * remembered next to our keyfile so a CSR keypair can be generated
+ * while there's no DPP exchange going on
+ */
+#define CSRKEY_HINT_FILE        "csrkey.hint"
+static char csrkey_hint_file[256];
+static int csrkey_hint_nid = -1;        /* -1: not read yet, 0: none */
+static int csrkey_hint_bits = 0;
+static EVP_PKEY *spare_csrkey = NULL;
+static int spare_csrkey_nid, spare_csrkey_bits;
+static timerid spare_csrkey_timer = 0;
 
 /*
  * our instance of DPP
@@ -228,6 +250,7 @@ struct _dpp_instance {
     int group_num;              /* these are handy to keep around */
     int primelen;               /* and not have to continually */
     int digestlen;              /* compute them from "bootstrap" */
+    int sivmode;                /* SIV key size that goes with digestlen */
     unsigned short newgroup;    /* 0 if not needed, NID of curve otherwise */
     EC_KEY *Pc;                 /* configurator's new protocol key (reused) */
     int noncelen;
@@ -256,9 +279,10 @@ typedef struct setval_t {
 } setval;
 
 /*
- * forward reference
+ * forward references
  */
 static void start_dpp_chirp (timerid id, void *data);
+static void schedule_csr_keygen (void);
 /*
  * global variables
  */
@@ -267,8 +291,15 @@ extern service_context srvctx;
 static dpp_handle next_handle = 0;
 static int dpp_initialized = 0;
 static BN_CTX *bnctx = NULL;
+static struct point_pool *ppool = NULL;
+static EC_GROUP *dppgroup = NULL;       /* precomputed, for our keys... */
+static EC_GROUP *newdppgroup = NULL;    /* ...and for a new group's keys */
 static int debug = 0;
 static int do_chirp;
+static int nchirpdests = 0;
+static unsigned char chirp_hash[SHA256_DIGEST_LENGTH];
+static char chirp_history[80];
+static int chirp_backoff_min = 10, chirp_backoff_max = 120;
 
 static unsigned char wfa_dpp[4] = { 0x50, 0x6f, 0x9a, 0x1a };
 static unsigned char dpp_proto_elem_req[3] = { 0x6c, 0x08, 0x00 };
@@ -475,40 +506,58 @@ prime_len_by_curve (int groupnum)
     return len;
 }
 
-EC_KEY *generate_new_protocol_key (unsigned short group)
+static int
+nid_by_group (unsigned short group)
 {
-    EC_KEY *newkey = NULL;
-
     switch (group) {
         case 19:
-            newkey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
-            break;
+            return NID_X9_62_prime256v1;
         case 20:
-            newkey = EC_KEY_new_by_curve_name(NID_secp384r1);
-            break;
+            return NID_secp384r1;
         case 21:
-            newkey = EC_KEY_new_by_curve_name(NID_secp521r1);
-            break;
+            return NID_secp521r1;
         case 25:
-            newkey = EC_KEY_new_by_curve_name(NID_X9_62_prime192v1);
-            break;
+            return NID_X9_62_prime192v1;
         case 26:
-            newkey = EC_KEY_new_by_curve_name(NID_secp224r1);
-            break;
+            return NID_secp224r1;
 #ifdef HAS_BRAINPOOL
         case 28:
-            newkey = EC_KEY_new_by_curve_name(NID_brainpoolP256r1);
-            break;
+            return NID_brainpoolP256r1;
         case 29:
-            newkey = EC_KEY_new_by_curve_name(NID_brainpoolP384r1);
-            break;
+            return NID_brainpoolP384r1;
         case 30:
-            newkey = EC_KEY_new_by_curve_name(NID_brainpoolP512r1);
-            break;
+            return NID_brainpoolP512r1;
 #endif  /* HAS_BRAINPOOL */
         default:
             break;
     }
+    return NID_undef;
+}
+
+/*
+ * new (empty) key on a curve, use one of the groups built at init time
+ * if it's the right curve
+ */
+static EC_KEY *
+new_dpp_key (int nid)
+{
+    if ((dppgroup != NULL) && (EC_GROUP_get_curve_name(dppgroup) == nid)) {
+        return new_key_on_group(dppgroup);
+    }
+    if ((newdppgroup != NULL) && (EC_GROUP_get_curve_name(newdppgroup) == nid)) {
+        return new_key_on_group(newdppgroup);
+    }
+    return EC_KEY_new_by_curve_name(nid);
+}
+
+EC_KEY *generate_new_protocol_key (unsigned short group)
+{
+    EC_KEY *newkey = NULL;
+    int nid;
+
+    if ((nid = nid_by_group(group)) != NID_undef) {
+        newkey = new_dpp_key(nid);
+    }
     if (newkey != NULL) {
         if (!EC_KEY_generate_key(newkey)) {
             dpp_debug(DPP_DEBUG_ERR, "cannot create new protocol key\n");
@@ -573,48 +622,148 @@ static void ieeeize_ntoh_attributes (unsigned char *attributes, int len)
     }
 }
 
+/*
+ * the SHA256 of the DER of a bootstrapping key, optionally prefixed
+ * by a string (a chirp is the hash with "chirp" in front)
+ */
 static int
-compute_bootstrap_key_hash (EC_KEY *key, unsigned char *digest)
+hash_bootstrap_key (EC_KEY *key, const char *prefix, unsigned char *digest)
 {
     int asn1len;
-    BIO *bio;
     EVP_MD_CTX *mdctx;
     unsigned int mdlen = SHA256_DIGEST_LENGTH;
-    unsigned char *asn1;
+    unsigned char asn1[256], *ptr;
 
     memset(digest, 0, SHA256_DIGEST_LENGTH);
 
-    if ((bio = BIO_new(BIO_s_mem())) == NULL) {
+    /*
+     * the DER of the largest public key we support is well under
+     * sizeof(asn1), check the length before encoding anyway
+     */
+    if (((asn1len = i2d_EC_PUBKEY(key, NULL)) < 1) || (asn1len > (int)sizeof(asn1))) {
         return -1;
     }
-    if ((mdctx = EVP_MD_CTX_new()) == NULL) {
-        BIO_free(bio);
+    ptr = asn1;
+    (void)i2d_EC_PUBKEY(key, &ptr);
+
+    if ((mdctx = scratch_md_ctx()) == NULL) {
         return -1;
     }
-    (void)i2d_EC_PUBKEY_bio(bio, key);
-    (void)BIO_flush(bio);
-    asn1len = BIO_get_mem_data(bio, &asn1);
-
-    EVP_DigestInit(mdctx, EVP_sha256());
+    EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
+    if (prefix != NULL) {
+        EVP_DigestUpdate(mdctx, prefix, strlen(prefix));
+    }
     EVP_DigestUpdate(mdctx, asn1, asn1len);
-    EVP_DigestFinal(mdctx, digest, &mdlen);
+    EVP_DigestFinal_ex(mdctx, digest, &mdlen);
 
-    BIO_free(bio);
-    EVP_MD_CTX_free(mdctx);
     return mdlen;
 }
 
+static int
+compute_bootstrap_key_hash (EC_KEY *key, unsigned char *digest)
+{
+    return hash_bootstrap_key(key, NULL, digest);
+}
+
+/*
+ * put the channels where configurators have answered first, keeping the
+ * order they were added in otherwise
+ */
+static void
+order_chirp_list (void)
+{
+    struct chirpdest *list[CHIRP_MAX_CHANNELS], *chirpto;
+    int i, j, n = 0;
+
+    TAILQ_FOREACH(chirpto, &chirpdests, entry) {
+        list[n++] = chirpto;
+    }
+    for (i = 1; i < n; i++) {
+        chirpto = list[i];
+        for (j = i; (j > 0) && (list[j-1]->answers < chirpto->answers); j--) {
+            list[j] = list[j-1];
+        }
+        list[j] = chirpto;
+    }
+    for (i = 0; i < n; i++) {
+        TAILQ_REMOVE(&chirpdests, list[i], entry);
+        TAILQ_INSERT_TAIL(&chirpdests, list[i], entry);
+    }
+}
+
+static void
+save_chirp_history (void)
+{
+    struct chirpdest *chirpto;
+    FILE *fp;
+
+    if ((chirp_history[0] == 0) || ((fp = fopen(chirp_history, "w")) == NULL)) {
+        return;
+    }
+    TAILQ_FOREACH(chirpto, &chirpdests, entry) {
+        if (chirpto->answers) {
+            fprintf(fp, "%ld %u\n", chirpto->freq, chirpto->answers);
+        }
+    }
+    fclose(fp);
+}
+
+static void
+chirp_answered (unsigned long freq)
+{
+    struct chirpdest *chirpto;
+
+    TAILQ_FOREACH(chirpto, &chirpdests, entry) {
+        if (chirpto->freq == freq) {
+            chirpto->answers++;
+            dpp_debug(DPP_DEBUG_TRACE, "configurator answered a chirp on %ld (%d times)\n",
+                      freq, chirpto->answers);
+            break;
+        }
+    }
+    save_chirp_history();
+}
+
+/*
+ * how long to wait before going through the chirp list again: double it
+ * every unanswered round up to the max, then pick something between half
+ * of that and all of it so enrollees that started together drift apart
+ */
+static unsigned long
+chirp_backoff (struct candidate *peer)
+{
+    unsigned long wait;
+    unsigned int r;
+    int i;
+
+    wait = chirp_backoff_min * 1000;
+    for (i = 0; (i < peer->chirpround) && (wait < (chirp_backoff_max * 1000)); i++) {
+        wait *= 2;
+    }
+    if (wait > (chirp_backoff_max * 1000)) {
+        wait = chirp_backoff_max * 1000;
+    }
+    if (!RAND_bytes((unsigned char *)&r, sizeof(r))) {
+        r = 0;
+    }
+    peer->chirpround++;
+    return (wait/2) + (r % ((wait/2) + 1));
+}
+
 static void
 next_dpp_chirp (timerid id, void *data)
 {
     struct candidate *peer = (struct candidate *)data;
 
+    unsigned long wait;
+
     if (peer->chirpto == NULL) {
         /*
-         * we ran through the chirp list so wait 30s and do it all over again
+         * we ran through the chirp list so back off and do it all over again
          */
-        dpp_debug(DPP_DEBUG_TRACE, "exhausted chirp list, wait a bit and try again\n");
-        peer->t0 = srv_add_timeout(srvctx, SRV_SEC(30), start_dpp_chirp, peer);
+        wait = chirp_backoff(peer);
+        dpp_debug(DPP_DEBUG_TRACE, "exhausted chirp list, try again in %ldms\n", wait);
+        peer->t0 = srv_add_timeout(srvctx, SRV_MSEC(wait), start_dpp_chirp, peer);
         return;
     }
     /*
@@ -626,11 +775,12 @@ next_dpp_chirp (timerid id, void *data)
     if (send_dpp_action_frame(peer)) {
         dpp_debug(DPP_DEBUG_PROTOCOL_MSG, "chirp on %ld...\n", peer->chirpto->freq);
     }
+    peer->chirpfreq = peer->chirpto->freq;
     /*
      * next!
      */
     peer->chirpto = TAILQ_NEXT(peer->chirpto, entry);
-    peer->t0 = srv_add_timeout(srvctx, SRV_SEC(5), next_dpp_chirp, peer);
+    peer->t0 = srv_add_timeout(srvctx, SRV_SEC(CHIRP_DWELL), next_dpp_chirp, peer);
     return;
 }
 
@@ -638,58 +788,38 @@ static void
 start_dpp_chirp (timerid id, void *data)
 {
     struct candidate *peer = (struct candidate *)data;
-    unsigned char bootkeyhash[SHA256_DIGEST_LENGTH], *asn1;
     TLV *tlv;
-    int asn1len;
-    BIO *bio;
-    EVP_MD_CTX *mdctx;
-    unsigned int mdlen = SHA256_DIGEST_LENGTH;
     
     memset(peer->buffer, 0, sizeof(peer->buffer));
-    memset(bootkeyhash, 0, SHA256_DIGEST_LENGTH);
     peer->bufferlen = 0;
     tlv = (TLV *)peer->buffer;
 
-    if ((bio = BIO_new(BIO_s_mem())) == NULL) {
-        goto fin;
-    }
-    if ((mdctx = EVP_MD_CTX_new()) == NULL) {
-        BIO_free(bio);
-        goto fin;
-    }
-    (void)i2d_EC_PUBKEY_bio(bio, dpp_instance.bootstrap);
-    (void)BIO_flush(bio);
-    asn1len = BIO_get_mem_data(bio, &asn1);
-
     /*
-     * the entirety of the chirp is a hash of "chirp" and our bootstrapping key
+     * the entirety of the chirp is a hash of "chirp" and our bootstrapping
+     * key, which was computed when we started
      */
-    EVP_DigestInit(mdctx, EVP_sha256());
-    EVP_DigestUpdate(mdctx, "chirp", strlen("chirp"));
-    EVP_DigestUpdate(mdctx, asn1, asn1len);
-    EVP_DigestFinal(mdctx, bootkeyhash, &mdlen);
-
-    BIO_free(bio);
-    EVP_MD_CTX_free(mdctx);
-
-    tlv = TLV_set_tlv(tlv, RESPONDER_BOOT_HASH, SHA256_DIGEST_LENGTH, bootkeyhash);
+    tlv = TLV_set_tlv(tlv, RESPONDER_BOOT_HASH, SHA256_DIGEST_LENGTH, chirp_hash);
     ieeeize_hton_attributes(peer->buffer, (int)((unsigned char *)tlv - peer->buffer));
 
     setup_dpp_action_frame(peer, DPP_CHIRP);
     peer->bufferlen = (int)((unsigned char *)tlv - peer->buffer);
-    peer->chirpto = TAILQ_FIRST(&chirpdests);
+    order_chirp_list();
+    if ((peer->chirpto = TAILQ_FIRST(&chirpdests)) == NULL) {
+        dpp_debug(DPP_DEBUG_ERR, "nowhere to chirp!\n");
+        return;
+    }
     if (change_dpp_freq(peer->handle, peer->chirpto->freq) < 1) {
         dpp_debug(DPP_DEBUG_ERR, "can't change channel to chirp!\n");
     }
     if (send_dpp_action_frame(peer)) {
         dpp_debug(DPP_DEBUG_PROTOCOL_MSG, "chirp on %ld...\n", peer->chirpto->freq);
     }
-fin:
+    peer->chirpfreq = peer->chirpto->freq;
     /*
      * keep chirping, when we get a response we'll stop
      */
     peer->chirpto = TAILQ_NEXT(peer->chirpto, entry);
-    peer->t0 = srv_add_timeout(srvctx, SRV_SEC(5), next_dpp_chirp, peer);
+    peer->t0 = srv_add_timeout(srvctx, SRV_SEC(CHIRP_DWELL), next_dpp_chirp, peer);
     return;
 }
 
@@ -705,8 +835,12 @@ static void
 destroy_peer (timerid id, void *data)
 {
     struct candidate *peer = (struct candidate *)data;
+    unsigned long gets, allocs;
 
     srv_rem_timeout(srvctx, peer->t0);
+    point_pool_stats(ppool, &gets, &allocs);
+    dpp_debug(DPP_DEBUG_CRYPTO, "peer %d used %lu scratch points, %lu needed allocation\n",
+              peer->handle, gets - peer->poolgets, allocs - peer->poolallocs);
     if (peer->my_proto != NULL) {
         EC_KEY_free(peer->my_proto);
     }
@@ -734,6 +868,10 @@ destroy_peer (timerid id, void *data)
     memset(peer->buffer, 0, 8192);
     TAILQ_REMOVE(&dpp_instance.peers, peer, entry);
     free(peer);
+    /*
+     * the exchange is over, get a CSR keypair ready for the next one
+     */
+    schedule_csr_keygen();
     return;
 }
 
@@ -995,25 +1133,159 @@ send_dpp_discovery_frame (unsigned char frametype, unsigned char status,
     return transmit_discovery_frame(transaction_id, framebuf, bufferlen + sizeof(dpp_action_frame));
 }
 
+/*
+ * each DPP Discovery exchange gets its own transaction. The transaction ID
+ * indexes right into the table so there's no searching, and a transaction
+ * that doesn't finish gets reclaimed by a timer
+ */
+#define DISCOVERY_TIMEOUT       10      /* seconds */
+
+struct discovery {
+    unsigned char tid;
+#define DISC_FREE               0
+#define DISC_ALLOCATED          1       /* waiting for a request, or to send one */
+#define DISC_REQ_SENT           2       /* waiting for a response */
+    unsigned char state;
+    timerid t0;
+};
+static struct discovery discoveries[256];
+
+static void
+end_discovery (unsigned char tid)
+{
+    struct discovery *disc = &discoveries[tid];
+
+    srv_rem_timeout(srvctx, disc->t0);
+    disc->t0 = 0;
+    disc->state = DISC_FREE;
+}
+
+static void
+discovery_timeout (timerid id, void *data)
+{
+    struct discovery *disc = (struct discovery *)data;
+
+    dpp_debug(DPP_DEBUG_PROTOCOL_MSG, "DPP Discovery transaction %d timed out\n", disc->tid);
+    disc->t0 = 0;
+    disc->state = DISC_FREE;
+}
+
 int
 dpp_begin_discovery (unsigned char transaction_id)
 {
+    struct discovery *disc = &discoveries[transaction_id];
+
     dpp_debug(DPP_DEBUG_TRACE, "initiate DPP discovery...\n");
 
     if ((connector == NULL) || (connector_len < 1)) {
         dpp_debug(DPP_DEBUG_ERR, "don't have a connector for peer with tid %d\n", transaction_id);
         return -1;
     }
+    if (disc->state == DISC_FREE) {
+        dpp_debug(DPP_DEBUG_ERR, "no DPP Discovery transaction %d\n", transaction_id);
+        return -1;
+    }
 
     send_dpp_discovery_frame (DPP_SUB_PEER_DISCOVER_REQ, STATUS_OK, transaction_id, transaction_id);
+    disc->state = DISC_REQ_SENT;
+    srv_rem_timeout(srvctx, disc->t0);
+    disc->t0 = srv_add_timeout(srvctx, SRV_SEC(DISCOVERY_TIMEOUT), discovery_timeout, disc);
     
     return 1;
 }
 
+/*
+ * a cache of connectors that have already been validated, indexed by a
+ * hash of the connector. A station that comes back with the same connector
+ * doesn't need its signature checked again and we don't need to dig its
+ * network access key out of the JSON again. The cache is flushed if the
+ * configurator's signing key changes.
+ */
+#define CONNCACHE_SIZE          256
+#define CONNCACHE_PROBE         4
+#define CONNCACHE_LIFETIME      3600    /* seconds */
+
+struct conncache {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    EC_POINT *netackey;
+    time_t expires;
+};
+static struct conncache conncache[CONNCACHE_SIZE];
+
+static void
+flush_connector_cache (void)
+{
+    int i;
+
+    for (i = 0; i < CONNCACHE_SIZE; i++) {
+        if (conncache[i].netackey != NULL) {
+            EC_POINT_free(conncache[i].netackey);
+        }
+    }
+    memset(conncache, 0, sizeof(conncache));
+}
+
+static struct conncache *
+find_cached_connector (unsigned char *digest)
+{
+    struct conncache *cc;
+    time_t now = time(NULL);
+    int i, idx;
+
+    idx = ((digest[0] << 8) | digest[1]) % CONNCACHE_SIZE;
+    for (i = 0; i < CONNCACHE_PROBE; i++) {
+        cc = &conncache[(idx + i) % CONNCACHE_SIZE];
+        if ((cc->netackey != NULL) &&
+            (memcmp(cc->digest, digest, SHA256_DIGEST_LENGTH) == 0)) {
+            if (cc->expires < now) {
+                EC_POINT_free(cc->netackey);
+                memset(cc, 0, sizeof(struct conncache));
+                return NULL;
+            }
+            return cc;
+        }
+    }
+    return NULL;
+}
+
+static void
+cache_connector (unsigned char *digest, const EC_POINT *netackey)
+{
+    struct conncache *cc, *victim = NULL;
+    int i, idx;
+
+    idx = ((digest[0] << 8) | digest[1]) % CONNCACHE_SIZE;
+    /*
+     * take an empty slot if there is one, otherwise evict the one that
+     * would expire first
+     */
+    for (i = 0; i < CONNCACHE_PROBE; i++) {
+        cc = &conncache[(idx + i) % CONNCACHE_SIZE];
+        if (cc->netackey == NULL) {
+            victim = cc;
+            break;
+        }
+        if ((victim == NULL) || (cc->expires < victim->expires)) {
+            victim = cc;
+        }
+    }
+    if (victim->netackey != NULL) {
+        EC_POINT_free(victim->netackey);
+    }
+    if ((victim->netackey = EC_POINT_dup(netackey, dpp_instance.group)) == NULL) {
+        memset(victim, 0, sizeof(struct conncache));
+        return;
+    }
+    memcpy(victim->digest, digest, SHA256_DIGEST_LENGTH);
+    victim->expires = time(NULL) + CONNCACHE_LIFETIME;
+}
+
 static int
 process_dpp_discovery_connector (unsigned char *conn, int conn_len, unsigned char *pmk, unsigned char *pmkid)
 {
-    unsigned char unburl[1024], *dot, *nx = NULL;
+    unsigned char conndigest[SHA256_DIGEST_LENGTH];
+    struct conncache *cc;
+    unsigned char unburl[1024], *dot, nx[P521_COORD_LEN];
     char *sstr, *estr;
     unsigned int mdlen = SHA512_DIGEST_LENGTH;
     int unburllen, ntok, ret = -1;
@@ -1022,7 +1294,19 @@ process_dpp_discovery_connector (unsigned char *conn, int conn_len, unsigned cha
     EVP_MD_CTX *mdctx = NULL;
     const BIGNUM *nk;
     const EC_POINT *NK;
-        
+
+    /*
+     * if we've seen this connector before we already know it's good
+     */
+    SHA256(conn, conn_len, conndigest);
+    if ((cc = find_cached_connector(conndigest)) != NULL) {
+        dpp_debug(DPP_DEBUG_TRACE, "connector in DPP Discovery frame was validated before\n");
+        if ((PK = EC_POINT_dup(cc->netackey, dpp_instance.group)) == NULL) {
+            goto fail;
+        }
+        goto derive;
+    }
+
     memset(unburl, 0, sizeof(unburl));
     /*
      * base64url decode the JWS Protected Header then extract and decode the 'kid'
@@ -1066,6 +1350,9 @@ process_dpp_discovery_connector (unsigned char *conn, int conn_len, unsigned cha
         dpp_debug(DPP_DEBUG_ERR, "can't extract point from connector!\n");
         goto fail;;
     }
+    cache_connector(conndigest, PK);
+
+derive:
     if (((nk = EC_KEY_get0_private_key(netaccesskey)) == NULL) ||
         ((NK = EC_KEY_get0_public_key(netaccesskey)) == NULL)) {
         dpp_debug(DPP_DEBUG_ERR, "can't get my own network key! FAIL!\n");
@@ -1080,10 +1367,6 @@ process_dpp_discovery_connector (unsigned char *conn, int conn_len, unsigned cha
         dpp_debug(DPP_DEBUG_ERR, "can't generate shared secret N.x!\n");
         goto fail;
     }
-    if ((nx = (unsigned char *)malloc(dpp_instance.primelen)) == NULL) {
-        dpp_debug(DPP_DEBUG_ERR, "can't malloc shared secret nx!\n");
-        goto fail;
-    }
     /*
      * get hex of x-coordinate of shared secret
      */
@@ -1109,7 +1392,7 @@ process_dpp_discovery_connector (unsigned char *conn, int conn_len, unsigned cha
         dpp_debug(DPP_DEBUG_ERR, "can't get coordinates to generate PMKID!\n");
         goto fail;
     }
-    if ((mdctx = EVP_MD_CTX_new()) == NULL) {
+    if ((mdctx = scratch_md_ctx()) == NULL) {
         dpp_debug(DPP_DEBUG_ERR, "can't generate PMKID!\n");
         goto fail;
     }
@@ -1133,9 +1416,6 @@ process_dpp_discovery_connector (unsigned char *conn, int conn_len, unsigned cha
 
     ret = 1;
 fail:
-    if (mdctx != NULL) {
-        EVP_MD_CTX_free(mdctx);
-    }
     if (PK != NULL) {
         EC_POINT_free(PK);
     }
@@ -1151,16 +1431,33 @@ fail:
     if (nkx != NULL) {
         BN_free(nkx);
     }
-    if (nx != NULL) {
-        free(nx);
-    }
+    OPENSSL_cleanse(nx, sizeof(nx));
     return ret;
 }
 
 unsigned char
 get_dpp_discovery_tid (void)
 {
-    return ++discovery_transaction;
+    struct discovery *disc;
+    int i;
+
+    /*
+     * hand out the next unused transaction ID, 0 is never used
+     */
+    for (i = 0; i < 255; i++) {
+        if (++discovery_transaction == 0) {
+            discovery_transaction = 1;
+        }
+        disc = &discoveries[discovery_transaction];
+        if (disc->state == DISC_FREE) {
+            disc->tid = discovery_transaction;
+            disc->state = DISC_ALLOCATED;
+            disc->t0 = srv_add_timeout(srvctx, SRV_SEC(DISCOVERY_TIMEOUT), discovery_timeout, disc);
+            return discovery_transaction;
+        }
+    }
+    dpp_debug(DPP_DEBUG_ERR, "too many outstanding DPP Discovery transactions!\n");
+    return 0;
 }
 
 int
@@ -1178,7 +1475,7 @@ process_dpp_discovery_frame (unsigned char *data, int len, unsigned char transac
     }
     if (configurator_signkey == NULL) {
         dpp_debug(DPP_DEBUG_PROTOCOL_MSG, "No configurator signing key, discarding DPP Discovery Request!\n");
-        return 1;
+        return 0;
     }
 
     ieeeize_ntoh_attributes(frame->attributes, len - sizeof(dpp_action_frame));
@@ -1199,6 +1496,7 @@ process_dpp_discovery_frame (unsigned char *data, int len, unsigned char transac
             if (process_dpp_discovery_connector(TLV_value(tlv), TLV_length(tlv), pmk, pmkid) < 1) {
                 dpp_debug(DPP_DEBUG_ERR, "failed to process dpp discovery request!\n");
                 send_dpp_discovery_frame(DPP_SUB_PEER_DISCOVER_RESP, STATUS_INVALID_CONNECTOR, tid, transaction_id);
+                end_discovery(transaction_id);
                 return -1;
             }
             /*
@@ -1206,16 +1504,18 @@ process_dpp_discovery_frame (unsigned char *data, int len, unsigned char transac
              * transaction_id is ours to identify the state of the exchange 
              */
             send_dpp_discovery_frame(DPP_SUB_PEER_DISCOVER_RESP, STATUS_OK, tid, transaction_id);
+            end_discovery(transaction_id);
             break;
         case DPP_SUB_PEER_DISCOVER_RESP:
             /*
-             * non-AP STAs should not have more than one active transaction at a time
+             * the response has to be to a request we sent out
              */
-            if (tid != transaction_id) {
+            if ((tid != transaction_id) || (discoveries[transaction_id].state != DISC_REQ_SENT)) {
                 dpp_debug(DPP_DEBUG_ERR, "got a spurious DPP Discovery Response (%d, expected %d)\n",
-                          tid, discovery_transaction);
+                          tid, transaction_id);
                 return -1;
             }
+            end_discovery(transaction_id);
             if (TLV_type(tlv) != DPP_STATUS) {
                 dpp_debug(DPP_DEBUG_ERR, "2nd TLV in dpp discovery response was not status!\n");
                 return -1;
@@ -1243,6 +1543,108 @@ process_dpp_discovery_frame (unsigned char *data, int len, unsigned char transac
     return 1;
 }
 
+/*
+ * PMKSAs that came out of DPP Discovery, indexed by the peer's MAC address.
+ * A peer that comes back can reuse the PMK instead of doing DPP Discovery
+ * (and the ECDH that goes with it) all over again.
+ */
+#define PMKSA_CACHE_SIZE        256
+#define PMKSA_CACHE_PROBE       4
+
+struct pmksa {
+    unsigned char mac[ETH_ALEN];
+    unsigned char pmkid[PMKID_LEN];
+    unsigned char pmk[PMK_LEN];
+    int pmklen;
+    time_t expires;
+};
+static struct pmksa pmksa_cache[PMKSA_CACHE_SIZE];
+static int pmksa_lifetime = 43200;     /* seconds, 0 means don't cache */
+
+static int
+pmksa_index (unsigned char *mac)
+{
+    return ((mac[3] << 16) | (mac[4] << 8) | mac[5]) % PMKSA_CACHE_SIZE;
+}
+
+static void
+flush_pmksa_cache (void)
+{
+    memset(pmksa_cache, 0, sizeof(pmksa_cache));
+}
+
+void
+dpp_set_pmksa_lifetime (int lifetime)
+{
+    pmksa_lifetime = lifetime;
+    if (pmksa_lifetime < 1) {
+        flush_pmksa_cache();
+    }
+}
+
+int
+dpp_add_pmksa (unsigned char *mac, unsigned char *pmk, unsigned char *pmkid)
+{
+    struct pmksa *sa, *victim = NULL;
+    int i, idx;
+
+    if (pmksa_lifetime < 1) {
+        return 0;
+    }
+    idx = pmksa_index(mac);
+    /*
+     * replace an existing PMKSA with this peer, otherwise take an empty
+     * slot, otherwise evict the one closest to expiring
+     */
+    for (i = 0; i < PMKSA_CACHE_PROBE; i++) {
+        sa = &pmksa_cache[(idx + i) % PMKSA_CACHE_SIZE];
+        if ((sa->pmklen > 0) && (memcmp(sa->mac, mac, ETH_ALEN) == 0)) {
+            victim = sa;
+            break;
+        }
+        if ((victim == NULL) || (victim->pmklen && (sa->pmklen == 0)) ||
+            (victim->pmklen && (sa->expires < victim->expires))) {
+            victim = sa;
+        }
+    }
+    memcpy(victim->mac, mac, ETH_ALEN);
+    memcpy(victim->pmkid, pmkid, PMKID_LEN);
+    memcpy(victim->pmk, pmk, dpp_instance.digestlen);
+    victim->pmklen = dpp_instance.digestlen;
+    victim->expires = time(NULL) + pmksa_lifetime;
+    dpp_debug(DPP_DEBUG_TRACE, "caching PMKSA for " MACSTR " for %d seconds\n",
+              MAC2STR(mac), pmksa_lifetime);
+    return 1;
+}
+
+/*
+ * find a PMKSA for a peer, filling in its pmkid and pmk. Returns the
+ * length of the PMK.
+ */
+int
+dpp_get_pmksa_by_mac (unsigned char *mac, unsigned char *pmkid, unsigned char *pmk)
+{
+    struct pmksa *sa;
+    time_t now = time(NULL);
+    int i, idx;
+
+    idx = pmksa_index(mac);
+    for (i = 0; i < PMKSA_CACHE_PROBE; i++) {
+        sa = &pmksa_cache[(idx + i) % PMKSA_CACHE_SIZE];
+        if ((sa->pmklen == 0) || memcmp(sa->mac, mac, ETH_ALEN)) {
+            continue;
+        }
+        if (sa->expires < now) {
+            memset(sa, 0, sizeof(struct pmksa));
+            continue;
+        }
+        memcpy(pmkid, sa->pmkid, PMKID_LEN);
+        memcpy(pmk, sa->pmk, sa->pmklen);
+        return sa->pmklen;
+    }
+    return -1;
+}
+
 //----------------------------------------------------------------------
 // cert and enterprise credential routines
 //----------------------------------------------------------------------
@@ -1284,76 +1686,24 @@ certificate_verify_callback (int pre_verify_ok, X509_STORE_CTX *sctx)
 }
 
 /*
- * extract X509 certificates out of a PKCS7 bag o'certs
+ * base64 decode a PKCS7 blob and parse it
  */
-void
-extract_certs (char *bag, int len, char *cacert, int cacert_len)
+static PKCS7 *
+decode_p7 (char *b64, int len)
 {
-    PKCS7 *p7 = NULL, *cap7 = NULL;
-    X509_STORE *store = NULL;
-    X509 *x509 = NULL;
-    STACK_OF(X509) *certs = NULL, *cacerts = NULL;
+    PKCS7 *p7 = NULL;
     EVP_ENCODE_CTX *ectx = NULL;
-    X509_STORE_CTX *sctx = NULL;
     BIO *bio = NULL;
     unsigned char *asn1 = NULL;
-    char fname[20];
-    int i, asn1len, nid;
+    int i, asn1len;
 
-    if (bag == NULL || len < 1) {
-        return;
-    }
-    if ((ectx = EVP_ENCODE_CTX_new()) == NULL) {
-        return;
-    }
-    /*
-     * if we got a CA cert then decode that
-     */
-    if ((cacert != NULL) && (cacert_len > 0)) {
-        if ((asn1 = (unsigned char *)malloc(cacert_len)) == NULL) {
-            goto fin;
-        }
-        i = cacert_len;
-        EVP_DecodeInit(ectx);
-        (void)EVP_DecodeUpdate(ectx, asn1, &i, (unsigned char *)cacert, cacert_len);
-        asn1len = i;
-        (void)EVP_DecodeFinal(ectx, &(asn1[i]), &i);
-        asn1len += i;
-
-        if ((bio = BIO_new_mem_buf(asn1, asn1len)) == NULL) {
-            dpp_debug(DPP_DEBUG_ERR, "cannot create bio to get X509 from CA cert blob\n");
-            goto fin;
-        }
-        if ((cap7 = d2i_PKCS7_bio(bio, NULL)) == NULL) {
-            dpp_debug(DPP_DEBUG_ERR, "cannot extract X509 from CA cert blob\n");
-            goto fin;
-        }
-        BIO_free(bio); bio = NULL;
-        free(asn1); asn1 = NULL;
-        
-        nid = OBJ_obj2nid(cap7->type);
-        switch (nid) {
-            case NID_pkcs7_signed:
-                cacerts = cap7->d.sign->cert;
-                break;
-            case NID_pkcs7_signedAndEnveloped:
-                cacerts = cap7->d.signed_and_enveloped->cert;
-                break;
-            default:
-                dpp_debug(DPP_DEBUG_ERR, "don't know how to handle this type (%d) of p7!\n", nid);
-                goto fin;
-        }
-        dpp_debug(DPP_DEBUG_PKI, "got a CA certs p7 with %d certs in it\n", sk_X509_num(cacerts));
-    }
-    /*
-     * decode the p7 with our cert in it...
-     */
-    if ((asn1 = (unsigned char *)malloc(len)) == NULL) {
+    if (((ectx = EVP_ENCODE_CTX_new()) == NULL) ||
+        ((asn1 = (unsigned char *)malloc(len)) == NULL)) {
         goto fin;
     }
     i = len;
     EVP_DecodeInit(ectx);
-    (void)EVP_DecodeUpdate(ectx, asn1, &i, (unsigned char *)bag, len);
+    (void)EVP_DecodeUpdate(ectx, asn1, &i, (unsigned char *)b64, len);
     asn1len = i;
     (void)EVP_DecodeFinal(ectx, &(asn1[i]), &i);
     asn1len += i;
@@ -1361,128 +1711,259 @@ extract_certs (char *bag, int len, char *cacert, int cacert_len)
     if ((bio = BIO_new_mem_buf(asn1, asn1len)) == NULL) {
         goto fin;
     }
-    if ((p7 = d2i_PKCS7_bio(bio, NULL)) == NULL) {
-        dpp_debug(DPP_DEBUG_ERR, "cannot extract PKCS7 from p7 blob!\n");
-        goto fin;
+    p7 = d2i_PKCS7_bio(bio, NULL);
+fin:
+    if (bio != NULL) {
+        BIO_free(bio);
+    }
+    if (asn1 != NULL) {
+        free(asn1);
+    }
+    if (ectx != NULL) {
+        EVP_ENCODE_CTX_free(ectx);
     }
-    BIO_free(bio); bio = NULL;
+    return p7;
+}
+
+/*
+ * the location of the certs depends on the type of PKCS7
+ */
+static STACK_OF(X509) *
+p7_certs (PKCS7 *p7)
+{
+    int nid;
 
-    /*
-     * the location of the certs depends on the type of PKCS7
-     */
     nid = OBJ_obj2nid(p7->type);
     switch (nid) {
         case NID_pkcs7_signed:
-            certs = p7->d.sign->cert;
-            break;
+            return p7->d.sign->cert;
         case NID_pkcs7_signedAndEnveloped:
-            certs = p7->d.signed_and_enveloped->cert;
-            break;
+            return p7->d.signed_and_enveloped->cert;
         default:
             dpp_debug(DPP_DEBUG_ERR, "don't know how to handle this type (%d) of p7!\n", nid);
-            goto fin;
+            break;
     }
-    dpp_debug(DPP_DEBUG_PKI, "got a p7 with %d certs in it\n", sk_X509_num(certs));
-    
-    if ((certs != NULL) &&
-        ((store = X509_STORE_new()) != NULL) &&
-        ((sctx = X509_STORE_CTX_new()) != NULL)) {
+    return NULL;
+}
 
-        /*
-         * insert ourselves into the verification check chain
-         */
-        X509_STORE_set_verify_cb(store, certificate_verify_callback);
-        /*
-         * go through all the certs and find a self-signed one, make it the root
-         * and stick ourselves into the process to get a notice of verification errors
-         */
-        for (i = 0; i < sk_X509_num(certs); i++) {
-            if (X509_check_issued(sk_X509_value(certs, i),
-                                  sk_X509_value(certs, i)) == X509_V_OK) {
-                X509_STORE_add_cert(store, sk_X509_value(certs,i));
-                break;
-            }
-        }
-        if (i == sk_X509_num(certs)) {
-            dpp_debug(DPP_DEBUG_PKI, "no self-signed cert in PKCS7 bag o'certs\n");
-        }
-        /*
-         * be as generous as possible in interpreting what we got...
-         * add self-signed certs from the CA p7 into the store as well in
-         * case that's the trust root needed to validate our received cert
-         */
-        if (cacerts != NULL) {
-            dpp_debug(DPP_DEBUG_PKI, "adding certs from CA p7 to store...\n");
-            for (i = 0; i < sk_X509_num(cacerts); i++) {
-                if (X509_check_issued(sk_X509_value(cacerts, i),
-                                      sk_X509_value(cacerts, i)) == X509_V_OK) {
-                    X509_STORE_add_cert(store, sk_X509_value(cacerts,i));
-                    snprintf(fname, sizeof(fname), "cacert%d.pem", i);
-                    if ((bio = BIO_new_file(fname, "w+")) == NULL) {
-                        dpp_debug(DPP_DEBUG_ERR, "unable to save CA certificate to %s\n", fname);
-                    } else {
-                        PEM_write_bio_X509(bio, sk_X509_value(cacerts,i));
-                    }
-                    BIO_free(bio); bio = NULL;
-                }
+/*
+ * the trust store made from the CA's certs. It's built once and only
+ * rebuilt if the CA's PKCS7 changes (e.g. the CA rolled its cert)
+ */
+static X509_STORE *trust_store = NULL;
+static STACK_OF(X509) *trust_chain = NULL;      /* CA's intermediates, untrusted */
+static unsigned char trust_digest[SHA256_DIGEST_LENGTH];
+
+static int
+load_trust_store (char *cacert, int cacert_len)
+{
+    PKCS7 *cap7 = NULL;
+    X509_STORE *store = NULL;
+    STACK_OF(X509) *cacerts, *chain = NULL;
+    X509 *x509;
+    BIO *bio;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char fname[32];
+    int i, nroots = 0, ret = -1;
+
+    if ((cacert == NULL) || (cacert_len < 1)) {
+        return -1;
+    }
+    SHA256((unsigned char *)cacert, cacert_len, digest);
+    if ((trust_store != NULL) && (memcmp(digest, trust_digest, SHA256_DIGEST_LENGTH) == 0)) {
+        return 1;
+    }
+    if ((cap7 = decode_p7(cacert, cacert_len)) == NULL) {
+        dpp_debug(DPP_DEBUG_ERR, "cannot extract X509 from CA cert blob\n");
+        goto fin;
+    }
+    if ((cacerts = p7_certs(cap7)) == NULL) {
+        goto fin;
+    }
+    dpp_debug(DPP_DEBUG_PKI, "got a CA certs p7 with %d certs in it\n", sk_X509_num(cacerts));
+    if (((store = X509_STORE_new()) == NULL) ||
+        ((chain = sk_X509_new_null()) == NULL)) {
+        goto fin;
+    }
+    X509_STORE_set_verify_cb(store, certificate_verify_callback);
+    /*
+     * self-signed certs are trust roots, anything else can help build
+     * a chain but isn't trusted
+     */
+    for (i = 0; i < sk_X509_num(cacerts); i++) {
+        x509 = sk_X509_value(cacerts, i);
+        if (X509_check_issued(x509, x509) == X509_V_OK) {
+            X509_STORE_add_cert(store, x509);
+            nroots++;
+            snprintf(fname, sizeof(fname), "cacert%d.pem", i);
+            if ((bio = BIO_new_file(fname, "w+")) == NULL) {
+                dpp_debug(DPP_DEBUG_ERR, "unable to save CA certificate to %s\n", fname);
+            } else {
+                PEM_write_bio_X509(bio, x509);
+                BIO_free(bio);
             }
+        } else {
+            X509_up_ref(x509);
+            sk_X509_push(chain, x509);
+        }
+    }
+    if (trust_store != NULL) {
+        dpp_debug(DPP_DEBUG_PKI, "CA certs changed, replacing trust store\n");
+        X509_STORE_free(trust_store);
+        sk_X509_pop_free(trust_chain, X509_free);
+    }
+    trust_store = store;
+    trust_chain = chain;
+    store = NULL;
+    chain = NULL;
+    memcpy(trust_digest, digest, SHA256_DIGEST_LENGTH);
+    dpp_debug(DPP_DEBUG_PKI, "trust store has %d roots and %d intermediates\n",
+              nroots, sk_X509_num(trust_chain));
+    ret = 1;
+fin:
+    if (store != NULL) {
+        X509_STORE_free(store);
+    }
+    if (chain != NULL) {
+        sk_X509_pop_free(chain, X509_free);
+    }
+    if (cap7 != NULL) {
+        PKCS7_free(cap7);
+    }
+    return ret;
+}
+
+/*
+ * verify the end-entity cert in a bag o'certs, the rest of the bag
+ * is used to build the chain. If there's no trust store from the CA
+ * then fall back to trusting a self-signed cert in the bag
+ */
+static int
+verify_cert_bag (STACK_OF(X509) *certs)
+{
+    X509_STORE *store = trust_store, *tmpstore = NULL;
+    X509_STORE_CTX *sctx = NULL;
+    STACK_OF(X509) *untrusted = NULL;
+    X509 *x509, *leaf = NULL;
+    int i, j, ret = -1;
+
+    if ((certs == NULL) || (sk_X509_num(certs) < 1)) {
+        return -1;
+    }
+    if (store == NULL) {
+        if ((tmpstore = X509_STORE_new()) == NULL) {
+            goto fin;
         }
+        X509_STORE_set_verify_cb(tmpstore, certificate_verify_callback);
         for (i = 0; i < sk_X509_num(certs); i++) {
-            /*
-             * go through each certificate in the chain....
-             */
-            dpp_debug(DPP_DEBUG_TRACE, "checking certificate %d\n", i);
-            if (!X509_STORE_CTX_init(sctx, store, NULL, certs)) {
-                dpp_debug(DPP_DEBUG_ERR, "can't initialize STORE_CTX!\n");
-                break;
-            }
             x509 = sk_X509_value(certs, i);
-
-//            X509_NAME_oneline(X509_get_subject_name(x509), buf, sizeof(buf));
-//            dpp_debug(DPP_DEBUG_TRACE, "cert %d is for %s, ", i, buf);
-//            X509_NAME_oneline(X509_get_issuer_name(x509), buf, sizeof(buf));
-//            dpp_debug(DPP_DEBUG_TRACE, "issued by %s\n", buf);
-
-            X509_STORE_CTX_set_cert(sctx, x509);
-            /*
-             * if the cert verifies then save it
-             */
-            if (X509_verify_cert(sctx) > 0) {
-                dpp_debug(DPP_DEBUG_PKI, "certificate %d verified!\n", i);
-            } else {
-                dpp_debug(DPP_DEBUG_PKI, "certificate %d did not verify\n", i);
+            if (X509_check_issued(x509, x509) == X509_V_OK) {
+                X509_STORE_add_cert(tmpstore, x509);
+                break;
             }
-            snprintf(fname, sizeof(fname), "mycert%d.pem", i);
-            if ((bio = BIO_new_file(fname, "w+")) == NULL) {
-                dpp_debug(DPP_DEBUG_ERR, "unable to save certificate to %s\n", fname);
+        }
+        if (i == sk_X509_num(certs)) {
+            dpp_debug(DPP_DEBUG_PKI, "no self-signed cert in PKCS7 bag o'certs\n");
+        }
+        store = tmpstore;
+    }
+    /*
+     * the end-entity cert is the one that didn't issue anything else in the bag
+     */
+    for (i = 0; (i < sk_X509_num(certs)) && (leaf == NULL); i++) {
+        x509 = sk_X509_value(certs, i);
+        for (j = 0; j < sk_X509_num(certs); j++) {
+            if ((j != i) && (X509_check_issued(x509, sk_X509_value(certs, j)) == X509_V_OK)) {
                 break;
             }
-            PEM_write_bio_X509(bio, x509);
-            BIO_free(bio); bio = NULL;
-            X509_free(x509);
+        }
+        if (j == sk_X509_num(certs)) {
+            leaf = x509;
         }
     }
-fin:
-    if (p7 != NULL) {
-        PKCS7_free(p7);
+    if (leaf == NULL) {
+        dpp_debug(DPP_DEBUG_PKI, "can't find the end-entity cert in PKCS7 bag o'certs\n");
+        goto fin;
     }
-    if (cap7 != NULL) {
-        PKCS7_free(cap7);
+    if (((untrusted = sk_X509_dup(certs)) == NULL) ||
+        ((sctx = X509_STORE_CTX_new()) == NULL)) {
+        goto fin;
     }
-    if (asn1 != NULL) {
-        free(asn1);
+    if (trust_chain != NULL) {
+        for (i = 0; i < sk_X509_num(trust_chain); i++) {
+            sk_X509_push(untrusted, sk_X509_value(trust_chain, i));
+        }
     }
-    if (store != NULL) {
-        X509_STORE_free(store);
+    if (!X509_STORE_CTX_init(sctx, store, leaf, untrusted)) {
+        dpp_debug(DPP_DEBUG_ERR, "can't initialize STORE_CTX!\n");
+        goto fin;
     }
+    if (X509_verify_cert(sctx) > 0) {
+        dpp_debug(DPP_DEBUG_PKI, "certificate chain verified!\n");
+        ret = 1;
+    } else {
+        dpp_debug(DPP_DEBUG_PKI, "certificate chain did not verify\n");
+        ret = 0;
+    }
+fin:
     if (sctx != NULL) {
         X509_STORE_CTX_free(sctx);
     }
-    if (bio != NULL) {
-        BIO_free(bio);
+    if (untrusted != NULL) {
+        sk_X509_free(untrusted);        /* certs belong to the bag and trust chain */
     }
-    if (ectx != NULL) {
-        EVP_ENCODE_CTX_free(ectx);
+    if (tmpstore != NULL) {
+        X509_STORE_free(tmpstore);
+    }
+    return ret;
+}
+
+/*
+ * extract X509 certificates out of a PKCS7 bag o'certs
+ */
+void
+extract_certs (char *bag, int len, char *cacert, int cacert_len)
+{
+    PKCS7 *p7 = NULL;
+    STACK_OF(X509) *certs;
+    BIO *bio = NULL;
+    char fname[32];
+    int i;
+
+    if (bag == NULL || len < 1) {
+        return;
+    }
+    /*
+     * if we got a CA cert then make sure the trust store is built from it
+     */
+    if ((cacert != NULL) && (cacert_len > 0)) {
+        (void)load_trust_store(cacert, cacert_len);
+    }
+    /*
+     * decode the p7 with our cert in it...
+     */
+    if ((p7 = decode_p7(bag, len)) == NULL) {
+        dpp_debug(DPP_DEBUG_ERR, "cannot extract PKCS7 from p7 blob!\n");
+        goto fin;
+    }
+    if ((certs = p7_certs(p7)) == NULL) {
+        goto fin;
+    }
+    dpp_debug(DPP_DEBUG_PKI, "got a p7 with %d certs in it\n", sk_X509_num(certs));
+
+    (void)verify_cert_bag(certs);
+    for (i = 0; i < sk_X509_num(certs); i++) {
+        snprintf(fname, sizeof(fname), "mycert%d.pem", i);
+        if ((bio = BIO_new_file(fname, "w+")) == NULL) {
+            dpp_debug(DPP_DEBUG_ERR, "unable to save certificate to %s\n", fname);
+            break;
+        }
+        PEM_write_bio_X509(bio, sk_X509_value(certs, i));
+        BIO_free(bio); bio = NULL;
+    }
+fin:
+    if (p7 != NULL) {
+        PKCS7_free(p7);
     }
 }
 
@@ -1716,13 +2197,130 @@ get_set (const unsigned char **p, int len)
     return ret;
 }
 
+/*
+ * generate a fresh keypair for a CSR, either RSA of keylen bits or
+ * EC on the curve indicated by crypto_nid
+ */
+static EVP_PKEY *
+generate_csr_key (int crypto_nid, int keylen)
+{
+    EVP_PKEY_CTX *pkeyctx = NULL;
+    EVP_PKEY *key = NULL;
+
+    if (crypto_nid == NID_rsaEncryption) {
+        dpp_debug(DPP_DEBUG_PKI, "generating a %d bit RSA key for CSR...\n", keylen);
+        if (((pkeyctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL)) == NULL) ||
+            (EVP_PKEY_keygen_init(pkeyctx) < 1) ||
+            (EVP_PKEY_CTX_set_rsa_keygen_bits(pkeyctx, keylen) < 1)) {
+            dpp_debug(DPP_DEBUG_ERR, "can't initialize key generation for RSA\n");
+            goto fin;
+        }
+    } else {
+        dpp_debug(DPP_DEBUG_PKI, "generating an ECC key for CSR...\n");
+        if (((pkeyctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) == NULL) ||
+            (EVP_PKEY_keygen_init(pkeyctx) < 1) ||
+            (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pkeyctx, crypto_nid) < 1) ||
+            (EVP_PKEY_CTX_set_ec_param_enc(pkeyctx, OPENSSL_EC_NAMED_CURVE) < 1)) {
+            dpp_debug(DPP_DEBUG_ERR, "can't initialize key generation for curve %d\n",
+                      crypto_nid);
+            goto fin;
+        }
+    }
+    if (EVP_PKEY_keygen(pkeyctx, &key) < 1) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to generate keypair!\n");
+        key = NULL;
+    }
+fin:
+    if (pkeyctx != NULL) {
+        EVP_PKEY_CTX_free(pkeyctx);
+    }
+    return key;
+}
+
+/*
+ * remember what kind of key the configurator wanted in the CSR so the
+ * next time we enroll it can be generated ahead of time
+ */
+static void
+save_csrkey_hint (int crypto_nid, int keylen)
+{
+    FILE *fp;
+
+    if ((crypto_nid == csrkey_hint_nid) && (keylen == csrkey_hint_bits)) {
+        return;
+    }
+    csrkey_hint_nid = crypto_nid;
+    csrkey_hint_bits = keylen;
+    if ((fp = fopen(csrkey_hint_file, "w")) != NULL) {
+        fprintf(fp, "%d %d\n", crypto_nid, keylen);
+        fclose(fp);
+    }
+}
+
+static void
+load_csrkey_hint (void)
+{
+    FILE *fp;
+
+    csrkey_hint_nid = 0;
+    csrkey_hint_bits = 0;
+    if ((fp = fopen(csrkey_hint_file, "r")) != NULL) {
+        if (fscanf(fp, "%d %d", &csrkey_hint_nid, &csrkey_hint_bits) != 2) {
+            csrkey_hint_nid = 0;
+            csrkey_hint_bits = 0;
+        }
+        fclose(fp);
+    }
+}
+
+/*
+ * generate a spare CSR keypair of the kind the configurator asked for
+ * last time, generate_csr() will use it if it guessed right. Keygen can
+ * take a while so only do it when no DPP exchange is going on, if one
+ * started since this was scheduled then wait for it to finish.
+ */
+static void
+pregen_csr_key (timerid id, void *unused)
+{
+    spare_csrkey_timer = 0;
+    if (!TAILQ_EMPTY(&dpp_instance.peers)) {
+        return;
+    }
+    if (csrkey_hint_nid < 0) {
+        load_csrkey_hint();
+    }
+    /*
+     * nothing to do if we already have one or if the protocol key gets used
+     */
+    if ((spare_csrkey != NULL) || (csrkey_hint_nid == 0) ||
+        (csrkey_hint_nid == dpp_instance.nid)) {
+        return;
+    }
+    if ((spare_csrkey = generate_csr_key(csrkey_hint_nid, csrkey_hint_bits)) != NULL) {
+        spare_csrkey_nid = csrkey_hint_nid;
+        spare_csrkey_bits = csrkey_hint_bits;
+        dpp_debug(DPP_DEBUG_PKI, "CSR keypair is ready ahead of time\n");
+    }
+    return;
+}
+
+static void
+schedule_csr_keygen (void)
+{
+    if (!(dpp_instance.core & DPP_ENROLLEE) || (spare_csrkey != NULL) ||
+        (spare_csrkey_timer != 0)) {
+        return;
+    }
+    spare_csrkey_timer = srv_add_timeout(srvctx, SRV_SEC(1), pregen_csr_key, NULL);
+}
+
 /*
  * generate a PKCS#10 certificate signing request 
  */
 static int
 generate_csr (struct candidate *peer, char **csr)
 {
-    int challp_len, pkey_id, tag, xclass, inf, asn1len, csrlen = -1;
+    int challp_len, tag, xclass, inf, asn1len, csrlen = -1;
     int nid, keylen = 2048, crypto_nid;
     const EVP_MD *md = EVP_sha256();
     const unsigned char *tot, *op;
@@ -1731,11 +2329,7 @@ generate_csr (struct candidate *peer, char **csr)
     char whoami[20];
     BIO *bio = NULL;
     ASN1_OBJECT *o = NULL;
-    const EVP_PKEY_ASN1_METHOD *ameth;
-    EVP_PKEY_CTX *pkeyctx = NULL;
     EVP_PKEY *tmp = NULL, *key = NULL;
-    EC_GROUP *group = NULL;
-    EC_KEY *ec = NULL;
     X509_NAME *subj = NULL;
     X509_REQ *req = NULL;
     long len, length;
@@ -2151,68 +2745,24 @@ gen_csr:
     /*
      * if we were told to use a different public key then generate it
      */
+    save_csrkey_hint(crypto_nid, crypto_nid == NID_rsaEncryption ? keylen : 0);
     if (crypto_nid != dpp_instance.nid) {
-        if (crypto_nid == NID_rsaEncryption) {
-            dpp_debug(DPP_DEBUG_PKI, "generating an RSA key for CSR...\n");
-            /*
-             * rsa of the specified length
-             */
-            ameth = EVP_PKEY_asn1_find_str(NULL, "rsa", -1);
-            EVP_PKEY_asn1_get0_info(&pkey_id, NULL, NULL, NULL, NULL, ameth);
-            pkeyctx = EVP_PKEY_CTX_new_id(pkey_id, NULL);
-            if (EVP_PKEY_keygen_init(pkeyctx) < 1) {
-                dpp_debug(DPP_DEBUG_ERR, "can't initialize key generation for RSA\n");
-                return -1;
-            }
-            EVP_PKEY_CTX_set_rsa_keygen_bits(pkeyctx, keylen);
-        } else {
-            dpp_debug(DPP_DEBUG_PKI, "generating an ECC key for CSR...\n");
-            /*
-             * generate an EC keypair for the specified group
-             */
-            if ((group = EC_GROUP_new_by_curve_name(crypto_nid)) == NULL) {
-                dpp_debug(DPP_DEBUG_ERR, "unable to create curve group!\n");
-                return -1;
-            }
-            EC_GROUP_set_asn1_flag(group, OPENSSL_EC_NAMED_CURVE);
-            EC_GROUP_set_point_conversion_form(group, POINT_CONVERSION_UNCOMPRESSED);
-            if ((ec = EC_KEY_new()) == NULL) {
-                dpp_debug(DPP_DEBUG_ERR, "unable to create an EC_KEY!\n");
-                return -1;
-            }
-            if (EC_KEY_set_group(ec, group) == 0) {
-                dpp_debug(DPP_DEBUG_ERR, "unable to set group to  PKEY!\n");
-                return -1;
-            }
-            if (!EC_KEY_generate_key(ec)) {
-                dpp_debug(DPP_DEBUG_ERR, "unable to generate PKEY!\n");
-                return -1;
-            }
-            /*
-             * assign EC keypair to an EVP_PKEY and then use that to make
-             * an EVP_PKEY_CTX
-             */
-            if ((tmp = EVP_PKEY_new()) == NULL) {
-                dpp_debug(DPP_DEBUG_ERR, "unable to create PKEY!\n");
-                return -1;
-            }
-            EVP_PKEY_assign(tmp, EVP_PKEY_EC, ec);
-            pkeyctx = EVP_PKEY_CTX_new(tmp, NULL);
-            EVP_PKEY_free(tmp);
-            EC_GROUP_free(group);
-        }
         /*
-         * we have an EVP_PKEY_CTX now for our desired public key type, generate!
+         * if the spare key is the right kind use it, otherwise generate
+         * one now
          */
-        if (EVP_PKEY_keygen_init(pkeyctx) < 1) {
-            dpp_debug(DPP_DEBUG_ERR, "unable to initiate keygen procedure!\n");
+        if ((spare_csrkey != NULL) && (spare_csrkey_nid == crypto_nid) &&
+            ((crypto_nid != NID_rsaEncryption) || (spare_csrkey_bits == keylen))) {
+            dpp_debug(DPP_DEBUG_PKI, "using pre-generated key for CSR...\n");
+            key = spare_csrkey;
+            spare_csrkey = NULL;
+        } else if ((key = generate_csr_key(crypto_nid, keylen)) == NULL) {
             goto csr_fail;
         }
-        if (EVP_PKEY_keygen(pkeyctx, &key) < 1) {
-            dpp_debug(DPP_DEBUG_ERR, "unable to generate keypair!\n");
-            goto csr_fail;
+        if (spare_csrkey != NULL) {
+            EVP_PKEY_free(spare_csrkey);
+            spare_csrkey = NULL;
         }
-        EVP_PKEY_CTX_free(pkeyctx); /* will free ec too, if used */
         if ((bio = BIO_new_file("key_for_cert.pem", "w")) != NULL) {
             PEM_write_bio_PrivateKey(bio, key, NULL, NULL, 0, NULL, NULL);
         }
@@ -2513,19 +3063,7 @@ send_dpp_config_result (struct candidate *peer, unsigned char status)
                             (int)((unsigned char *)tlv - (unsigned char *)(wraptlv->value + AES_BLOCK_SIZE)));
 
     setup_dpp_action_frame(peer, DPP_CONFIG_RESULT);
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-    }
+    siv_init(&ctx, peer->ke, dpp_instance.sivmode);
     peer->bufferlen = (int)((unsigned char *)tlv - peer->buffer);
     wraptlv->length = ieee_order(peer->bufferlen - sizeof(TLV));
 
@@ -2545,10 +3083,10 @@ generate_dpp_config_resp_frame (struct candidate *peer, unsigned char status)
     siv_ctx ctx;
     TLV *tlv, *wraptlv;
     unsigned char burlx[256], burly[256], kid[KID_LENGTH];
-    unsigned char conn[1024], *bn = NULL, *ptr;
+    unsigned char conn[1024], bn[P521_COORD_LEN], *ptr;
     char confresp[4096];
     int sofar = 0, offset, burllen, nid;
-    BIGNUM *x = NULL, *y = NULL, *signprime = NULL;
+    BIGNUM *x, *y, *signprime;
     const EC_POINT *signpub, *newpub;
     const EC_GROUP *signgroup = NULL;
     unsigned char *encrypt_ptr = NULL;
@@ -2560,6 +3098,11 @@ generate_dpp_config_resp_frame (struct candidate *peer, unsigned char status)
     memset(peer->buffer, 0, sizeof(peer->buffer));
     peer->bufferlen = 0;
     
+    BN_CTX_start(bnctx);
+    x = BN_CTX_get(bnctx);
+    y = BN_CTX_get(bnctx);
+    signprime = BN_CTX_get(bnctx);
+
     tlv = (TLV *)peer->buffer;
     wraptlv = TLV_set_tlv(tlv, DPP_STATUS, 1, &status);
     wraptlv->type = WRAPPED_DATA;
@@ -2597,16 +3140,15 @@ generate_dpp_config_resp_frame (struct candidate *peer, unsigned char status)
             status = STATUS_CONFIGURE_FAILURE;
             goto problemo;
         } 
-        if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
-            ((signprime = BN_new()) == NULL) ||
+        if ((signprime == NULL) ||
             !EC_GROUP_get_curve_GFp(signgroup, signprime, NULL, NULL, bnctx) ||
             !EC_POINT_get_affine_coordinates_GFp(signgroup, signpub, x, y, bnctx)) {
             dpp_debug(DPP_DEBUG_ERR, "unable to get coordinates of public signing key!\n");
             status = STATUS_CONFIGURE_FAILURE;
             goto problemo;
         } 
-        if ((bn = (unsigned char *)malloc(BN_num_bytes(signprime))) == NULL) {
-            dpp_debug(DPP_DEBUG_ERR, "unable to alloc memory for public signing key points!\n");
+        if (BN_num_bytes(signprime) > (int)sizeof(bn)) {
+            dpp_debug(DPP_DEBUG_ERR, "public signing key is on too big a curve!\n");
             status = STATUS_CONFIGURE_FAILURE;
             goto problemo;
         }
@@ -2898,7 +3440,7 @@ problemo:
         case STATUS_NEW_KEY_NEEDED:
             dpp_debug(DPP_DEBUG_TRACE, "asking enrollee to generate a new protocol key in %d!\n",
                       dpp_instance.newgroup);
-            if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
+            if ((y == NULL) ||
                 ((newpub = EC_KEY_get0_public_key(peer->mynewproto)) == NULL) ||
                 !EC_POINT_get_affine_coordinates_GFp((EC_GROUP *)EC_KEY_get0_group(peer->mynewproto),
                                                      newpub, x, y, bnctx)) {
@@ -2943,37 +3485,14 @@ problemo:
      */
     ieeeize_hton_attributes(peer->buffer, (int)(((unsigned char *)tlv - peer->buffer)));
 
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-    }
+    siv_init(&ctx, peer->ke, dpp_instance.sivmode);
     siv_encrypt(&ctx, wraptlv->value + AES_BLOCK_SIZE, encrypt_ptr, wrapped_len,
                 wraptlv->value, 1, &peer->buffer,
                 (int)((unsigned char *)wraptlv - (unsigned char *)peer->buffer));
 
     peer->bufferlen = (int)((unsigned char *)tlv - peer->buffer);
 
-    if (x != NULL) {
-        BN_free(x);
-    }
-    if (y != NULL) {
-        BN_free(y);
-    }
-    if (signprime != NULL) {
-        BN_free(signprime);
-    }
-    if (bn != NULL) {
-        free(bn);
-    }
+    BN_CTX_end(bnctx);
     return 1;
 }
 
@@ -2984,7 +3503,8 @@ send_dpp_config_req_frame (struct candidate *peer)
     TLV *tlv;
     int ret = -1, caolen = 0, offset;
     char confattsobj[1500], whoami[20], *csr = NULL;
-    unsigned char *ptr, *xoctets = NULL;
+    unsigned char *ptr, *xoctets = NULL, *wrapped;
+    struct iovec iov[2];
     unsigned int mdlen = 0;
     HMAC_CTX *hctx = NULL;
     BIGNUM *x = NULL, *y = NULL, *Sx = NULL;
@@ -3012,7 +3532,7 @@ send_dpp_config_req_frame (struct candidate *peer)
     if (peer->mynewproto != NULL) {
         dpp_debug(DPP_DEBUG_TRACE, "adding new protocol key...\n");
         if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
-            ((hctx = HMAC_CTX_new()) == NULL) ||
+            ((hctx = scratch_hmac_ctx()) == NULL) ||
             !EC_POINT_get_affine_coordinates_GFp(EC_KEY_get0_group(peer->mynewproto),
                                                  EC_KEY_get0_public_key(peer->mynewproto),
                                                  x, y, bnctx)) {
@@ -3022,9 +3542,6 @@ send_dpp_config_req_frame (struct candidate *peer)
             if (y != NULL) {
                 BN_free(y);
             }
-            if (hctx != NULL) {
-                HMAC_CTX_free(hctx);
-            }
             return ret;
         }
         /*
@@ -3044,7 +3561,6 @@ send_dpp_config_req_frame (struct candidate *peer)
         if (((Sx = BN_new()) == NULL) ||
             (S = EC_POINT_new(EC_KEY_get0_group(peer->mynewproto))) == NULL) {
             dpp_debug(DPP_DEBUG_ERR, "cannot create POP secret!\n");
-            HMAC_CTX_free(hctx);
             return ret;
         }
         if (((pc = EC_KEY_get0_private_key(peer->mynewproto)) == NULL) ||
@@ -3054,7 +3570,6 @@ send_dpp_config_req_frame (struct candidate *peer)
             dpp_debug(DPP_DEBUG_ERR, "failure to compute shared key for POP!\n");
             BN_free(Sx);
             EC_POINT_free(S);
-            HMAC_CTX_free(hctx);
             return ret;
         }
         memset(k, 0, SHA512_DIGEST_LENGTH);
@@ -3075,7 +3590,6 @@ send_dpp_config_req_frame (struct candidate *peer)
             dpp_debug(DPP_DEBUG_ERR, "internal error trying to do POP!\n");
             BN_free(Sx);
             EC_POINT_free(S);
-            HMAC_CTX_free(hctx);
             return ret;
         }
         HMAC_Init_ex(hctx, k, dpp_instance.digestlen, dpp_instance.hashfcn, NULL);
@@ -3093,7 +3607,6 @@ send_dpp_config_req_frame (struct candidate *peer)
             EC_POINT_free(S);
             BN_free(Sx);
             BN_free(x);
-            HMAC_CTX_free(hctx);
             return ret;
         }
         memset(xoctets, 0, peer->newprimelen);
@@ -3109,7 +3622,6 @@ send_dpp_config_req_frame (struct candidate *peer)
             EC_POINT_free(S);
             BN_free(Sx);
             BN_free(x);
-            HMAC_CTX_free(hctx);
             return ret;
         }
         memset(xoctets, 0, peer->newprimelen);
@@ -3126,7 +3638,6 @@ send_dpp_config_req_frame (struct candidate *peer)
         EC_POINT_free(S);
         BN_free(Sx);
         BN_free(x);
-        HMAC_CTX_free(hctx);
     }
     
     /*
@@ -3154,26 +3665,26 @@ send_dpp_config_req_frame (struct candidate *peer)
     }
     caolen += snprintf(confattsobj+caolen, sizeof(confattsobj)-caolen, "}");
 
-    tlv = TLV_set_tlv(tlv, CONFIG_ATTRIBUTES_OBJECT, caolen, (unsigned char *)confattsobj);
+    /*
+     * the config attributes object goes last, only its TLV header goes
+     * into the frame, the object gets encrypted into place right out
+     * of confattsobj
+     */
+    tlv->type = CONFIG_ATTRIBUTES_OBJECT;
+    tlv->length = caolen;
+    ptr = tlv->value;
+    wrapped = ((TLV *)peer->buffer)->value + AES_BLOCK_SIZE;
     /*
      * put the attributes into ieee-order
      */
-    ieeeize_hton_attributes((((TLV *)peer->buffer)->value + AES_BLOCK_SIZE),
-                            (int)((unsigned char *)tlv - (((TLV *)peer->buffer)->value + AES_BLOCK_SIZE)));
+    ieeeize_hton_attributes(wrapped, (int)(ptr - wrapped));
+    iov[0].iov_base = wrapped;
+    iov[0].iov_len = ptr - wrapped;
+    iov[1].iov_base = confattsobj;
+    iov[1].iov_len = caolen;
+    tlv = (TLV *)(ptr + caolen);
     
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-    }
+    siv_init(&ctx, peer->ke, dpp_instance.sivmode);
     /*
      * fill in the lengths now that we have constructed the frame...
      */
@@ -3185,9 +3696,7 @@ send_dpp_config_req_frame (struct candidate *peer)
      */
     tlv->length = ieee_order(peer->bufferlen - sizeof(TLV));
 
-    siv_encrypt(&ctx, tlv->value + AES_BLOCK_SIZE, tlv->value + AES_BLOCK_SIZE,
-                (peer->bufferlen - sizeof(TLV)) - AES_BLOCK_SIZE,
-                tlv->value, 0);
+    siv_encryptv(&ctx, NULL, 0, iov, 2, wrapped, tlv->value);
 
     if (send_dpp_config_frame(peer, GAS_INITIAL_REQUEST)) {
         peer->retrans = 0;
@@ -3229,20 +3738,7 @@ process_dpp_config_result (struct candidate *peer, unsigned char *data, int len)
     /*
      * decrypt the wrapped data
      */
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-            goto fin;
-    }
+    siv_init(&ctx, peer->ke, dpp_instance.sivmode);
     
     if (siv_decrypt(&ctx, TLV_value(tlv) + AES_BLOCK_SIZE, TLV_value(tlv) + AES_BLOCK_SIZE,
                     TLV_length(tlv) - AES_BLOCK_SIZE, TLV_value(tlv),
@@ -3272,16 +3768,17 @@ fin:
 }
 
 static int
-check_connector (struct candidate *peer, unsigned char *blob, int len)
+check_connector (struct candidate *peer, struct json_doc *conf)
 {
-    unsigned char unb64url[1024], coordbin[P521_COORD_LEN];
+    unsigned char unb64url[1024], coordbin[P521_COORD_LEN], oldkid[KID_LENGTH];
     BIGNUM *x = NULL, *y = NULL;
     const EC_POINT *P;
     const EC_GROUP *signgroup;
+    struct json_doc jws;
     char *sstr, *estr, *dot;
     int ntok, unburllen, cl, signnid, coordlen, ret = -1;
 
-    if ((ntok = get_json_data((char *)blob, len, &sstr, &estr, 2, "cred", "signedConnector")) == 0) {
+    if ((ntok = json_get(conf, &sstr, &estr, 2, "cred", "signedConnector")) == 0) {
         dpp_debug(DPP_DEBUG_ERR, "No connector found!\n");
         goto fin;
     }
@@ -3294,12 +3791,16 @@ check_connector (struct candidate *peer, unsigned char *blob, int len)
         dpp_debug(DPP_DEBUG_ERR, "Cannot base64url decode the JWS Protected Header!\n");
         goto fin;
     }
-    if ((ntok = get_json_data((char *)unb64url, unburllen, &sstr, &estr, 1, "alg")) != 1) {
+    if (json_parse(&jws, (char *)unb64url, unburllen) < 1) {
+        dpp_debug(DPP_DEBUG_ERR, "Cannot parse the JWS Protected Header!\n");
+        goto fin;
+    }
+    if ((ntok = json_get(&jws, &sstr, &estr, 1, "alg")) != 1) {
         dpp_debug(DPP_DEBUG_ERR, "Failed to get 'alg' from JWS Protected Header!\n");
         goto fin;
     }
     dpp_debug(DPP_DEBUG_TRACE, "connector is signed with %.*s, ", (int)(estr - sstr), sstr);
-    if ((ntok = get_json_data((char *)unb64url, unburllen, &sstr, &estr, 1, "kid")) != 1) {
+    if ((ntok = json_get(&jws, &sstr, &estr, 1, "kid")) != 1) {
         dpp_debug(DPP_DEBUG_ERR, "Failed to get 'kid' from JWS Protected Header!\n");
         goto fin;
     }
@@ -3307,7 +3808,7 @@ check_connector (struct candidate *peer, unsigned char *blob, int len)
     /*
      * get the Configurator's signing key from the "csign" portion of the DPP Config Object
      */
-    if ((ntok = get_json_data((char *)blob, len, &sstr, &estr, 3, "cred", "csign", "crv")) != 1) {
+    if ((ntok = json_get(conf, &sstr, &estr, 3, "cred", "csign", "crv")) != 1) {
         dpp_debug(DPP_DEBUG_ERR, "No 'crv' coordinate in 'csign' portion of the response!\n");
         goto fin;
     }
@@ -3349,7 +3850,7 @@ check_connector (struct candidate *peer, unsigned char *blob, int len)
     /*
      * get the x-coordinate...
      */
-    if ((ntok = get_json_data((char *)blob, len, &sstr, &estr, 3, "cred", "csign", "x")) != 1) {
+    if ((ntok = json_get(conf, &sstr, &estr, 3, "cred", "csign", "x")) != 1) {
         dpp_debug(DPP_DEBUG_ERR, "No 'x' coordinate in 'csign' portion of the response!\n");
         goto fin;
     }
@@ -3369,7 +3870,7 @@ check_connector (struct candidate *peer, unsigned char *blob, int len)
     /*
      * get the y-coordinate...
      */
-    if ((ntok = get_json_data((char *)blob, len, &sstr, &estr, 3, "cred", "csign", "y")) != 1) {
+    if ((ntok = json_get(conf, &sstr, &estr, 3, "cred", "csign", "y")) != 1) {
         dpp_debug(DPP_DEBUG_ERR, "No 'y' coordinate in 'csign' portion of the response!\n");
         goto fin;
     }
@@ -3388,7 +3889,7 @@ check_connector (struct candidate *peer, unsigned char *blob, int len)
     /*
      * create an EC_KEY out of "crv", "x", and "y"
      */
-    configurator_signkey = EC_KEY_new_by_curve_name(signnid);
+    configurator_signkey = new_dpp_key(signnid);
     EC_KEY_set_public_key_affine_coordinates(configurator_signkey, x, y);
     EC_KEY_set_conv_form(configurator_signkey, POINT_CONVERSION_COMPRESSED);
     EC_KEY_set_asn1_flag(configurator_signkey, OPENSSL_EC_NAMED_CURVE);
@@ -3400,15 +3901,22 @@ check_connector (struct candidate *peer, unsigned char *blob, int len)
     }
     dpp_debug(DPP_DEBUG_TRACE, "configurator's signing key is valid!!!\n");
 
+    memcpy(oldkid, csign_kid, KID_LENGTH);
     if (get_kid_from_point(csign_kid, signgroup, P, bnctx) < KID_LENGTH) {
         dpp_debug(DPP_DEBUG_ERR, "can't get key id for configurator's sign key!\n");
         goto fin;
     }
+    /*
+     * connectors validated with a different configurator key are suspect now
+     */
+    if (memcmp(oldkid, csign_kid, KID_LENGTH)) {
+        flush_connector_cache();
+    }
         
     /*
      * validate the connector
      */
-    if ((ntok = get_json_data((char *)blob, len, &sstr, &estr, 2, "cred", "signedConnector")) == 0) {
+    if ((ntok = json_get(conf, &sstr, &estr, 2, "cred", "signedConnector")) == 0) {
         dpp_debug(DPP_DEBUG_ERR, "No connector in DPP Config response!\n");
         goto fin;
     }
@@ -3427,6 +3935,10 @@ check_connector (struct candidate *peer, unsigned char *blob, int len)
             goto fin;
         }
         memcpy(connector, sstr, connector_len);
+        /*
+         * PMKSAs from an old connector aren't any good anymore
+         */
+        flush_pmksa_cache();
     }
     ret = 1;
 fin:
@@ -3452,6 +3964,7 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
     EVP_ENCODE_CTX *ectx = NULL;
     BIGNUM *x = NULL, *y = NULL;
     siv_ctx ctx;
+    struct json_doc conf;
     char *sstr, *estr;
     unsigned short newgrp;
     int i, wrapdatalen, ntok, ncred, ret = -1;
@@ -3473,20 +3986,7 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
     /*
      * decrypt the wrapped data
      */
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-            goto fin;
-    }
+    siv_init(&ctx, peer->ke, dpp_instance.sivmode);
     wrapdatalen = TLV_length(tlv) - AES_BLOCK_SIZE;
     if (siv_decrypt(&ctx, TLV_value(tlv) + AES_BLOCK_SIZE, TLV_value(tlv) + AES_BLOCK_SIZE,
                     wrapdatalen, TLV_value(tlv), 1, attrs,
@@ -3543,8 +4043,8 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
                 }
                 dpp_debug(DPP_DEBUG_TRACE, "\ncredential object:\n");
                 dpp_debug(DPP_DEBUG_TRACE, "%.*s\n\n", TLV_length(tlv), TLV_value(tlv));
-                if ((ncred = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                           &sstr, &estr, 2, "cred", "akm")) == 0) {
+                json_parse(&conf, (char *)TLV_value(tlv), TLV_length(tlv));
+                if ((ncred = json_get(&conf, &sstr, &estr, 2, "cred", "akm")) == 0) {
                     dpp_debug(DPP_DEBUG_ERR, "No AKM credential in DPP Config response!\n");
                     goto fin;
                 }
@@ -3557,12 +4057,11 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
                      * we got a connector!
                      */
                     dpp_debug(DPP_DEBUG_TRACE, "A DPP AKM Configuration Object!\n");
-                    if (check_connector(peer, TLV_value(tlv), TLV_length(tlv)) < 0) {
+                    if (check_connector(peer, &conf) < 0) {
                         dpp_debug(DPP_DEBUG_ERR, "Bad connector in DPP AKM of Config response!\n");
                         goto fin;
                     }
-                    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                              &sstr, &estr, 2, "discovery", "ssid")) == 0) {
+                    if ((ntok = json_get(&conf, &sstr, &estr, 2, "discovery", "ssid")) == 0) {
                         provision_connector(dpp_instance.enrollee_role, "*", 1,
                                             connector, connector_len, peer->handle);
                         dump_key_con(peer, NULL, 0);
@@ -3579,16 +4078,14 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
                     /*
                      * got a PSK configuration!
                      */
-                    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                              &sstr, &estr, 2, "cred", "pass")) != 0) {
+                    if ((ntok = json_get(&conf, &sstr, &estr, 2, "cred", "pass")) != 0) {
                         dpp_debug(DPP_DEBUG_TRACE, "use password '%.*s' ", (int)(estr - sstr), sstr);
                         strncpy(pwd, sstr, (int)(estr - sstr));
                     } else {
                         dpp_debug(DPP_DEBUG_ERR, "Unknown type of sae, not 'pass'\n");
                         goto fin;
                     }
-                    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                              &sstr, &estr, 2, "discovery", "ssid")) == 0) {
+                    if ((ntok = json_get(&conf, &sstr, &estr, 2, "discovery", "ssid")) == 0) {
                         dpp_debug(DPP_DEBUG_TRACE, "with an any SSID I guess\n");
                     } else {
                         dpp_debug(DPP_DEBUG_TRACE, "with SSID %.*s\n", (int)(estr - sstr), sstr);
@@ -3597,7 +4094,7 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
                         /*
                          * connector is v2 only
                          */
-                        if (check_connector(peer, TLV_value(tlv), TLV_length(tlv)) < 0) {
+                        if (check_connector(peer, &conf) < 0) {
                             dpp_debug(DPP_DEBUG_ERR, "Bad connector in SAE AKM of Config response!\n");
                             goto fin;
                         }
@@ -3615,20 +4112,17 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
                     /*
                      * got a PSK configuration!
                      */
-                    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                              &sstr, &estr, 2, "cred", "pass")) != 0) {
+                    if ((ntok = json_get(&conf, &sstr, &estr, 2, "cred", "pass")) != 0) {
                         dpp_debug(DPP_DEBUG_TRACE, "use passphrase '%.*s' ", (int)(estr - sstr), sstr);
                         strncpy(pwd, sstr, (int)(estr - sstr));
-                    } else if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                                     &sstr, &estr, 2, "cred", "psk_hex")) != 0) {
+                    } else if ((ntok = json_get(&conf, &sstr, &estr, 2, "cred", "psk_hex")) != 0) {
                         dpp_debug(DPP_DEBUG_TRACE, "use hexstring '%.*s' ", (int)(estr - sstr), sstr);
                         strncpy(pwd, sstr, (int)(estr - sstr));
                     } else {
                         dpp_debug(DPP_DEBUG_ERR, "Unknown type of psk, not 'pass' and not 'psk_hex'\n");
                         goto fin;
                     }
-                    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                              &sstr, &estr, 2, "discovery", "ssid")) == 0) {
+                    if ((ntok = json_get(&conf, &sstr, &estr, 2, "discovery", "ssid")) == 0) {
                         dpp_debug(DPP_DEBUG_TRACE, "with an any SSID I guess\n");
                     } else {
                         dpp_debug(DPP_DEBUG_TRACE, "with SSID %.*s\n", (int)(estr - sstr), sstr);
@@ -3637,7 +4131,7 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
                         /*
                          * connector is v2 only
                          */
-                        if (check_connector(peer, TLV_value(tlv), TLV_length(tlv)) < 0) {
+                        if (check_connector(peer, &conf) < 0) {
                             dpp_debug(DPP_DEBUG_ERR, "Bad connector in PSK AKM of Config response!\n");
                             goto fin;
                         }
@@ -3651,16 +4145,14 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
                     char *p7, *ca, *san;
                     int p7len, calen, sanlen;
             
-                    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                              &sstr, &estr, 3, "cred", "entCreds", "certBag")) < 1) {
+                    if ((ntok = json_get(&conf, &sstr, &estr, 3, "cred", "entCreds", "certBag")) < 1) {
                         dpp_debug(DPP_DEBUG_ERR, "No certBag in DPP Config response for dot1x!\n");
                         goto fin;
                     }
                     dpp_debug(DPP_DEBUG_PKI, "got PKCS#7:\n %.*s\n", (int)(estr - sstr), sstr);
                     p7 = sstr;
                     p7len = (int)(estr - sstr);
-                    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                              &sstr, &estr, 3, "cred", "entCreds", "caCert")) < 1) {
+                    if ((ntok = json_get(&conf, &sstr, &estr, 3, "cred", "entCreds", "caCert")) < 1) {
                         dpp_debug(DPP_DEBUG_ERR, "No caCert in DPP Config response for dot1x!\n");
                         ca = NULL;
                         calen = 0;
@@ -3669,8 +4161,7 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
                         calen = (int)(estr - sstr);
                         dpp_debug(DPP_DEBUG_PKI, "got CA cert:\n %.*s\n", calen, ca);
                     }
-                    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                              &sstr, &estr, 3, "cred", "entCreds", "trustedEapServerName")) < 1) {
+                    if ((ntok = json_get(&conf, &sstr, &estr, 3, "cred", "entCreds", "trustedEapServerName")) < 1) {
                         dpp_debug(DPP_DEBUG_ERR, "No SAN to match in server cert!\n");
                         san = NULL;
                         sanlen = 0;
@@ -3680,8 +4171,7 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
                         sanlen = (int)(estr - sstr);
                     }
                     extract_certs(p7, p7len, ca, calen);
-                    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                              &sstr, &estr, 2, "discovery", "ssid")) == 0) {
+                    if ((ntok = json_get(&conf, &sstr, &estr, 2, "discovery", "ssid")) == 0) {
                         dpp_debug(DPP_DEBUG_TRACE, "with an any SSID I guess\n");
                     } else {
                         dpp_debug(DPP_DEBUG_TRACE, "with SSID %.*s\n", (int)(estr - sstr), sstr);
@@ -3690,7 +4180,7 @@ process_dpp_config_response (struct candidate *peer, unsigned char *attrs, int l
                     /*
                      * dot1x credentials are v2 only so there'll always be a connector
                      */
-                    if (check_connector(peer, TLV_value(tlv), TLV_length(tlv)) < 0) {
+                    if (check_connector(peer, &conf) < 0) {
                         dpp_debug(DPP_DEBUG_ERR, "Bad connector in dot1x AKM of Config response!\n");
                         goto fin;
                     }
@@ -3789,6 +4279,77 @@ fin:
     return ret;
 }
 
+/*
+ * the CA may have rolled its certs since we built our trust store. Asking
+ * it blocks the service loop so do it from a timer, not while an enrollee
+ * waits for its response, and not more than once every CA_REFRESH_INTERVAL
+ */
+#define CA_REFRESH_INTERVAL     300     /* seconds */
+static time_t last_ca_refresh = 0;
+static timerid ca_refresh_timer = 0;
+
+static void
+refresh_ca_certs (timerid id, void *unused)
+{
+    char *cacert = NULL;
+    int cacert_len;
+
+    ca_refresh_timer = 0;
+    last_ca_refresh = time(NULL);
+    if ((cacert_len = get_cacerts(&cacert, dpp_instance.caip)) < 1) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to get certs from CA!\n");
+        return;
+    }
+    if ((cacert_len != dpp_instance.cacert_len) ||
+        memcmp(cacert, dpp_instance.cacert, cacert_len)) {
+        dpp_debug(DPP_DEBUG_PKI, "CA has new certs, refreshing trust store\n");
+        if (load_trust_store(cacert, cacert_len) > 0) {
+            free(dpp_instance.cacert);
+            dpp_instance.cacert = cacert;
+            dpp_instance.cacert_len = cacert_len;
+            return;
+        }
+    }
+    free(cacert);
+}
+
+static void
+schedule_ca_refresh (void)
+{
+    time_t now = time(NULL);
+
+    if (ca_refresh_timer) {
+        return;
+    }
+    if (now - last_ca_refresh < CA_REFRESH_INTERVAL) {
+        dpp_debug(DPP_DEBUG_PKI, "checked the CA's certs %ld seconds ago, not asking again\n",
+                  (long)(now - last_ca_refresh));
+        return;
+    }
+    ca_refresh_timer = srv_add_timeout(srvctx, SRV_MSEC(1), refresh_ca_certs, NULL);
+}
+
+/*
+ * validate the chain the CA returned for an enrollee against our trust store
+ */
+static int
+check_ca_p7 (char *p7b64, int p7len)
+{
+    PKCS7 *p7;
+    STACK_OF(X509) *certs;
+    int ret = -1;
+
+    if ((p7 = decode_p7(p7b64, p7len)) == NULL) {
+        dpp_debug(DPP_DEBUG_ERR, "cannot extract PKCS7 from CA's p7!\n");
+        return -1;
+    }
+    if ((certs = p7_certs(p7)) != NULL) {
+        ret = verify_cert_bag(certs);
+    }
+    PKCS7_free(p7);
+    return ret;
+}
+
 static void
 p7fromca (int s, void *data)
 {
@@ -3800,7 +4361,13 @@ p7fromca (int s, void *data)
         generate_dpp_config_resp_frame(peer, STATUS_CONFIGURE_FAILURE);
     } else {
         dpp_debug(DPP_DEBUG_PKI, "got a %d byte PKCS7 from CA!\n", peer->p7len);
-        generate_dpp_config_resp_frame(peer, STATUS_OK);
+        if (check_ca_p7(peer->p7, peer->p7len) < 1) {
+            dpp_debug(DPP_DEBUG_ERR, "CA issued a cert we can't validate!\n");
+            generate_dpp_config_resp_frame(peer, STATUS_CONFIGURE_FAILURE);
+            schedule_ca_refresh();
+        } else {
+            generate_dpp_config_resp_frame(peer, STATUS_OK);
+        }
     }
     /*
      * generate a config response frame in the peer buffer and wait for
@@ -3829,6 +4396,7 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
     TLV *tlv;
     int ntok;
     siv_ctx ctx;
+    struct json_doc conf;
     char *sstr, *estr;
     BIGNUM *x = NULL, *y = NULL, *Sx = NULL;
     const BIGNUM *pc;
@@ -3846,19 +4414,7 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
         return -1;
     }
 
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-    }
+    siv_init(&ctx, peer->ke, dpp_instance.sivmode);
     if (siv_decrypt(&ctx, tlv->value + AES_BLOCK_SIZE, tlv->value + AES_BLOCK_SIZE,
                     TLV_length(tlv) - AES_BLOCK_SIZE, TLV_value(tlv), 0) < 1) {
         dpp_debug(DPP_DEBUG_ERR, "can't decrypt DPP Config Request frame!\n");
@@ -3897,7 +4453,7 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
         dpp_debug(DPP_DEBUG_TRACE, "enrollee sent new protocol key and POP auth tag!\n");
         if (((peer->peernewproto = EC_POINT_new(EC_KEY_get0_group(peer->mynewproto))) == NULL) ||
             ((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
-            ((hctx = HMAC_CTX_new()) == NULL)) {
+            ((hctx = scratch_hmac_ctx()) == NULL)) {
             dpp_debug(DPP_DEBUG_ERR, "internal POP error (0)!\n");
             if (x != NULL) {
                 BN_free(x);
@@ -3905,9 +4461,6 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
             if (y != NULL) {
                 BN_free(y);
             }
-            if (hctx != NULL) {
-                HMAC_CTX_free(hctx);
-            }
             return -1;
         }
         /*
@@ -3921,7 +4474,6 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
             dpp_debug(DPP_DEBUG_ERR, "unable to create peer's new protocol key!\n");
             BN_free(x);
             BN_free(y);
-            HMAC_CTX_free(hctx);
             return -1;
         }
 
@@ -3933,7 +4485,6 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
             dpp_debug(DPP_DEBUG_ERR, "internal POP error (1)!\n");
             BN_free(x);
             BN_free(y);
-            HMAC_CTX_free(hctx);
             return -1;
         }
         if (((pc = EC_KEY_get0_private_key(peer->mynewproto)) == NULL) ||
@@ -3946,7 +4497,6 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
             BN_free(Sx);
             BN_free(x);
             BN_free(y);
-            HMAC_CTX_free(hctx);
             return -1;
         }
         memset(k, 0, SHA512_DIGEST_LENGTH);
@@ -3969,7 +4519,6 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
             BN_free(Sx);
             BN_free(x);
             BN_free(y);
-            HMAC_CTX_free(hctx);
             return -1;
         }
         HMAC_Init_ex(hctx, k, dpp_instance.digestlen, dpp_instance.hashfcn, NULL);
@@ -3989,7 +4538,6 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
             BN_free(Sx);
             BN_free(x);
             BN_free(y);
-            HMAC_CTX_free(hctx);
             return -1;
         }
         memset(xoctets, 0, peer->newprimelen);
@@ -4005,7 +4553,6 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
             BN_free(Sx);
             BN_free(x);
             BN_free(y);
-            HMAC_CTX_free(hctx);
             return -1;
         }
         memset(xoctets, 0, peer->newprimelen);
@@ -4023,7 +4570,6 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
             BN_free(Sx);
             BN_free(x);
             BN_free(y);
-            HMAC_CTX_free(hctx);
             return -1;
         }
         dpp_debug(DPP_DEBUG_TRACE, "POP passed for new protocol key\n");
@@ -4033,7 +4579,6 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
         BN_free(Sx);
         BN_free(x);
         BN_free(y);
-        HMAC_CTX_free(hctx);
         tlv = TLV_next(tlv);
     }
     if (TLV_type(tlv) != CONFIG_ATTRIBUTES_OBJECT) {
@@ -4045,8 +4590,11 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
     /*
      * parse the config attributes object for some interesting info
      */
-    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                              &sstr, &estr, 1, "name")) < 1) {
+    if (json_parse(&conf, (char *)TLV_value(tlv), TLV_length(tlv)) < 1) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to parse the config attributes object!\n");
+        return -1;
+    }
+    if ((ntok = json_get(&conf, &sstr, &estr, 1, "name")) < 1) {
         return -1;
     }
     dpp_debug(DPP_DEBUG_ANY, "there are %d result(s) for 'name': %.*s\n",
@@ -4057,8 +4605,7 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
         strncpy(peer->enrollee_name, sstr, estr - sstr);
     }
 
-    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                              &sstr, &estr, 1, "netRole")) < 1) {
+    if ((ntok = json_get(&conf, &sstr, &estr, 1, "netRole")) < 1) {
         return -1;
     }
     dpp_debug(DPP_DEBUG_ANY, "there are %d result(s) for 'netRole': %.*s\n",
@@ -4070,8 +4617,7 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
     }
 
     if (dpp_instance.enterprise) {
-        if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                                  &sstr, &estr, 1, "pkcs10")) < 1) {
+        if ((ntok = json_get(&conf, &sstr, &estr, 1, "pkcs10")) < 1) {
             dpp_debug(DPP_DEBUG_TRACE, "provisioning enterprise credentials but no CSR\n");
             return 2;
         }
@@ -4083,8 +4629,7 @@ process_dpp_config_request (struct candidate *peer, unsigned char *attrs, int le
         return 1;
     }
 
-    if ((ntok = get_json_data((char *)TLV_value(tlv), TLV_length(tlv),
-                              &sstr, &estr, 1, "mudurl")) > 0) {
+    if ((ntok = json_get(&conf, &sstr, &estr, 1, "mudurl")) > 0) {
         dpp_debug(DPP_DEBUG_TRACE, "got a MUD URL of %.*s\n",
                   estr - sstr, sstr);
 // TODO: when we handle pending responses do this
@@ -4376,18 +4921,18 @@ static int
 generate_auth (struct candidate *peer, int initiators, unsigned char *auth)
 {
     int offset;
-    BIGNUM *x = NULL;
-    unsigned char *xoctets = NULL, finaloctet;
+    BIGNUM *x;
+    unsigned char xoctets[P521_COORD_LEN], finaloctet;
     unsigned int mdlen = 0;
-    EVP_MD_CTX *mdctx = NULL;
+    EVP_MD_CTX *mdctx;
     const EC_POINT *boot, *pub;
     
-    if (((x = BN_new()) == NULL) || ((mdctx = EVP_MD_CTX_new()) == NULL) ||
-        ((xoctets = (unsigned char *)malloc(dpp_instance.primelen)) == NULL)) {
+    BN_CTX_start(bnctx);
+    if (((x = BN_CTX_get(bnctx)) == NULL) || ((mdctx = scratch_md_ctx()) == NULL)) {
         goto fin;
     }
 
-    EVP_DigestInit(mdctx, dpp_instance.hashfcn);
+    EVP_DigestInit_ex(mdctx, dpp_instance.hashfcn, NULL);
     finaloctet = initiators;
     if (initiators != peer->is_initiator) {
         EVP_DigestUpdate(mdctx, peer->mynonce, dpp_instance.noncelen);
@@ -4527,18 +5072,10 @@ generate_auth (struct candidate *peer, int initiators, unsigned char *auth)
     EVP_DigestUpdate(mdctx, &finaloctet, 1);
     debug_buffer(DPP_DEBUG_TRACE, "final octet", &finaloctet, 1);
     mdlen = dpp_instance.digestlen;
-    EVP_DigestFinal(mdctx, auth, &mdlen);
+    EVP_DigestFinal_ex(mdctx, auth, &mdlen);
 
 fin:
-    if (x != NULL) {
-        BN_free(x);
-    }
-    if (mdctx != NULL) {
-        EVP_MD_CTX_free(mdctx);
-    }
-    if (xoctets != NULL) {
-        free(xoctets);
-    }
+    BN_CTX_end(bnctx);
     return mdlen;
 }
 
@@ -4547,12 +5084,8 @@ static int
 compute_ke (struct candidate *peer, BIGNUM *n, BIGNUM *l)
 {
     int offset;
-    unsigned char salt[SHA512_DIGEST_LENGTH], *ikm, *ptr;
+    unsigned char salt[SHA512_DIGEST_LENGTH], ikm[3 * P521_COORD_LEN], *ptr;
 
-    if ((ikm = (unsigned char *)malloc(3 * dpp_instance.primelen)) == NULL) {
-        dpp_debug(DPP_DEBUG_ERR, "unable to malloc space to compute ke!\n");
-        return 0;
-    }
     /*
      * construct ikm as (M.x | N.x | L.x)
      */
@@ -4602,9 +5135,7 @@ compute_ke (struct candidate *peer, BIGNUM *n, BIGNUM *l)
                     (unsigned char *)"DPP Key", strlen("DPP Key"),
                     peer->ke, dpp_instance.digestlen);
     }
-    if (ikm != NULL) {
-        free(ikm);
-    }
+    OPENSSL_cleanse(ikm, sizeof(ikm));
     return 1;
 }
 
@@ -4692,20 +5223,7 @@ send_dpp_auth_confirm (struct candidate *peer, unsigned char status)
          */
         ieeeize_hton_attributes(attrs, peer->bufferlen);
 
-        switch(dpp_instance.digestlen) {
-            case SHA256_DIGEST_LENGTH:
-                siv_init(&ctx, peer->ke, SIV_256);
-                break;
-            case SHA384_DIGEST_LENGTH:
-                siv_init(&ctx, peer->ke, SIV_384);
-                break;
-            case SHA512_DIGEST_LENGTH:
-                siv_init(&ctx, peer->ke, SIV_512);
-                break;
-            default:
-                dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-                goto fin;
-        }
+        siv_init(&ctx, peer->ke, dpp_instance.sivmode);
         siv_encrypt(&ctx, ptr + AES_BLOCK_SIZE, ptr + AES_BLOCK_SIZE,
                     dpp_instance.digestlen + sizeof(TLV), ptr, 
                     2, peer->frame, sizeof(dpp_action_frame), attrs, aadlen);
@@ -4727,20 +5245,7 @@ send_dpp_auth_confirm (struct candidate *peer, unsigned char status)
          */
         ieeeize_hton_attributes(attrs, peer->bufferlen);
 
-        switch(dpp_instance.digestlen) {
-            case SHA256_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k2, SIV_256);
-                break;
-            case SHA384_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k2, SIV_384);
-                break;
-            case SHA512_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k2, SIV_512);
-                break;
-            default:
-                dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-                goto fin;
-        }
+        siv_init(&ctx, peer->k2, dpp_instance.sivmode);
         siv_encrypt(&ctx, ptr + AES_BLOCK_SIZE, ptr + AES_BLOCK_SIZE,
                     dpp_instance.digestlen + sizeof(TLV), ptr, 
                     2, peer->frame, sizeof(dpp_action_frame), attrs, aadlen);
@@ -4758,7 +5263,7 @@ static int
 send_dpp_auth_response (struct candidate *peer, unsigned char status)
 {
     siv_ctx ctx;
-    unsigned char *n1 = NULL;
+    unsigned char n1[P521_COORD_LEN];
     unsigned char bootkeyhash[SHA256_DIGEST_LENGTH], *ptr, capabilities;
     unsigned char *primary, *secondary, *attrs;
     const EC_POINT *Pr, *Bi;
@@ -4768,10 +5273,13 @@ send_dpp_auth_response (struct candidate *peer, unsigned char status)
     TLV *tlv, *primarywrap, *secondarywrap;
     int offset, success = 0, primarywraplen;
 
+    BN_CTX_start(bnctx);
+    point_pool_start(ppool);
     capabilities = peer->core;
     if (status == STATUS_OK) {
-        if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) || ((n = BN_new()) == NULL) ||
-            ((N = EC_POINT_new(dpp_instance.group)) == NULL) || ((order = BN_new()) == NULL)) {
+        if (((x = BN_CTX_get(bnctx)) == NULL) || ((y = BN_CTX_get(bnctx)) == NULL) ||
+            ((n = BN_CTX_get(bnctx)) == NULL) || ((order = BN_CTX_get(bnctx)) == NULL) ||
+            ((N = point_pool_get(ppool)) == NULL)) {
             dpp_debug(DPP_DEBUG_ERR, "unable to create bignums to construct DPP Auth Resp!\n");
             goto fin;
         }
@@ -4779,13 +5287,13 @@ send_dpp_auth_response (struct candidate *peer, unsigned char status)
          * only needed if we're doing mutual authentication
          */
         if (peer->mauth) {
-            if (((priv = BN_new()) == NULL) ||
-                ((l = BN_new()) == NULL) || ((L = EC_POINT_new(dpp_instance.group)) == NULL)) {
+            if (((priv = BN_CTX_get(bnctx)) == NULL) ||
+                ((l = BN_CTX_get(bnctx)) == NULL) || ((L = point_pool_get(ppool)) == NULL)) {
                 goto fin;
             }
         }
 
-        if (((peer->my_proto = EC_KEY_new_by_curve_name(dpp_instance.nid)) == NULL) ||
+        if (((peer->my_proto = new_dpp_key(dpp_instance.nid)) == NULL) ||
             !EC_KEY_generate_key(peer->my_proto) ||
             ((Pr = EC_KEY_get0_public_key(peer->my_proto)) == NULL) ||
             ((pr = EC_KEY_get0_private_key(peer->my_proto)) == NULL) ||
@@ -4801,10 +5309,6 @@ send_dpp_auth_response (struct candidate *peer, unsigned char status)
             dpp_debug(DPP_DEBUG_ERR, "unable to compute N!\n");
             goto fin;
         }
-        if ((n1 = (unsigned char *)malloc(dpp_instance.primelen)) == NULL) {
-            dpp_debug(DPP_DEBUG_ERR, "unable to malloc data to compute k2\n");
-            goto fin;
-        }
         memset(n1, 0, dpp_instance.primelen);
         offset = dpp_instance.primelen - BN_num_bytes(n);
         BN_bn2bin(n, n1 + offset);
@@ -4964,20 +5468,7 @@ send_dpp_auth_response (struct candidate *peer, unsigned char status)
         /*
          * now encrypt the secondary wrapping in ke
          */
-        switch(dpp_instance.digestlen) {
-            case SHA256_DIGEST_LENGTH:
-                siv_init(&ctx, peer->ke, SIV_256);
-                break;
-            case SHA384_DIGEST_LENGTH:
-                siv_init(&ctx, peer->ke, SIV_384);
-                break;
-            case SHA512_DIGEST_LENGTH:
-                siv_init(&ctx, peer->ke, SIV_512);
-                break;
-            default:
-                dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-                goto fin;
-        }
+        siv_init(&ctx, peer->ke, dpp_instance.sivmode);
         /*
          * no AAD in this inner wrapped data
          */
@@ -4990,20 +5481,7 @@ send_dpp_auth_response (struct candidate *peer, unsigned char status)
         /*
          * and encrypt the whole thing with k2
          */
-        switch(dpp_instance.digestlen) {
-            case SHA256_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k2, SIV_256);
-                break;
-            case SHA384_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k2, SIV_384);
-                break;
-            case SHA512_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k2, SIV_512);
-                break;
-            default:
-                dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-                goto fin;
-        }
+        siv_init(&ctx, peer->k2, dpp_instance.sivmode);
         siv_encrypt(&ctx, primary + AES_BLOCK_SIZE, primary + AES_BLOCK_SIZE,
                     primarywraplen - AES_BLOCK_SIZE, primary, 
                     2, peer->frame, sizeof(dpp_action_frame), attrs, ((unsigned char *)tlv - attrs));
@@ -5021,20 +5499,7 @@ send_dpp_auth_response (struct candidate *peer, unsigned char status)
          */
         ieeeize_hton_attributes(primary + AES_BLOCK_SIZE, (int)(ptr - (primary + AES_BLOCK_SIZE)));
         
-        switch(dpp_instance.digestlen) {
-            case SHA256_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k1, SIV_256);
-                break;
-            case SHA384_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k1, SIV_384);
-                break;
-            case SHA512_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k1, SIV_512);
-                break;
-            default:
-                dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-                goto fin;
-        }
+        siv_init(&ctx, peer->k1, dpp_instance.sivmode);
         siv_encrypt(&ctx, primary + AES_BLOCK_SIZE, primary + AES_BLOCK_SIZE,
                     primarywraplen - AES_BLOCK_SIZE, primary,
                     2, peer->frame, sizeof(dpp_action_frame), attrs, ((unsigned char *)tlv - attrs));
@@ -5048,33 +5513,9 @@ send_dpp_auth_response (struct candidate *peer, unsigned char status)
     }
     
 fin:
-    if (x != NULL) {
-        BN_free(x);
-    }
-    if (y != NULL) {
-        BN_free(y);
-    }
-    if (n != NULL) {
-        BN_free(n);
-    }
-    if (l != NULL) {
-        BN_free(l);
-    }
-    if (priv != NULL) {
-        BN_free(priv);
-    }
-    if (order != NULL) {
-        BN_free(order);
-    }
-    if (n1 != NULL) {
-        free(n1);
-    }
-    if (N != NULL) {
-        EC_POINT_free(N);
-    }
-    if (L != NULL) {
-        EC_POINT_free(L);
-    }
+    OPENSSL_cleanse(n1, sizeof(n1));
+    point_pool_end(ppool);
+    BN_CTX_end(bnctx);
     return success;
 }
 
@@ -5089,7 +5530,7 @@ send_dpp_auth_request (struct candidate *peer)
     unsigned short wrapped_len;
     EC_POINT *M = NULL;
     BIGNUM *x = NULL, *y = NULL;
-    unsigned char *m1 = NULL;
+    unsigned char m1[P521_COORD_LEN];
     TLV *tlv;
     int offset, success = 0;
 
@@ -5106,7 +5547,7 @@ send_dpp_auth_request (struct candidate *peer)
         dpp_debug(DPP_DEBUG_ERR, "unable to create bignums to initiate DPP!\n");
         goto fin;
     }
-    if (((peer->my_proto = EC_KEY_new_by_curve_name(dpp_instance.nid)) == NULL) ||
+    if (((peer->my_proto = new_dpp_key(dpp_instance.nid)) == NULL) ||
         !EC_KEY_generate_key(peer->my_proto) ||
         ((pub = EC_KEY_get0_public_key(peer->my_proto)) == NULL) ||
         ((priv = EC_KEY_get0_private_key(peer->my_proto)) == NULL) ||
@@ -5127,10 +5568,6 @@ send_dpp_auth_request (struct candidate *peer)
         dpp_debug(DPP_DEBUG_ERR, "unable to compute M to initiate DPP!\n");
         goto fin;
     }
-    if ((m1 = (unsigned char *)malloc(dpp_instance.primelen)) == NULL) {
-        dpp_debug(DPP_DEBUG_ERR, "unable to allocate m1 to initiate DPP!\n");
-        goto fin;
-    }
     memset(m1, 0, dpp_instance.primelen);
     offset = dpp_instance.primelen - BN_num_bytes(peer->m);
     BN_bn2bin(peer->m, m1 + offset);
@@ -5142,20 +5579,7 @@ send_dpp_auth_request (struct candidate *peer)
 
     debug_buffer(DPP_DEBUG_TRACE, "k1", peer->k1, dpp_instance.digestlen);
     
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->k1, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->k1, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->k1, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-            goto fin;
-    }
+    siv_init(&ctx, peer->k1, dpp_instance.sivmode);
 
     /*
      * get our wrapped TLVs set up
@@ -5281,9 +5705,7 @@ fin:
     if (M != NULL) {
         EC_POINT_free(M);
     }
-    if (m1 != NULL) {
-        free(m1);
-    }
+    OPENSSL_cleanse(m1, sizeof(m1));
     return success;
 }
 
@@ -5346,20 +5768,7 @@ process_dpp_auth_confirm (struct candidate *peer, dpp_action_frame *frame, int f
     if (TLV_type(tlv) != WRAPPED_DATA) {
         goto fin;
     }
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-            goto fin;
-    }
+    siv_init(&ctx, peer->ke, dpp_instance.sivmode);
     if (siv_decrypt(&ctx, TLV_value(tlv) + AES_BLOCK_SIZE, TLV_value(tlv) + AES_BLOCK_SIZE,
                     TLV_length(tlv) - AES_BLOCK_SIZE, TLV_value(tlv), 
                     2, frame, sizeof(dpp_action_frame), attrs, (unsigned char *)tlv - attrs) < 1) {
@@ -5395,7 +5804,7 @@ static int
 process_dpp_auth_response (struct candidate *peer, dpp_action_frame *frame, int framelen)
 {
     int ret = -1, primarywraplen = 0, offset, len;
-    unsigned char bootkeyhash[SHA256_DIGEST_LENGTH], *ptr, *val, *n1 = NULL;
+    unsigned char bootkeyhash[SHA256_DIGEST_LENGTH], *ptr, *val, n1[P521_COORD_LEN];
     unsigned char respauth[SHA512_DIGEST_LENGTH], *attrs;
     EC_POINT *N = NULL, *L = NULL, *Pub = NULL;
     BIGNUM *x = NULL, *y = NULL, *n = NULL, *l = NULL;
@@ -5484,20 +5893,7 @@ process_dpp_auth_response (struct candidate *peer, dpp_action_frame *frame, int
         /*
          * status is bad so decrypt data wrapped with k1
          */
-        switch(dpp_instance.digestlen) {
-            case SHA256_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k1, SIV_256);
-                break;
-            case SHA384_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k1, SIV_384);
-                break;
-            case SHA512_DIGEST_LENGTH:
-                siv_init(&ctx, peer->k1, SIV_512);
-                break;
-            default:
-                dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-                goto fin;
-        }
+        siv_init(&ctx, peer->k1, dpp_instance.sivmode);
         /*
          * find the wrapped data...
          */
@@ -5576,10 +5972,6 @@ process_dpp_auth_response (struct candidate *peer, dpp_action_frame *frame, int
     /*
      * compute k2
      */
-    if ((n1 = (unsigned char *)malloc(dpp_instance.primelen)) == NULL) {
-        dpp_debug(DPP_DEBUG_ERR, "unable to malloc data to compute k2\n");
-        goto fin;
-    }
     memset(n1, 0, dpp_instance.primelen);
     offset = dpp_instance.primelen - BN_num_bytes(n);
     BN_bn2bin(n, n1 + offset);
@@ -5589,20 +5981,7 @@ process_dpp_auth_response (struct candidate *peer, dpp_action_frame *frame, int
 
     debug_buffer(DPP_DEBUG_TRACE, "k2", peer->k2, dpp_instance.digestlen);
 
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->k2, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->k2, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->k2, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-            goto fin;
-    }
+    siv_init(&ctx, peer->k2, dpp_instance.sivmode);
     /*
      * find the wrapped data...
      */
@@ -5708,20 +6087,7 @@ process_dpp_auth_response (struct candidate *peer, dpp_action_frame *frame, int
      
     debug_buffer(DPP_DEBUG_TRACE, "ke", peer->ke, dpp_instance.digestlen);
     
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->ke, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-            goto fin;
-    }
+    siv_init(&ctx, peer->ke, dpp_instance.sivmode);
 
     /*
      * no AAD on inner wrapped data, just unwrap it
@@ -5776,28 +6142,28 @@ process_dpp_auth_response (struct candidate *peer, dpp_action_frame *frame, int
     if (Pub != NULL) {
         EC_POINT_free(Pub);
     }
-    if (n1 != NULL) {
-        free(n1);
-    }
+    OPENSSL_cleanse(n1, sizeof(n1));
     return ret;
 }
 
 static int
 process_dpp_auth_request (struct candidate *peer, dpp_action_frame *frame, int framelen)
 {
-    unsigned char bootkeyhash[SHA256_DIGEST_LENGTH], *ptr, *m1 = NULL, *attrs;
+    unsigned char bootkeyhash[SHA256_DIGEST_LENGTH], *ptr, m1[P521_COORD_LEN], *attrs;
     siv_ctx ctx;
     int ret = 0, offset, len;
     TLV *tlv;
     unsigned char opclass, channel;
     const BIGNUM *priv;
-    EC_POINT *M = NULL;
-    BIGNUM *x = NULL, *y = NULL;
+    EC_POINT *M;
+    BIGNUM *x, *y;
 
     attrs = frame->attributes;
     len = framelen - sizeof(dpp_action_frame);
-    if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
-        ((M = EC_POINT_new(dpp_instance.group)) == NULL)) {
+    BN_CTX_start(bnctx);
+    point_pool_start(ppool);
+    if (((x = BN_CTX_get(bnctx)) == NULL) || ((y = BN_CTX_get(bnctx)) == NULL) ||
+        ((M = point_pool_get(ppool)) == NULL)) {
         dpp_debug(DPP_DEBUG_ERR, "can't malloc bignums!\n");
         goto fin;
     }
@@ -5884,10 +6250,6 @@ process_dpp_auth_request (struct candidate *peer, dpp_action_frame *frame, int f
         dpp_debug(DPP_DEBUG_ERR, "unable to compute intermediate key M\n");
         goto fin;
     }
-    if ((m1 = (unsigned char *)malloc(dpp_instance.primelen)) == NULL) {
-        dpp_debug(DPP_DEBUG_ERR, "unable to alloc m1 to process DPP Auth Req\n");
-        goto fin;
-    }
     memset(m1, 0, dpp_instance.primelen);
     offset = dpp_instance.primelen - BN_num_bytes(peer->m);
     BN_bn2bin(peer->m, m1 + offset);
@@ -5897,20 +6259,7 @@ process_dpp_auth_request (struct candidate *peer, dpp_action_frame *frame, int f
 
     debug_buffer(DPP_DEBUG_TRACE, "k1", peer->k1, dpp_instance.digestlen);
     
-    switch(dpp_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->k1, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->k1, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->k1, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", dpp_instance.digestlen);
-            goto fin;
-    }
+    siv_init(&ctx, peer->k1, dpp_instance.sivmode);
     if ((tlv = find_tlv(WRAPPED_DATA, attrs, len)) == NULL) {
         dpp_debug(DPP_DEBUG_ERR, "can't find wrapped data in DPP Auth Request!\n");
         goto fin;
@@ -5997,21 +6346,20 @@ process_dpp_auth_request (struct candidate *peer, dpp_action_frame *frame, int f
             goto fin;
         }
     }
+    /*
+     * if this is an answer to a chirp remember where it came
+     */
+    if (do_chirp && peer->chirpfreq) {
+        chirp_answered(peer->chirpfreq);
+        peer->chirpfreq = 0;
+        peer->chirpround = 0;
+    }
 
     ret = 1;
 fin:
-    if (m1 != NULL) {
-        free(m1);
-    }
-    if (x != NULL) {
-        BN_free(x);
-    }
-    if (y != NULL) {
-        BN_free(y);
-    }
-    if (M != NULL) {
-        EC_POINT_free(M);
-    }
+    OPENSSL_cleanse(m1, sizeof(m1));
+    point_pool_end(ppool);
+    BN_CTX_end(bnctx);
     return ret;
 }
 
@@ -6171,32 +6519,45 @@ init_dpp_auth (timerid id, void *data)
     return;
 }
 
-dpp_handle
-dpp_create_peer (char *keyb64, int initiator, int mutualauth, int mtu)
+/*
+ * create a peer to do DPP Authentication with, peerkey is its bootstrapping
+ * key (if we know it) and from here on belongs to the peer
+ */
+static dpp_handle
+create_peer (EC_KEY *peerkey, int initiator, int mutualauth, int mtu)
 {
     struct candidate *peer;
     const BIGNUM *priv;
-    int asn1len;
-    const unsigned char *kptr;
-    unsigned char keyasn1[1024];
 
     if (!dpp_initialized) {
+        EC_KEY_free(peerkey);
+        return -1;
+    }
+    if ((peerkey == NULL) && initiator) {
+        dpp_debug(DPP_DEBUG_ERR, "Initiator needs responder's bootstrapping key!\n");
         return -1;
     }
     
     if ((peer = (struct candidate *)malloc(sizeof(struct candidate))) == NULL) {
+        EC_KEY_free(peerkey);
         return -1;
     }
     if ((peer->peer_proto = EC_POINT_new(dpp_instance.group)) == NULL) {
+        EC_KEY_free(peerkey);
         free(peer);
         return -1;
     }
     if ((peer->m = BN_new()) == NULL) {
+        EC_KEY_free(peerkey);
         EC_POINT_free(peer->peer_proto);
         free(peer);
         return -1;
     }
     peer->t0 = 0;
+    peer->chirpto = NULL;
+    peer->chirpfreq = 0;
+    peer->chirpround = 0;
+    point_pool_stats(ppool, &peer->poolgets, &peer->poolallocs);
     peer->my_proto = NULL;
     peer->peernewproto = NULL;
     peer->mynewproto = NULL;
@@ -6209,6 +6570,7 @@ dpp_create_peer (char *keyb64, int initiator, int mutualauth, int mtu)
     if (mtu) {
         if (mtu > 8192) {
             dpp_debug(DPP_DEBUG_ANY, "cannot have an MTU of %d\n", mtu);
+            EC_KEY_free(peerkey);
             free(peer);
             return -1;
         }
@@ -6217,6 +6579,7 @@ dpp_create_peer (char *keyb64, int initiator, int mutualauth, int mtu)
         peer->mtu = 8192;
     }
     if ((peer->frame = malloc(peer->mtu)) == NULL) {
+        EC_KEY_free(peerkey);
         free(peer);
         return -1;
     }
@@ -6236,29 +6599,11 @@ dpp_create_peer (char *keyb64, int initiator, int mutualauth, int mtu)
     debug_ec_key(DPP_DEBUG_TRACE, "my public bootstrap key", dpp_instance.bootstrap);
     debug_asn1_ec(DPP_DEBUG_TRACE, "DER encoded ASN.1", dpp_instance.bootstrap, 0);
 
-    if (keyb64 != NULL) { 
-        /*
-         * so get the peer's bootstrap key
-         */
-        if ((asn1len = EVP_DecodeBlock(keyasn1, (unsigned char *)keyb64, strlen(keyb64))) < 0) {
-            dpp_debug(DPP_DEBUG_ERR, "unable to decode bootstrap key\n");
-            EC_POINT_free(peer->peer_proto);
-            free(peer);
-            return -1;
-        }
-        kptr = keyasn1;
-        peer->peer_bootstrap = d2i_EC_PUBKEY(NULL, &kptr, asn1len);
-    
-        EC_KEY_set_conv_form(peer->peer_bootstrap, POINT_CONVERSION_COMPRESSED);
-        EC_KEY_set_asn1_flag(peer->peer_bootstrap, OPENSSL_EC_NAMED_CURVE);
+    if (peerkey != NULL) { 
+        peer->peer_bootstrap = peerkey;
         debug_ec_key(DPP_DEBUG_TRACE, "peer's bootstrap key", peer->peer_bootstrap);
         debug_asn1_ec(DPP_DEBUG_TRACE, "DER encoded ASN.1", peer->peer_bootstrap, 0);
-    } else if (peer->is_initiator) {
-        dpp_debug(DPP_DEBUG_ERR, "Initiator needs responder's bootstrapping key!\n");
-        EC_POINT_free(peer->peer_proto);
-        free(peer);
-        return -1;
-    } 
+    }
     
     configurator_signkey = NULL;  // even if this is a configurator, used by discovery
     connector = NULL;
@@ -6286,6 +6631,47 @@ dpp_create_peer (char *keyb64, int initiator, int mutualauth, int mtu)
     return peer->handle;
 }
 
+dpp_handle
+dpp_create_peer (char *keyb64, int initiator, int mutualauth, int mtu)
+{
+    EC_KEY *peerkey = NULL;
+    int asn1len;
+    const unsigned char *kptr;
+    unsigned char keyasn1[1024];
+
+    if (keyb64 != NULL) { 
+        /*
+         * so get the peer's bootstrap key
+         */
+        if ((asn1len = EVP_DecodeBlock(keyasn1, (unsigned char *)keyb64, strlen(keyb64))) < 0) {
+            dpp_debug(DPP_DEBUG_ERR, "unable to decode bootstrap key\n");
+            return -1;
+        }
+        kptr = keyasn1;
+        if ((peerkey = d2i_EC_PUBKEY(NULL, &kptr, asn1len)) == NULL) {
+            dpp_debug(DPP_DEBUG_ERR, "unable to decode bootstrap key\n");
+            return -1;
+        }
+        EC_KEY_set_conv_form(peerkey, POINT_CONVERSION_COMPRESSED);
+        EC_KEY_set_asn1_flag(peerkey, OPENSSL_EC_NAMED_CURVE);
+    }
+    return create_peer(peerkey, initiator, mutualauth, mtu);
+}
+
+/*
+ * same as dpp_create_peer() but with a key that's already been decoded
+ * (compressed, named curve), the caller keeps its reference and the peer
+ * only reads it
+ */
+dpp_handle
+dpp_create_peer_by_key (EC_KEY *peerkey, int initiator, int mutualauth, int mtu)
+{
+    if ((peerkey != NULL) && !EC_KEY_up_ref(peerkey)) {
+        return -1;
+    }
+    return create_peer(peerkey, initiator, mutualauth, mtu);
+}
+
 void
 dpp_free_peer (dpp_handle handle)
 {
@@ -6307,8 +6693,8 @@ dpp_free_peer (dpp_handle handle)
     return;
 }
 
-void
-dpp_add_chirp_freq (unsigned char *bssid, unsigned long freq)
+static struct chirpdest *
+add_chirp_dest (unsigned char *bssid, unsigned long freq)
 {
     struct chirpdest *chirpto;
 
@@ -6317,16 +6703,71 @@ dpp_add_chirp_freq (unsigned char *bssid, unsigned long freq)
      */
     TAILQ_FOREACH(chirpto, &chirpdests, entry) {
         if (chirpto->freq == freq) {
-            return;
+            return chirpto;
         }
     }
+    if (nchirpdests == CHIRP_MAX_CHANNELS) {
+        return NULL;
+    }
     if ((chirpto = (struct chirpdest *)malloc(sizeof(struct chirpdest))) == NULL) {
-        return;
+        return NULL;
+    }
+    if (bssid != NULL) {
+        memcpy(chirpto->bssid, bssid, ETH_ALEN);
+    } else {
+        memset(chirpto->bssid, 0, ETH_ALEN);
     }
-    memcpy(chirpto->bssid, bssid, ETH_ALEN);
     chirpto->freq = freq;
+    chirpto->answers = 0;
     TAILQ_INSERT_TAIL(&chirpdests, chirpto, entry);
-    return;
+    nchirpdests++;
+    return chirpto;
+}
+
+void
+dpp_add_chirp_freq (unsigned char *bssid, unsigned long freq)
+{
+    (void)add_chirp_dest(bssid, freq);
+}
+
+/*
+ * chirping backs off from backoff_min up to backoff_max seconds between
+ * rounds. If there's a history file then channels where configurators
+ * answered before get added to the chirp list and are chirped on first,
+ * and new answers get written back out to it.
+ */
+void
+dpp_set_chirp_schedule (char *history, int backoff_min, int backoff_max)
+{
+    struct chirpdest *chirpto;
+    unsigned long freq;
+    unsigned int answers;
+    FILE *fp;
+
+    if (backoff_min > 0) {
+        chirp_backoff_min = backoff_min;
+    }
+    if (backoff_max > 0) {
+        chirp_backoff_max = backoff_max;
+    }
+    if (chirp_backoff_max < chirp_backoff_min) {
+        chirp_backoff_max = chirp_backoff_min;
+    }
+    if (history == NULL) {
+        return;
+    }
+    strncpy(chirp_history, history, sizeof(chirp_history) - 1);
+    if ((fp = fopen(chirp_history, "r")) == NULL) {
+        return;
+    }
+    while (fscanf(fp, "%lu %u", &freq, &answers) == 2) {
+        if ((chirpto = add_chirp_dest(NULL, freq)) != NULL) {
+            chirpto->answers = answers;
+            dpp_debug(DPP_DEBUG_TRACE, "configurators answered %d chirps on %ld\n",
+                      answers, freq);
+        }
+    }
+    fclose(fp);
 }
 
 static void
@@ -6352,7 +6793,9 @@ dpp_initialize (int core, char *keyfile, char *signkeyfile, int newgrp,
     FILE *fp;
     BIO *bio = NULL;
     int ret = 0;
+    long usecs, bytes;
     struct cpolicy cp, *pol;
+    char *slash;
 
     /*
      * initialize globals 
@@ -6366,6 +6809,12 @@ dpp_initialize (int core, char *keyfile, char *signkeyfile, int newgrp,
      * set defaults and read in config
      */
     debug = verbosity;
+    if ((slash = strrchr(keyfile, '/')) != NULL) {
+        snprintf(csrkey_hint_file, sizeof(csrkey_hint_file), "%.*s/%s",
+                 (int)(slash - keyfile), keyfile, CSRKEY_HINT_FILE);
+    } else {
+        snprintf(csrkey_hint_file, sizeof(csrkey_hint_file), "%s", CSRKEY_HINT_FILE);
+    }
     TAILQ_INIT(&chirpdests);
     TAILQ_INIT(&cpolicies);
     do_chirp = chirp;
@@ -6448,6 +6897,7 @@ dpp_initialize (int core, char *keyfile, char *signkeyfile, int newgrp,
             strcpy(dpp_instance.caip, caip);
             dpp_debug(DPP_DEBUG_TRACE, "got a %d byte cert from CA (via %s)\n",
                       dpp_instance.cacert_len, caip);
+            (void)load_trust_store(dpp_instance.cacert, dpp_instance.cacert_len);
         }
     }
 
@@ -6475,6 +6925,11 @@ dpp_initialize (int core, char *keyfile, char *signkeyfile, int newgrp,
         ret = -1;
         goto fin;
     }
+    if ((ppool = point_pool_new(dpp_instance.group)) == NULL) {
+        fprintf(stderr, "DPP: unable to create pool of scratch points!\n");
+        ret = -1;
+        goto fin;
+    }
     dpp_instance.nid = EC_GROUP_get_curve_name(dpp_instance.group);
     switch (dpp_instance.nid) {
         case NID_X9_62_prime256v1:
@@ -6524,9 +6979,44 @@ dpp_initialize (int core, char *keyfile, char *signkeyfile, int newgrp,
             ret = -1;
             goto fin;
     }
+    /*
+     * the AES-SIV mode follows from the digest so figure it out once
+     */
+    switch (dpp_instance.digestlen) {
+        case SHA256_DIGEST_LENGTH:
+            dpp_instance.sivmode = SIV_256;
+            break;
+        case SHA384_DIGEST_LENGTH:
+            dpp_instance.sivmode = SIV_384;
+            break;
+        default:
+            dpp_instance.sivmode = SIV_512;
+            break;
+    }
 
     dpp_instance.primelen = prime_len_by_curve(dpp_instance.group_num);
 
+    /*
+     * chirps are always the same so hash them once
+     */
+    if (do_chirp && (hash_bootstrap_key(dpp_instance.bootstrap, "chirp", chirp_hash) < 1)) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to compute the chirp!\n");
+        ret = -1;
+        goto fin;
+    }
+
+    /*
+     * every protocol key we generate is a multiplication of the generator
+     * so build a group with a table of multiples of it to use for the
+     * life of the process
+     */
+    if ((dppgroup = precomputed_group(dpp_instance.nid, bnctx, &usecs, &bytes)) == NULL) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to precompute generator multiples!\n");
+    } else {
+        dpp_debug(DPP_DEBUG_CRYPTO, "precomputed group %d generator in %ld usec, %ld bytes\n",
+                  dpp_instance.group_num, usecs, bytes);
+    }
+
     /*
      * if we're the configurator and were initialized to ask for a new key
      * make sure it differs from our bootstrapping key, if not don't ask
@@ -6535,6 +7025,11 @@ dpp_initialize (int core, char *keyfile, char *signkeyfile, int newgrp,
         if (dpp_instance.group_num == dpp_instance.newgroup) {
             dpp_instance.newgroup = 0;
         } else {
+            if ((newdppgroup = precomputed_group(nid_by_group(dpp_instance.newgroup), bnctx,
+                                                 &usecs, &bytes)) != NULL) {
+                dpp_debug(DPP_DEBUG_CRYPTO, "precomputed group %d generator in %ld usec, %ld bytes\n",
+                          dpp_instance.newgroup, usecs, bytes);
+            }
             /*
              * if we are gonna ask, then generate a keypair on the new curve
              */
@@ -6551,6 +7046,7 @@ dpp_initialize (int core, char *keyfile, char *signkeyfile, int newgrp,
         EVP_add_digest(EVP_sha256());   /* to hash bootstrapping keys */
     }
     TAILQ_INIT(&dpp_instance.peers);
+    schedule_csr_keygen();
     ret = 1;
 fin:
     return ret;
@@ -43,7 +43,9 @@ typedef unsigned int dpp_handle;
  */
 int dpp_initialize(int, char *, char *, int, char *, char *, int, char *, int, int, int);
 void dpp_add_chirp_freq(unsigned char *, unsigned long);
+void dpp_set_chirp_schedule(char *, int, int);
 dpp_handle dpp_create_peer(unsigned char *, int, int, int);
+dpp_handle dpp_create_peer_by_key(EC_KEY *, int, int, int);
 void dpp_free_peer(dpp_handle);
 int process_dpp_auth_frame(unsigned char *, int, dpp_handle);
 int process_dpp_config_frame(unsigned char, unsigned char *, int, dpp_handle);
@@ -51,5 +53,8 @@ int process_dpp_discovery_frame(unsigned char *, int, unsigned char,
                                 unsigned char *, unsigned char *);
 unsigned char get_dpp_discovery_tid(void);
 int dpp_begin_discovery(unsigned char);
+void dpp_set_pmksa_lifetime(int);
+int dpp_add_pmksa(unsigned char *, unsigned char *, unsigned char *);
+int dpp_get_pmksa_by_mac(unsigned char *, unsigned char *, unsigned char *);
 
 #endif  /* _DPP_H_ */
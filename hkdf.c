@@ -37,40 +37,76 @@
 #include <openssl/hmac.h>
 #include <openssl/sha.h>
 
+/*
+ * the daemons are single threaded so one HMAC context and one digest
+ * context, allocated the first time they're needed, serve every KDF,
+ * HMAC and hash in the process. None of them nest so they're safe to
+ * share.
+ */
+static HMAC_CTX *hmac_scratch = NULL;
+static EVP_MD_CTX *md_scratch = NULL;
+static const unsigned char zeros[EVP_MAX_MD_SIZE] = { 0 };
+
+/*
+ * the HMAC context, callers HMAC_Init_ex() it with their key and must
+ * HMAC_Final() before calling anything else that might want it.
+ */
+HMAC_CTX *
+scratch_hmac_ctx (void)
+{
+    if ((hmac_scratch == NULL) && ((hmac_scratch = HMAC_CTX_new()) == NULL)) {
+        perror("HMAC_CTX_new()");
+    }
+    return hmac_scratch;
+}
+
+/*
+ * a reusable digest context for the hash helpers elsewhere, it's reset
+ * before being handed out so callers just EVP_DigestInit_ex() it and must
+ * finish with it before calling anything else that might want it.
+ */
+EVP_MD_CTX *
+scratch_md_ctx (void)
+{
+    if (md_scratch == NULL) {
+        if ((md_scratch = EVP_MD_CTX_new()) == NULL) {
+            perror("EVP_MD_CTX_new()");
+            return NULL;
+        }
+    } else {
+        EVP_MD_CTX_reset(md_scratch);
+    }
+    return md_scratch;
+}
+
 int
 hkdf_extract (const EVP_MD *h,
               unsigned char *salt, int saltlen,
               unsigned char *ikm, int ikmlen,
               unsigned char *prk)               // prklen depnds on h
 {
-    unsigned char *tweak;
+    const unsigned char *tweak;
     unsigned int prklen;
     int tweaklen;
     HMAC_CTX *ctx;
 
     prklen = EVP_MD_size(h);
-    if ((ctx = HMAC_CTX_new()) == NULL) {
-        perror("HMAC_CTX_new()");
+    if ((ctx = scratch_hmac_ctx()) == NULL) {
         return -1;
     }
 
     if (!salt || (saltlen == 0)) {
-        if ((tweak = (unsigned char *)malloc(prklen)) == NULL) {
-            perror("malloc");
-            HMAC_CTX_free(ctx);
-            return 0;
-        }
-        memset(tweak, 0, prklen);
+        tweak = zeros;
         tweaklen = prklen;
     } else {
         tweak = salt;
         tweaklen = saltlen;
     }
-    (void)HMAC(h, tweak, tweaklen, ikm, ikmlen, prk, &prklen);
-    if (!salt || (saltlen == 0)) {
-        free(tweak);
+    if (!HMAC_Init_ex(ctx, tweak, tweaklen, h, NULL) ||
+        !HMAC_Update(ctx, ikm, ikmlen) ||
+        !HMAC_Final(ctx, prk, &prklen)) {
+        return -1;
     }
-    HMAC_CTX_free(ctx);
     return prklen;
 }
 
@@ -81,21 +117,14 @@ hkdf_expand (const EVP_MD *h,
              unsigned char *okm, int okmlen)
 {
     HMAC_CTX *ctx;
-    unsigned char ctr, *digest;
+    unsigned char ctr, digest[EVP_MAX_MD_SIZE];
     int len;
     unsigned int digestlen;
 
-    digestlen = EVP_MD_size(h);
-    if ((digest = (unsigned char *)malloc(digestlen)) == NULL) {
-        perror("malloc");
-        return -1;
-    }
-    if ((ctx = HMAC_CTX_new()) == NULL) {
-        perror("HMAC_CTX_new()");
+    if ((ctx = scratch_hmac_ctx()) == NULL) {
         return -1;
     }
 
-    memset(digest, 0, digestlen);
     digestlen = 0;
     ctr = 0;
     len = 0;
@@ -118,11 +147,9 @@ hkdf_expand (const EVP_MD *h,
         } else {
             memcpy(okm + len, digest, digestlen);
         }
-        HMAC_CTX_reset(ctx);
         len += digestlen;
     }
-    free(digest);
-    HMAC_CTX_free(ctx);
+    OPENSSL_cleanse(digest, sizeof(digest));
 
     return okmlen;
 }
@@ -134,85 +161,20 @@ hkdf (const EVP_MD *h, int skip,
       unsigned char *info, int infolen,
       unsigned char *okm, int okmlen)
 {
-    unsigned char *prk, *tweak, ctr, *digest;
-    int len;
-    unsigned int digestlen, prklen, tweaklen;
-    HMAC_CTX *ctx;
+    unsigned char prk[EVP_MAX_MD_SIZE];
+    int prklen, ret;
 
-    digestlen = prklen = EVP_MD_size(h);
-    if ((digest = (unsigned char *)malloc(digestlen)) == NULL) {
-        perror("malloc");
-        return 0;
-    }
-    if ((ctx = HMAC_CTX_new()) == NULL) {
-        perror("HMAC_CTX_new()");
-        free(digest);
-        return 0;
-    }
     if (!skip) {
         /*
-         * if !skip then do HKDF-extract
+         * if !skip then do HKDF-extract, with no salt that's all zeros
          */
-        if ((prk = (unsigned char *)malloc(digestlen)) == NULL) {
-            free(digest);
-            perror("malloc");
+        if ((prklen = hkdf_extract(h, salt, saltlen, ikm, ikmlen, prk)) < 1) {
             return 0;
         }
-        /*
-         * if there's no salt then use all zeros
-         */
-        if (!salt || (saltlen == 0)) {
-            if ((tweak = (unsigned char *)malloc(digestlen)) == NULL) {
-                free(digest);
-                free(prk);
-                perror("malloc");
-                return 0;
-            }
-            memset(tweak, 0, digestlen);
-            tweaklen = saltlen;
-        } else {
-            tweak = salt;
-            tweaklen = saltlen;
-        }
-        (void)HMAC(h, tweak, tweaklen, ikm, ikmlen, prk, &prklen);
-        if (!salt || (saltlen == 0)) {
-            free(tweak);
-        }
+        ret = hkdf_expand(h, prk, prklen, info, infolen, okm, okmlen);
+        OPENSSL_cleanse(prk, sizeof(prk));
     } else {
-        prk = ikm;
-        prklen = ikmlen;
-    }
-    memset(digest, 0, digestlen);
-    digestlen = 0;
-    ctr = 0;
-    len = 0;
-    while (len < okmlen) {
-        /*
-         * T(0) = all zeros
-         * T(n) = HMAC(prk, T(n-1) | info | counter)
-         * okm = T(0) | ... | T(n)
-         */
-        ctr++;
-        HMAC_Init_ex(ctx, prk, prklen, h, NULL);
-        HMAC_Update(ctx, digest, digestlen);
-        if (info && (infolen != 0)) {
-            HMAC_Update(ctx, info, infolen);
-        }
-        HMAC_Update(ctx, &ctr, sizeof(unsigned char));
-        HMAC_Final(ctx, digest, &digestlen);
-        if ((len + digestlen) > okmlen) {
-            memcpy(okm + len, digest, okmlen - len);
-        } else {
-            memcpy(okm + len, digest, digestlen);
-        }
-        HMAC_CTX_reset(ctx);
-        len += digestlen;
+        ret = hkdf_expand(h, ikm, ikmlen, info, infolen, okm, okmlen);
     }
-    if (!skip) {
-        free(prk);
-    }
-    free(digest);
-    HMAC_CTX_free(ctx);
-
-    return okmlen;
+    return ret < 0 ? 0 : ret;
 }
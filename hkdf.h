@@ -49,4 +49,7 @@ int hkdf(const EVP_MD *, int,
          unsigned char *, int,
          unsigned char *, int);
 
+EVP_MD_CTX *scratch_md_ctx(void);
+HMAC_CTX *scratch_hmac_ctx(void);
+
 #endif  /* _HKDF_H_ */
@@ -69,6 +69,7 @@
 #include "tlv.h"
 #include "pkex.h"
 #include "dpp.h"
+#include "bskeys.h"
 
 #ifdef HASAVAHI
 static char *conname = NULL;
@@ -89,31 +90,6 @@ service_context srvctx;
 char bootstrapfile[80];
 int keyidx = 0;
 
-static void
-dump_buffer (unsigned char *buf, int len)
-{
-    int i;
-
-    for (i = 0; i < len; i++) {
-        if (i && (i%4 == 0)) {
-            printf(" ");
-        }
-        if (i && (i%32 == 0)) {
-            printf("\n");
-        }
-        printf("%02x", buf[i]);
-    }
-    printf("\n");
-}
-
-static void
-print_buffer (char *str, unsigned char *buf, int len)
-{
-    printf("%s:\n", str);
-    dump_buffer(buf, len);
-    printf("\n");
-}
-
 static void
 message_from_relay (int fd, void *data)
 {
@@ -326,11 +302,12 @@ provision_connector (char *role, unsigned char *ssid, int ssidlen,
 int
 save_bootstrap_key (pkex_handle handle, void *param)
 {
-    FILE *fp = NULL;
     BIO *bio = NULL;
-    char newone[1024], existing[1024], b64bskey[1024];
-    unsigned char *ptr, mac[2*ETH_ALEN];
-    int ret = -1, oc, ch, len, octets;
+    char newone[1024], b64bskey[1024];
+    unsigned char *ptr, keyhash[SHA256_DIGEST_LENGTH];
+    unsigned char broadcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    unsigned int mdlen = SHA256_DIGEST_LENGTH;
+    int ret = -1, len, octets;
     EC_KEY *peerbskey = (EC_KEY *)param;
     struct conversation *conv;
     
@@ -355,39 +332,27 @@ save_bootstrap_key (pkex_handle handle, void *param)
     (void)BIO_flush(bio);
     len = BIO_get_mem_data(bio, &ptr);
     octets = EVP_EncodeBlock((unsigned char *)newone, ptr, len);
+    if (!EVP_Digest(ptr, len, keyhash, &mdlen, EVP_sha256(), NULL)) {
+        BIO_free(bio);
+        goto fin;
+    }
     BIO_free(bio);
 
     memset(b64bskey, 0, 1024);
     strncpy(b64bskey, newone, octets);
 
-    if ((fp = fopen(bootstrapfile, "r+")) == NULL) {
-        fprintf(stderr, "SSS: unable to open %s as bootstrapping file\n", bootstrapfile);
-        goto fin;
-    }
-    ret = 0;
     printf("peer's bootstrapping key (b64 encoded)\n%s\n", b64bskey);
-    while (!feof(fp)) {
-        memset(existing, 0, 1024);
-        if (fscanf(fp, "%d %d %d %s %s", &ret, &oc, &ch, mac, existing) < 1) {
-            break;
-        }
-        if (strcmp((char *)existing, (char *)b64bskey) == 0) {
-            fprintf(stderr, "SSS: bootstrapping key is trusted already\n");
-//            goto fin;
-        }
+    if (bskeys_by_hash(keyhash) != NULL) {
+        fprintf(stderr, "SSS: bootstrapping key is trusted already\n");
     }
-    ret++;
     /*
      * bootstrapping file is index opclass channel macaddr key
      * but the controller doesn't care about opclass and channel 
      * and doesn't know anything about MAC addresses....
      */
-    fprintf(fp, "%d 0 0 ffffffffffff %s\n", ret, b64bskey);
+    ret = bskeys_add(0, 0, broadcast, b64bskey);
 
   fin:
-    if (fp != NULL) {
-        fclose(fp);
-    }
     return ret;
 }
 
@@ -396,15 +361,13 @@ new_connection (int fd, void *data)
 {
     struct sockaddr_in *serv = (struct sockaddr_in *)data;
     struct conversation *conv = NULL;
-    int sd, rlen, framesize, ret, opclass, channel, asn1len, found = 0;
+    int sd, rlen, framesize;
     uint32_t netlen;
-    unsigned int clen, mdlen = SHA256_DIGEST_LENGTH;
-    char pkey[200];
-    unsigned char buf[3000], mac[20], keyasn1[1024], keyhash[SHA256_DIGEST_LENGTH];
+    unsigned int clen;
+    unsigned char buf[3000];
     dpp_action_frame *frame;
-    EVP_MD_CTX *mdctx = NULL;
+    struct bskey *bk;
     TLV *rhash;
-    FILE *fp;
     
     printf("new connection!!!\n");
     clen = sizeof(struct sockaddr_in);
@@ -479,49 +442,15 @@ new_connection (int fd, void *data)
             if ((rhash = find_tlv(RESPONDER_BOOT_HASH, frame->attributes, framesize - 1)) == NULL) {
                 goto fail;
             }
-            if ((fp = fopen(bootstrapfile, "r")) == NULL) {
+            if ((TLV_length(rhash) != SHA256_DIGEST_LENGTH) ||
+                ((bk = bskeys_by_chirp(TLV_value(rhash))) == NULL)) {
                 goto fail;
             }
-            if ((mdctx = EVP_MD_CTX_new()) == NULL) {
-                goto fail;
-            }
-            while (!feof(fp)) {
-                memset(pkey, 0, sizeof(pkey));
-                if (fscanf(fp, "%d %d %d %s %s", &ret, &opclass, &channel, mac, pkey) < 0) {
-                    continue;
-                }
-                if ((asn1len = EVP_DecodeBlock(keyasn1, (unsigned char *)pkey, strlen(pkey))) < 0) {
-                    continue;
-                }
-                print_buffer("asn1", keyasn1, asn1len);
-                if (keyasn1[asn1len-1] == 0x00) {
-                    asn1len--;
-                    print_buffer("extra NULL in ASN.1, lopping off...", keyasn1, asn1len);
-                }
-                printf("checking %d...", ret);
-                EVP_DigestInit(mdctx, EVP_sha256());
-                EVP_DigestUpdate(mdctx, "chirp", strlen("chirp"));
-                EVP_DigestUpdate(mdctx, keyasn1, asn1len);
-                EVP_DigestFinal(mdctx, keyhash, &mdlen);
-                print_buffer("computed", keyhash, mdlen);
-                print_buffer("chirped", TLV_value(rhash), SHA256_DIGEST_LENGTH); 
-                if (memcmp(keyhash, TLV_value(rhash), SHA256_DIGEST_LENGTH) == 0) {
-                    printf("YES!!!\n");
-                    /* 
-                     * if so, initiator and try mutual (responder decides anyway)
-                     */
-                    if ((conv->handle = dpp_create_peer((unsigned char *)&pkey[0], 1, 1, 0)) < 1) {
-                        fclose(fp);
-                        goto fail;
-                    }
-                    found = 1;
-                    break;
-                } else {
-                    printf("no\n");
-                }
-            }
-            fclose(fp);
-            if (!found) {
+            printf("YES!!! it's key %d\n", bk->idx);
+            /* 
+             * if so, initiator and try mutual (responder decides anyway)
+             */
+            if ((conv->handle = dpp_create_peer_by_key(bskeys_ec_key(bk), 1, 1, 0)) < 1) {
                 goto fail;
             }
             break;
@@ -558,49 +487,17 @@ int change_dpp_channel (dpp_handle handle, unsigned char foo, unsigned char bar)
 int
 bootstrap_peer (pkex_handle handle, int keyidx, int is_initiator, int mauth)
 {
-    FILE *fp;
     struct conversation *conv = NULL;
-    int n, opclass, channel;
-    unsigned char peermac[ETH_ALEN]; 
-    unsigned char keyb64[1024];
-    char mac[20], *ptr;
+    struct bskey *bk;
+    EC_KEY *bskey;
 
     printf("looking for bootstrap key index %d\n", keyidx);
-    if ((fp = fopen(bootstrapfile, "r")) == NULL) {
-        return -1;
-    }
-    while (!feof(fp)) {
-        memset(keyb64, 0, sizeof(keyb64));
-        if (fscanf(fp, "%d %d %d %s %s", &n, &opclass, &channel, mac, keyb64) < 1) {
-            fprintf(stderr, "unable to read from bootstrap key file\n");
-            fclose(fp);
-            return -1;
-        }
-        if (n == keyidx) {
-            break;
-        }
-    }
-    if (feof(fp)) {
+    if ((bk = bskeys_by_index(keyidx)) == NULL) {
         fprintf(stderr, "unable to find bootstrap key with index %d\n", keyidx);
-        fclose(fp);
         return -1;
     }
-    fclose(fp);
-    printf("peer is on operating class %d and channel %d, checking...\n", opclass, channel);
-    printf("peer's bootstrapping key is %s\n", keyb64);
-
-    ptr = &mac[10];
-    sscanf(ptr, "%hhx", &peermac[5]); mac[10] = '\0';
-    ptr = &mac[8];
-    sscanf(ptr, "%hhx", &peermac[4]); mac[8] = '\0';
-    ptr = &mac[6];
-    sscanf(ptr, "%hhx", &peermac[3]); mac[6] = '\0';
-    ptr = &mac[4];
-    sscanf(ptr, "%hhx", &peermac[2]); mac[4] = '\0';
-    ptr = &mac[2];
-    sscanf(ptr, "%hhx", &peermac[1]); mac[2] = '\0';
-    ptr = &mac[0];
-    sscanf(ptr, "%hhx", &peermac[0]); 
+    printf("peer is on operating class %d and channel %d, checking...\n", bk->opclass, bk->channel);
+    printf("peer's bootstrapping key is %s\n", bk->b64);
 
     TAILQ_FOREACH(conv, &conversations, entry) {
         if (conv->handle == (dpp_handle)handle) {
@@ -617,7 +514,8 @@ bootstrap_peer (pkex_handle handle, int keyidx, int is_initiator, int mauth)
      * reuse the conversation structure, just delete the pkex state
      * and migrate local state over to dpp state
      */
-    if ((conv->handle = dpp_create_peer(keyb64, is_initiator, mauth, 0)) < 1) {
+    if (((bskey = bskeys_ec_key(bk)) == NULL) ||
+        ((conv->handle = dpp_create_peer_by_key(bskey, is_initiator, mauth, 0)) < 1)) {
         close(conv->fd);
         free(conv);
         return -1;
@@ -796,7 +694,7 @@ main (int argc, char **argv)
     int opt, infd, newgroup = 0, do_mdns = 0;
     struct sockaddr_in serv;
     char relay[20], password[80], keyfile[80], signkeyfile[80], enrollee_role[10], mudurl[80];
-    char *ptr, *endptr, identifier[80], pkexinfo[80], caip[40];
+    char *ptr, *endptr, identifier[80], pkexinfo[80], caip[40], codefile[80];
     unsigned char targetmac[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 #ifdef HASAVAHI
     FILE *fp;
@@ -818,10 +716,12 @@ main (int argc, char **argv)
     memset(signkeyfile, 0, 80);
     memset(mudurl, 0, 80);
     memset(identifier, 0, 80);
+    memset(password, 0, 80);
+    memset(codefile, 0, 80);
     memset(pkexinfo, 0, 80);
     memset(caip, 0, 40);
     for (;;) {
-        c = getopt(argc, argv, "hirm:k:I:B:x:yb:ae:c:d:p:n:z:w:j");
+        c = getopt(argc, argv, "hirm:k:I:B:x:yb:ae:c:d:p:n:o:z:w:j");
         if (c < 0) {
             break;
         }
@@ -842,6 +742,10 @@ main (int argc, char **argv)
             case 'n':           /* pkex identifier */
                 strcpy(identifier, optarg);
                 break;
+            case 'o':           /* file of pkex identifiers and codes */
+                strcpy(codefile, optarg);
+                do_pkex = 1;
+                break;
             case 'd':           /* debug */
                 debug = atoi(optarg);
                 break;
@@ -899,7 +803,7 @@ main (int argc, char **argv)
             default:
             case 'h':
                 fprintf(stderr, 
-                        "USAGE: %s [-hCIBapkceirdfgs]\n"
+                        "USAGE: %s [-hCIBapkceirdfgso]\n"
                         "\t-h  show usage, and exit\n"
                         "\t-c <signkey> run DPP as the configurator, sign connectors with <signkey>\n"
                         "\t-e <role> run DPP as the enrollee in the role of <role> (sta or ap)\n"
@@ -913,6 +817,7 @@ main (int argc, char **argv)
                         "\t-p <password> to use for PKEX\n"
                         "\t-z <info> to pass along with public key in PKEX\n"
                         "\t-n <identifier> for the code used in PKEX\n"
+                        "\t-o <filename> of PKEX identifiers and codes, reread when changed\n"
                         "\t-k <filename> my bootstrapping key\n"
                         "\t-y  bootstrapping (PKEX) only, don't run DPP\n"
                         "\t-x  <index> DPP only with key <index> in -B <filename>, don't do PKEX\n"
@@ -933,6 +838,9 @@ main (int argc, char **argv)
         fprintf(stderr, "%s: specify a peer bootstrapping key file with -B <filename>\n", argv[0]);
         exit(1);
     }
+    if (bootstrapfile[0] != 0) {
+        bskeys_load(bootstrapfile, srvctx);
+    }
     if (is_initiator && !do_pkex && (keyidx == 0)) {
         fprintf(stderr, "%s: either do PKEX or specify an index into bootstrapping file with -x\n",
                 argv[0]);
@@ -971,6 +879,10 @@ main (int argc, char **argv)
             fprintf(stderr, "%s: cannot configure PKEX/DPP, check config file!\n", argv[0]);
             exit(1);
         }
+        if ((codefile[0] != 0) && (pkex_load_codes(codefile) < 0)) {
+            fprintf(stderr, "%s: cannot load PKEX codes from %s\n", argv[0], codefile);
+            exit(1);
+        }
     }
     if (do_dpp) {
         if (dpp_initialize(config_or_enroll, keyfile,
@@ -53,6 +53,7 @@
 #include "tlv.h"
 #include "pkex.h"
 #include "dpp.h"
+#include "bskeys.h"
 
 service_context srvctx;
 unsigned int opclass = 81, channel = 6;
@@ -285,10 +286,11 @@ save_bootstrap_key (pkex_handle handle, void *param)
 {
     EC_KEY *peerbskey = (EC_KEY *)param;
     BIO *bio = NULL;
-    FILE *fp = NULL;
-    unsigned char mac[20], *ptr;
-    char existing[1024], newone[1024], b64bskey[1024];
-    int ret = -1, oc, ch, len, octets;
+    unsigned char *ptr, keyhash[SHA256_DIGEST_LENGTH];
+    unsigned char broadcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    unsigned int mdlen = SHA256_DIGEST_LENGTH;
+    char newone[1024], b64bskey[1024];
+    int ret = -1, len, octets;
     
     /*
      * get the base64 encoded EC_KEY as onerow[1]
@@ -301,75 +303,48 @@ save_bootstrap_key (pkex_handle handle, void *param)
     (void)BIO_flush(bio);
     len = BIO_get_mem_data(bio, &ptr);
     octets = EVP_EncodeBlock((unsigned char *)newone, ptr, len);
+    if (!EVP_Digest(ptr, len, keyhash, &mdlen, EVP_sha256(), NULL)) {
+        BIO_free(bio);
+        goto fin;
+    }
     BIO_free(bio);
 
     memset(b64bskey, 0, 1024);
     strncpy(b64bskey, newone, octets);
 
-    if ((fp = fopen(bootstrapfile, "r+")) == NULL) {
-        fprintf(stderr, "SSS: unable to open %s as bootstrapping file\n", bootstrapfile);
-        goto fin;
+    if (bskeys_by_hash(keyhash) != NULL) {
+        fprintf(stderr, "SSS: bootstrapping key is trusted already\n");
     }
-    ret = 0;
-    printf("peer's bootstrapping key (b64 encoded)\n%s\n", b64bskey);
-    while (!feof(fp)) {
-        memset(existing, 0, 1024);
-        if (fscanf(fp, "%d %d %d %s %s", &ret, &oc, &ch, mac, existing) < 1) {
-            break;
-        }
-        if (strcmp((char *)existing, (char *)b64bskey) == 0) {
-            fprintf(stderr, "SSS: bootstrapping key is trusted already\n");
-        }
-    }
-    ret++;
     /*
      * bootstrapping file is index opclass channel macaddr key
      */
-    fprintf(fp, "%d 0 0 ffffffffffff %s\n", ret, b64bskey);
+    ret = bskeys_add(0, 0, broadcast, b64bskey);
   fin:
-    if (fp != NULL) {
-        fclose(fp);
-    }
     return ret;
 }
 
 int
 bootstrap_peer (pkex_handle handle, int keyidx, int is_initiator, int mauth)
 {
-    FILE *fp;
-    int n, opclass, channel;
-    unsigned char keyb64[1024];
-    char mac[20];
+    struct bskey *bk;
+    EC_KEY *bskey;
 
     if (phandle == handle) {
         pkex_destroy_peer(handle);
         phandle = -1;
     }
     printf("looking for bootstrap key index %d in %s\n", keyidx, bootstrapfile);
-    if ((fp = fopen(bootstrapfile, "r")) == NULL) {
-        fprintf(stderr, "failed to open %s to read\n", bootstrapfile);
-        return -1;
-    }
-    while (!feof(fp)) {
-        memset(keyb64, 0, sizeof(keyb64));
-        if (fscanf(fp, "%d %d %d %s %s", &n, &opclass, &channel, mac, keyb64) < 1) {
-            fprintf(stderr, "unable to read from bootstrap key file!\n");
-            fclose(fp);
-            return -1;
-        }
-        if (n == keyidx) {
-            break;
-        }
-    }
-    if (feof(fp)) {
+    if ((bk = bskeys_by_index(keyidx)) == NULL) {
         fprintf(stderr, "unable to find bootstrap key with index %d\n", keyidx);
-        fclose(fp);
         return -1;
     }
-    fclose(fp);
-    printf("peer's bootstrapping key is %s\n", keyb64);
+    printf("peer's bootstrapping key is %s\n", bk->b64);
 
-    if ((dhandle = dpp_create_peer(keyb64, is_initiator, mauth, 0)) < 1) {
+    if ((bskey = bskeys_ec_key(bk)) == NULL) {
+        fprintf(stderr, "bootstrapping key %d is no good\n", keyidx);
+        return -1;
+    }
+    if ((dhandle = dpp_create_peer_by_key(bskey, is_initiator, mauth, 0)) < 1) {
         fprintf(stderr, "unable to create peer!\n");
         return -1;
     }
@@ -485,6 +460,9 @@ main (int argc, char **argv)
         fprintf(stderr, "%s: specify a peer bootstrapping key file with -B <filename>\n", argv[0]);
         exit(1);
     }
+    if (bootstrapfile[0] != 0) {
+        bskeys_load(bootstrapfile, srvctx);
+    }
 
     if (mutual && !do_pkex && (keyidx == 0)) {
         fprintf(stderr, "%s: either do PKEX or specify an index into bootstrapping file with -x\n",
@@ -34,6 +34,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <ctype.h>              /* DELETE ME WITH SCAN STUFF */
 #include <signal.h>
@@ -46,6 +47,7 @@
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
 #include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <linux/if_tun.h>
 #include <linux/nl80211.h>
@@ -893,6 +895,71 @@ nl_sock_in (int fd, void *data)
     }
 }
 
+/*
+ * classic BPF program for the loopback socket. Everyone on "lo" sees
+ * everything written to it, so let the kernel throw away our own frames,
+ * frames addressed to someone else, and anything that isn't a DPP/PKEX
+ * public action frame or a GAS frame before we're woken up for it.
+ */
+static void
+attach_frame_filter (struct interface *inf)
+{
+    unsigned int bw, bh;
+    enum { FC = 13, ACCEPT = 23, DROP = 24 };
+    struct sock_fprog prog;
+
+    bw = (inf->bssid[0] << 24) | (inf->bssid[1] << 16) | (inf->bssid[2] << 8) | inf->bssid[3];
+    bh = (inf->bssid[4] << 8) | inf->bssid[5];
+    {
+        struct sock_filter code[] = {
+            /* 0: drop our copy of outgoing frames */
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_OUTGOING, DROP - 2, 0),
+            /* 2: drop frames we sent */
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, sa)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, bw, 0, 2),
+            BPF_STMT(BPF_LD|BPF_H|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, sa) + 4),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, bh, DROP - 6, 0),
+            /* 6: must be broadcast or for us */
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, da)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0xffffffff, 0, 2),
+            BPF_STMT(BPF_LD|BPF_H|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, da) + 4),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0xffff, FC - 10, DROP - 10),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, bw, 0, DROP - 11),
+            BPF_STMT(BPF_LD|BPF_H|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, da) + 4),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, bh, 0, DROP - 13),
+            /* 13: public action frames */
+            BPF_STMT(BPF_LD|BPF_B|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, frame_control)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IEEE802_11_FC_TYPE_MGMT << 2 | IEEE802_11_FC_STYPE_ACTION << 4,
+                     0, DROP - 15),
+            BPF_STMT(BPF_LD|BPF_B|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, action.category)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ACTION_PUBLIC, 0, DROP - 17),
+            /* 17: vendor specific with the WFA DPP OUI/type, or GAS */
+            BPF_STMT(BPF_LD|BPF_B|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, action.field)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PUB_ACTION_VENDOR, 0, 2),
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, action.variable)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x506f9a1a, ACCEPT - 21, DROP - 21),
+            BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, GAS_INITIAL_REQUEST, 0, DROP - 22),
+            BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, GAS_COMEBACK_RESPONSE, DROP - 23, ACCEPT - 23),
+            /* 23: */
+            BPF_STMT(BPF_RET|BPF_K, 0xffffffff),
+            /* 24: */
+            BPF_STMT(BPF_RET|BPF_K, 0),
+        };
+
+        prog.len = sizeof(code)/sizeof(code[0]);
+        prog.filter = code;
+        /*
+         * not fatal, bpf_frame_in and process_incoming_mgmt_frame still
+         * do all these checks themselves
+         */
+        if (setsockopt(inf->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+            fprintf(stderr, "unable to attach frame filter to %s\n", inf->ifname);
+            perror("setsockopt");
+        }
+    }
+}
+
 static void
 bpf_frame_in (int fd, void *data)
 {
@@ -1268,6 +1335,7 @@ add_interface (char *ptr)
         if (!RAND_bytes(&inf->bssid[0], ETH_ALEN)) {
             fprintf(stderr, "unable to make a fake BSSID on %s!\n", inf->ifname);
         }
+        attach_frame_filter(inf);
         srv_add_input(srvctx, inf->fd, inf, bpf_frame_in);
     }
     
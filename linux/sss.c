@@ -34,11 +34,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <ctype.h>              /* DELETE ME WITH SCAN STUFF */
 #include <signal.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
 #include <netinet/in.h>
@@ -46,6 +49,7 @@
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
 #include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <linux/if_tun.h>
 #include <linux/nl80211.h>
@@ -61,6 +65,93 @@
 #include "pkex.h"
 #include "tlv.h"
 #include "dpp.h"
+#include "bskeys.h"
+
+struct interface;
+
+#define WIRELESS_MTU    1400
+#define TX_MAX_CHANNELS 32
+#define TX_WINDOW_BUSY  500     /* ms a window lasts when other channels are waiting */
+
+/*
+ * geometry of the optional PACKET_MMAP rings on a loopback interface
+ */
+#define RING_BLOCK_SIZE (1 << 15)
+#define RING_FRAME_SIZE 2048
+#define RING_RX_BLOCKS  16
+#define RING_TX_BLOCKS  4
+#define RING_RETIRE_MS  10
+
+/*
+ * retransmitted DPP Auth and PKEX frames are answered from a cache
+ */
+#define SEEN_FRAMES     16
+#define SEEN_LIFETIME   10      /* seconds */
+
+/*
+ * interfaces and DPP/PKEX instances are hashed by MAC address(es) and
+ * handle, there can be hundreds of peers when we're an AP
+ */
+#define INSTANCE_BUCKETS        256     /* power of 2 */
+#define INTERFACE_BUCKETS       16      /* power of 2 */
+
+/*
+ * scan results are cached per interface, a BSS seen recently enough can
+ * be used without scanning again and one seen before is a hint of where
+ * to look for it
+ */
+#define BSS_FRESH       10      /* seconds */
+#define SCAN_RETRY      2       /* seconds, doubled after each miss */
+#define SCAN_RETRY_MAX  60      /* seconds */
+#define SCAN_TRIES      10      /* scans for our SSID before giving up */
+#define SCAN_HINT_TRIES 2       /* single channel scans before scanning them all */
+
+/*
+ * a frame waiting for the radio to get to its channel
+ */
+struct tx_frame {
+    TAILQ_ENTRY(tx_frame) entry;
+    unsigned long freq;
+    unsigned long dwell;        /* ms to stay and listen afterwards */
+    int len;
+    char buf[WIRELESS_MTU];
+};
+
+/*
+ * a BSS from the kernel's scan results
+ */
+struct bss_entry {
+    TAILQ_ENTRY(bss_entry) entry;
+    unsigned char bssid[ETH_ALEN];
+    unsigned long freq;
+    char ssid[33];
+    unsigned char conie;        /* beacons a DPP Configurator Connectivity IE */
+    time_t seen;
+    unsigned int gen;           /* the last dump it was in */
+};
+
+struct chan_stats {
+    unsigned long freq;
+    unsigned long switches;     /* times the driver went there for us */
+    unsigned long frames;
+    unsigned long airtime;      /* ms spent remaining on this channel */
+};
+
+/*
+ * an nl80211 command that's been sent but not yet completed by the
+ * kernel, matched up with its replies by netlink sequence number
+ */
+struct nl_request {
+    TAILQ_ENTRY(nl_request) entry;
+    struct interface *inf;
+    unsigned int seq;
+    unsigned char cmd;
+    unsigned long long cookie;
+    struct timeval sent;
+    int (*handler)(struct nl_msg *, void *);
+    void (*done)(struct nl_request *, int);
+    void *data;
+};
 
 struct interface {
     TAILQ_ENTRY(interface) entry;
@@ -76,47 +167,127 @@ struct interface {
     unsigned char offchan_tx_ok;
     unsigned long max_roc;
     int fd;     /* BPF socket */
+    TAILQ_HEAD(nlreqs, nl_request) nlpending;   /* waiting for an ACK */
+    struct nlreqs nltx;                         /* frames waiting for TX status */
+    int ntx;
+    int scanning;               /* our scan is with the kernel */
+    void (*scan_done)(struct interface *);
+    int dumping, redump;
+    TAILQ_HEAD(bsscache, bss_entry) bsscache;
+    unsigned int bssgen;
+    int hinted;
+    int scantries;              /* scans for our SSID so far */
+    timerid scantimer;          /* the next one */
+    /*
+     * the TX scheduler, frames for our own channel go right out, frames
+     * for other channels are batched by channel and sent during a
+     * remain-on-channel window no longer than max_roc, which is also
+     * when we hear the answers
+     */
+    TAILQ_HEAD(txq, tx_frame) txq;
+    unsigned long txfreq;       /* channel of the open window, 0 if none */
+    struct nl_request *rocreq;  /* asked the driver to go there, no answer yet */
+    unsigned long long roccookie;
+    struct timeval winstart, winend, rocend;
+    timerid wintimer;
+    timerid statstimer;
+    struct chan_stats chstats[TX_MAX_CHANNELS];
+    int nchstats;
+    /*
+     * TPACKET_V3 rings mapped over the BPF socket, loopback only. The
+     * TX ring follows the RX ring in the mapping.
+     */
+    unsigned char *ring;
+    size_t ringlen;
+    struct tpacket_req3 rxreq, txreq;
+    unsigned int rxblock;
+    unsigned int txframe;
+    int txkick;
+    TAILQ_ENTRY(interface) macentry;
 };
 TAILQ_HEAD(bar, interface) interfaces;
+static TAILQ_HEAD(ifbucket, interface) if_by_mac[INTERFACE_BUCKETS];
 
+/*
+ * within a bucket instances are kept newest first, a lookup that can
+ * match either a peer or broadcast takes whichever was created last
+ */
 struct pkex_instance {
     TAILQ_ENTRY(pkex_instance) entry;
+    TAILQ_ENTRY(pkex_instance) macentry;
+    TAILQ_ENTRY(pkex_instance) handleentry;
+    unsigned long seq;
     pkex_handle handle;
     unsigned char mymac[ETH_ALEN];
     unsigned char peermac[ETH_ALEN];
 };
 TAILQ_HEAD(blah, pkex_instance) pkex_instances;
+static TAILQ_HEAD(pkexbucket, pkex_instance) pkex_by_mac[INSTANCE_BUCKETS];
+static struct pkexbucket pkex_by_handle[INSTANCE_BUCKETS];
+
+/*
+ * the last DPP Auth or PKEX frame a peer sent us and what, if anything,
+ * we sent back
+ */
+struct seen_frame {
+    unsigned char mymac[ETH_ALEN];
+    unsigned char peermac[ETH_ALEN];
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    time_t when;
+    unsigned char field;
+    unsigned long freq;
+    int len;                    /* 0 if we haven't answered */
+    char buf[WIRELESS_MTU];
+};
+static struct seen_frame seen_frames[SEEN_FRAMES];
+/*
+ * the frame being run through the state machine right now, it and its
+ * answer only go in seen_frames if processing it worked
+ */
+static struct seen_frame answering;
+static int answering_valid = 0;
 
 struct dpp_instance {
     TAILQ_ENTRY(dpp_instance) entry;
+    TAILQ_ENTRY(dpp_instance) macentry;
+    TAILQ_ENTRY(dpp_instance) handleentry;
+    unsigned long seq;
     dpp_handle handle;
     unsigned int tid;
+    unsigned long freq;         /* 0 means the interface's channel */
     unsigned char mymac[ETH_ALEN];
     unsigned char peermac[ETH_ALEN];
 };
 TAILQ_HEAD(foo, dpp_instance) dpp_instances;
+static TAILQ_HEAD(dppbucket, dpp_instance) dpp_by_mac[INSTANCE_BUCKETS];
+static struct dppbucket dpp_by_handle[INSTANCE_BUCKETS];
+static unsigned long instance_seq = 0;
+/*
+ * DPP Discovery transaction IDs are a single octet, index instances by them
+ */
+static struct dpp_instance *tid_instances[256];
 
 struct family_data {
     const char *group;
     int id;
 };
 
-struct trigger_results {
-    int done;
-    int aborted;
-};
-
-#define WIRELESS_MTU    1400
-
 service_context srvctx;
 static int discovered = -1;
 char our_ssid[33];
 unsigned int opclass = 81, channel = 6;
 char bootstrapfile[80];
 int quit_at_fin = 0;
+static int use_ring = 0;
+static int in_rx_batch = 0;
 
 extern int nl_debug;
 
+static void nl_tx_status(struct interface *, unsigned long long, int);
+static void nl_scan_done(struct interface *, int);
+static int cons_action_frame(unsigned char, unsigned char *, unsigned char *,
+                             unsigned long, char *, int);
+
 static void
 exceptor (int fd, void *unused)
 {
@@ -151,22 +322,88 @@ dump_ssid (struct ieee80211_mgmt_frame *frame, int len)
     }
 }
 
+static unsigned int
+mac_bucket (unsigned char *me, unsigned char *peer, int nbuckets)
+{
+    unsigned int h = 0;
+    int i;
+
+    for (i = 0; i < ETH_ALEN; i++) {
+        h = (h * 31) + me[i];
+    }
+    if (peer != NULL) {
+        for (i = 0; i < ETH_ALEN; i++) {
+            h = (h * 31) + peer[i];
+        }
+    }
+    return h & (nbuckets - 1);
+}
+
+static struct interface *
+find_interface_by_mac (unsigned char *mac)
+{
+    struct interface *inf;
+
+    TAILQ_FOREACH(inf, &if_by_mac[mac_bucket(mac, NULL, INTERFACE_BUCKETS)], macentry) {
+        if (memcmp(inf->bssid, mac, ETH_ALEN) == 0) {
+            break;
+        }
+    }
+    return inf;
+}
+
+/*
+ * put an instance in its MAC bucket keeping the bucket newest first
+ */
+static void
+hash_dpp_instance (struct dpp_instance *instance)
+{
+    struct dppbucket *bucket = &dpp_by_mac[mac_bucket(instance->mymac, instance->peermac, INSTANCE_BUCKETS)];
+    struct dpp_instance *next;
+
+    TAILQ_FOREACH(next, bucket, macentry) {
+        if (next->seq < instance->seq) {
+            break;
+        }
+    }
+    if (next != NULL) {
+        TAILQ_INSERT_BEFORE(next, instance, macentry);
+    } else {
+        TAILQ_INSERT_TAIL(bucket, instance, macentry);
+    }
+}
+
+static struct dpp_instance *
+lookup_dpp_instance (unsigned char *me, unsigned char *peer)
+{
+    struct dpp_instance *found;
+
+    TAILQ_FOREACH(found, &dpp_by_mac[mac_bucket(me, peer, INSTANCE_BUCKETS)], macentry) {
+        if ((memcmp(found->mymac, me, ETH_ALEN) == 0) &&
+            (memcmp(found->peermac, peer, ETH_ALEN) == 0)) {
+            break;
+        }
+    }
+    return found;
+}
+
 struct dpp_instance *
 find_instance_by_mac (unsigned char *me, unsigned char *peer)
 {
-    struct dpp_instance *found;
+    struct dpp_instance *found, *wild;
     unsigned char broadcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
     
-    TAILQ_FOREACH(found, &dpp_instances, entry) {
-        if (memcmp(found->mymac, me, ETH_ALEN) == 0) {
-            if (memcmp(found->peermac, peer, ETH_ALEN) == 0) {
-                break;
-            }
-            if (memcmp(found->peermac, broadcast, ETH_ALEN) == 0) {
-                memcpy(found->peermac, peer, ETH_ALEN);
-                break;
-            }
-        }
+    found = lookup_dpp_instance(me, peer);
+    /*
+     * an instance that was started to broadcast is claimed by the first
+     * peer that shows up, it now belongs in that peer's bucket
+     */
+    if (((wild = lookup_dpp_instance(me, broadcast)) != NULL) &&
+        ((found == NULL) || (wild->seq > found->seq))) {
+        TAILQ_REMOVE(&dpp_by_mac[mac_bucket(me, broadcast, INSTANCE_BUCKETS)], wild, macentry);
+        memcpy(wild->peermac, peer, ETH_ALEN);
+        hash_dpp_instance(wild);
+        found = wild;
     }
     if (found == NULL) {
         fprintf(stderr, "unable to find dpp peer, src="MACSTR", dst="MACSTR"\n",
@@ -180,7 +417,7 @@ find_instance_by_handle (dpp_handle handle)
 {
     struct dpp_instance *found;
     
-    TAILQ_FOREACH(found, &dpp_instances, entry) {
+    TAILQ_FOREACH(found, &dpp_by_handle[handle & (INSTANCE_BUCKETS - 1)], handleentry) {
         if (found->handle == handle) {
             break;
         }
@@ -195,11 +432,9 @@ struct dpp_instance *
 find_instance_by_tid (unsigned char tid)
 {
     struct dpp_instance *found;
-    
-    TAILQ_FOREACH(found, &dpp_instances, entry) {
-        if (found->tid == tid) {
-            break;
-        }
+
+    if (((found = tid_instances[tid]) != NULL) && (found->tid != tid)) {
+        found = NULL;
     }
     if (found == NULL) {
         fprintf(stderr, "unable to find dpp peer, tid = %d\n", tid);
@@ -207,22 +442,38 @@ find_instance_by_tid (unsigned char tid)
     return found;
 }
 
+static void
+add_dpp_instance (struct dpp_instance *instance)
+{
+    instance->seq = ++instance_seq;
+    TAILQ_INSERT_HEAD(&dpp_instances, instance, entry);
+    hash_dpp_instance(instance);
+    TAILQ_INSERT_HEAD(&dpp_by_handle[instance->handle & (INSTANCE_BUCKETS - 1)], instance, handleentry);
+}
+
 static struct dpp_instance *
-create_dpp_instance (unsigned char *mymac, unsigned char *peermac, unsigned char *bskey,
+create_dpp_instance (unsigned char *mymac, unsigned char *peermac, struct bskey *bk,
                      int is_initiator, int mauth)
 {
     struct dpp_instance *instance;
+    EC_KEY *bskey = NULL;
     
+    if ((bk != NULL) && ((bskey = bskeys_ec_key(bk)) == NULL)) {
+        fprintf(stderr, "bootstrapping key %d is no good\n", bk->idx);
+        return NULL;
+    }
     if ((instance = (struct dpp_instance *)malloc(sizeof(struct dpp_instance))) == NULL) {
         return NULL;
     }
     memcpy(instance->mymac, mymac, ETH_ALEN);
     memcpy(instance->peermac, peermac, ETH_ALEN);
-    if ((instance->handle = dpp_create_peer(bskey, is_initiator, mauth, WIRELESS_MTU)) < 1) {
+    instance->tid = 0;
+    instance->freq = 0;
+    if ((instance->handle = dpp_create_peer_by_key(bskey, is_initiator, mauth, WIRELESS_MTU)) < 1) {
         free(instance);
         return NULL;
     }
-    TAILQ_INSERT_HEAD(&dpp_instances, instance, entry);
+    add_dpp_instance(instance);
     
     return instance;
 }
@@ -242,36 +493,93 @@ create_discovery_instance (unsigned char *mymac, unsigned char *peermac)
         }
         memcpy(instance->mymac, mymac, ETH_ALEN);
         memcpy(instance->peermac, peermac, ETH_ALEN);
-        TAILQ_INSERT_HEAD(&dpp_instances, instance, entry);
+        instance->handle = 0;
+        instance->freq = 0;
+        add_dpp_instance(instance);
+    } else if (tid_instances[instance->tid & 0xff] == instance) {
+        tid_instances[instance->tid & 0xff] = NULL;
+    }
+    if ((instance->tid = get_dpp_discovery_tid()) == 0) {
+        fprintf(stderr, "no DPP Discovery transaction for " MACSTR "\n", MAC2STR(peermac));
+        return NULL;
     }
-    instance->tid = get_dpp_discovery_tid();
+    tid_instances[instance->tid] = instance;
     
     return instance;
 }
 
-struct pkex_instance *
-find_pkex_instance_by_mac (unsigned char *me)
+static void
+hash_pkex_instance (struct pkex_instance *instance)
+{
+    struct pkexbucket *bucket = &pkex_by_mac[mac_bucket(instance->mymac, instance->peermac, INSTANCE_BUCKETS)];
+    struct pkex_instance *next;
+
+    TAILQ_FOREACH(next, bucket, macentry) {
+        if (next->seq < instance->seq) {
+            break;
+        }
+    }
+    if (next != NULL) {
+        TAILQ_INSERT_BEFORE(next, instance, macentry);
+    } else {
+        TAILQ_INSERT_TAIL(bucket, instance, macentry);
+    }
+}
+
+static struct pkex_instance *
+lookup_pkex_instance (unsigned char *me, unsigned char *peer)
 {
     struct pkex_instance *found;
-    
-    TAILQ_FOREACH(found, &pkex_instances, entry) {
-        if (memcmp(found->mymac, me, ETH_ALEN) == 0) {
+
+    TAILQ_FOREACH(found, &pkex_by_mac[mac_bucket(me, peer, INSTANCE_BUCKETS)], macentry) {
+        if ((memcmp(found->mymac, me, ETH_ALEN) == 0) &&
+            (memcmp(found->peermac, peer, ETH_ALEN) == 0)) {
             break;
         }
     }
+    return found;
+}
+
+/*
+ * each peer gets its own PKEX instance so many can run at once, an
+ * instance we started by broadcasting will take whoever answers
+ */
+struct pkex_instance *
+find_pkex_instance_by_mac (unsigned char *me, unsigned char *peer)
+{
+    struct pkex_instance *found, *wild;
+    unsigned char broadcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    
+    found = lookup_pkex_instance(me, peer);
+    if (((wild = lookup_pkex_instance(me, broadcast)) != NULL) &&
+        ((found == NULL) || (wild->seq > found->seq))) {
+        found = wild;
+    }
     if (found == NULL) {
-        fprintf(stderr, "unable to find pkex peer with " MACSTR "\n",
-                MAC2STR(me));
+        fprintf(stderr, "unable to find pkex peer with " MACSTR " and " MACSTR "\n",
+                MAC2STR(me), MAC2STR(peer));
     }
     return found;
 }
 
+/*
+ * a broadcast PKEX instance got an answer, move it to the peer's bucket
+ */
+static void
+set_pkex_peer (struct pkex_instance *instance, unsigned char *peer)
+{
+    TAILQ_REMOVE(&pkex_by_mac[mac_bucket(instance->mymac, instance->peermac, INSTANCE_BUCKETS)],
+                 instance, macentry);
+    memcpy(instance->peermac, peer, ETH_ALEN);
+    hash_pkex_instance(instance);
+}
+
 struct pkex_instance *
 find_pkex_instance_by_handle (pkex_handle handle)
 {
     struct pkex_instance *found;
     
-    TAILQ_FOREACH(found, &pkex_instances, entry) {
+    TAILQ_FOREACH(found, &pkex_by_handle[handle & (INSTANCE_BUCKETS - 1)], handleentry) {
         if (found->handle == handle) {
             break;
         }
@@ -305,10 +613,149 @@ create_pkex_instance (unsigned char *mymac, unsigned char *peermac, int version)
     } else {
         instance->handle = 0;
     }
+    instance->seq = ++instance_seq;
     TAILQ_INSERT_HEAD(&pkex_instances, instance, entry);
+    hash_pkex_instance(instance);
+    TAILQ_INSERT_HEAD(&pkex_by_handle[instance->handle & (INSTANCE_BUCKETS - 1)], instance, handleentry);
     return instance;
 }
 
+static void
+delete_pkex_instance (struct pkex_instance *instance)
+{
+    TAILQ_REMOVE(&pkex_instances, instance, entry);
+    TAILQ_REMOVE(&pkex_by_mac[mac_bucket(instance->mymac, instance->peermac, INSTANCE_BUCKETS)],
+                 instance, macentry);
+    TAILQ_REMOVE(&pkex_by_handle[instance->handle & (INSTANCE_BUCKETS - 1)], instance, handleentry);
+    free(instance);
+}
+
+static struct seen_frame *
+find_seen_frame (unsigned char *mymac, unsigned char *peermac)
+{
+    int i;
+    time_t now = time(NULL);
+
+    for (i = 0; i < SEEN_FRAMES; i++) {
+        if ((seen_frames[i].when + SEEN_LIFETIME >= now) &&
+            (memcmp(seen_frames[i].mymac, mymac, ETH_ALEN) == 0) &&
+            (memcmp(seen_frames[i].peermac, peermac, ETH_ALEN) == 0)) {
+            return &seen_frames[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * a peer that doesn't hear our answer sends the exact same frame again.
+ * Don't run it back through the state machine, just send our answer to
+ * it again. Returns 1 if the frame was a retransmission and has been dealt
+ * with, 0 if it should be processed. If it should be processed then it,
+ * and what we send back while processing it, is held on to until
+ * remember_frame() says whether to keep it.
+ */
+static int
+retransmitted_frame (struct interface *inf, struct ieee80211_mgmt_frame *frame, int left)
+{
+    dpp_action_frame *dpp = (dpp_action_frame *)frame->action.variable;
+    struct seen_frame *seen;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned int mdlen = SHA256_DIGEST_LENGTH;
+
+    answering_valid = 0;
+    if (left < (int)sizeof(dpp_action_frame)) {
+        return 0;
+    }
+    switch (dpp->frame_type) {
+        case DPP_SUB_AUTH_REQUEST:
+        case DPP_SUB_AUTH_RESPONSE:
+        case DPP_SUB_AUTH_CONFIRM:
+        case PKEX_SUB_EXCH_V1REQ:
+        case PKEX_SUB_EXCH_REQ:
+        case PKEX_SUB_EXCH_RESP:
+        case PKEX_SUB_COM_REV_REQ:
+        case PKEX_SUB_COM_REV_RESP:
+            break;
+        default:
+            return 0;
+    }
+    /*
+     * the frame type is in what's hashed so the same attributes in a
+     * different frame aren't a match
+     */
+    if (!EVP_Digest(frame->action.variable, left, digest, &mdlen, EVP_sha256(), NULL)) {
+        return 0;
+    }
+    if (((seen = find_seen_frame(inf->bssid, frame->sa)) != NULL) &&
+        (memcmp(seen->digest, digest, SHA256_DIGEST_LENGTH) == 0)) {
+        if (seen->len) {
+            printf("retransmitted frame from " MACSTR ", sending our answer again\n",
+                   MAC2STR(frame->sa));
+            cons_action_frame(seen->field, inf->bssid, frame->sa, seen->freq, seen->buf, seen->len);
+        }
+        return 1;
+    }
+    memcpy(answering.mymac, inf->bssid, ETH_ALEN);
+    memcpy(answering.peermac, frame->sa, ETH_ALEN);
+    memcpy(answering.digest, digest, SHA256_DIGEST_LENGTH);
+    answering.len = 0;
+    answering_valid = 1;
+    return 0;
+}
+
+/*
+ * the frame retransmitted_frame() let through has been processed, if
+ * that worked then remember it and our answer. If it didn't then let a
+ * retransmission of it try again.
+ */
+static void
+remember_frame (int ok)
+{
+    struct seen_frame *seen;
+    int i;
+
+    if (!answering_valid) {
+        return;
+    }
+    answering_valid = 0;
+    if (!ok) {
+        return;
+    }
+    /*
+     * replace what we had for this peer, otherwise reuse an expired
+     * slot or the oldest one
+     */
+    if ((seen = find_seen_frame(answering.mymac, answering.peermac)) == NULL) {
+        seen = &seen_frames[0];
+        for (i = 1; i < SEEN_FRAMES; i++) {
+            if (seen_frames[i].when < seen->when) {
+                seen = &seen_frames[i];
+            }
+        }
+    }
+    *seen = answering;
+    seen->when = time(NULL);
+}
+
+/*
+ * hold on to what we say to a peer while processing its frame in case
+ * it asks again
+ */
+static void
+save_answer (unsigned char *mymac, unsigned char *peermac, unsigned char field,
+             unsigned long freq, char *data, int len)
+{
+    if (!answering_valid || (field != PUB_ACTION_VENDOR) || (len > WIRELESS_MTU) ||
+        memcmp(answering.mymac, mymac, ETH_ALEN) ||
+        memcmp(answering.peermac, peermac, ETH_ALEN)) {
+        return;
+    }
+    answering.field = field;
+    answering.freq = freq;
+    answering.len = len;
+    memcpy(answering.buf, data, len);
+}
+
 static void
 process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame *frame, int framesize)
 {
@@ -316,15 +763,12 @@ process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame
     struct dpp_instance *instance;
     struct pkex_instance *pinst;
     char el_id, el_len, ssid[33];
-    unsigned char *els, pmk[PMK_LEN], pmkid[PMKID_LEN], pkey[200];
-    unsigned char mac[20], keyasn1[1024], keyhash[SHA256_DIGEST_LENGTH];
-    unsigned int mdlen = SHA256_DIGEST_LENGTH;
+    unsigned char *els, pmk[PMK_LEN], pmkid[PMKID_LEN];
     unsigned short frame_control;
-    int type, stype, left, ret, oc, chan, asn1len;
+    int type, stype, left, ret;
     unsigned char broadcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    struct bskey *bk;
     TLV *rhash;
-    FILE *fp;
-    EVP_MD_CTX *mdctx;
 
     /*
      * if we sent it, ignore it
@@ -368,6 +812,9 @@ process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame
                          * PKEX, DPP Auth, and DPP Discovery
                          */
                         dpp = (dpp_action_frame *)frame->action.variable;
+                        if (retransmitted_frame(inf, frame, left)) {
+                            break;
+                        }
                         switch (dpp->frame_type) {
                             /*
                              * DPP Auth
@@ -383,7 +830,10 @@ process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame
                                 if (process_dpp_auth_frame(frame->action.variable, left, instance->handle) < 0) {
                                     fprintf(stderr, "error processing DPP Auth frame from " MACSTR "\n",
                                             MAC2STR(frame->sa));
+                                    remember_frame(0);
+                                    break;
                                 }
+                                remember_frame(1);
                                 break;
                                 /*
                                  * DPP Discovery
@@ -392,10 +842,17 @@ process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame
                                 if ((instance = create_discovery_instance(inf->bssid, frame->sa)) == NULL) {
                                     break;
                                 }
-                                if (process_dpp_discovery_frame(frame->action.variable, left, instance->tid,
-                                                                pmk, pmkid) < 0) {
+                                if ((ret = process_dpp_discovery_frame(frame->action.variable, left,
+                                                                       instance->tid, pmk, pmkid)) < 0) {
                                     fprintf(stderr, "error processing DPP Discovery frame from " MACSTR "\n",
                                             MAC2STR(frame->sa));
+                                    break;
+                                }
+                                /*
+                                 * 0 means it was dropped, no PMK came out of it
+                                 */
+                                if (ret > 0) {
+                                    dpp_add_pmksa(frame->sa, pmk, pmkid);
                                 }
                                 break;
                             case DPP_SUB_PEER_DISCOVER_RESP:
@@ -404,10 +861,17 @@ process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame
                                             MAC2STR(inf->bssid), MAC2STR(frame->sa));
                                     return;
                                 }
-                                if (process_dpp_discovery_frame(frame->action.variable, left, instance->tid,
-                                                                pmk, pmkid) < 0) {
+                                if ((ret = process_dpp_discovery_frame(frame->action.variable, left,
+                                                                       instance->tid, pmk, pmkid)) < 0) {
                                     fprintf(stderr, "error processing DPP Discovery frame from " MACSTR "\n",
                                             MAC2STR(frame->sa));
+                                    break;
+                                }
+                                /*
+                                 * 0 means it was dropped, no PMK came out of it
+                                 */
+                                if (ret > 0) {
+                                    dpp_add_pmksa(frame->sa, pmk, pmkid);
                                 }
                                 break;
                                 /*
@@ -418,7 +882,7 @@ process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame
                             case PKEX_SUB_EXCH_RESP:
                             case PKEX_SUB_COM_REV_REQ:
                             case PKEX_SUB_COM_REV_RESP:
-                                if ((pinst = find_pkex_instance_by_mac(inf->bssid)) == NULL) {
+                                if ((pinst = find_pkex_instance_by_mac(inf->bssid, frame->sa)) == NULL) {
                                     if (dpp->frame_type == PKEX_SUB_EXCH_V1REQ) {
                                         pinst = create_pkex_instance(inf->bssid, frame->sa, 1);
                                         pkex_update_macs(pinst->handle, inf->bssid, frame->sa);
@@ -435,7 +899,7 @@ process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame
                                      * if we started out broadcasting, we now got a response so
                                      * update MACs
                                      */
-                                    memcpy(pinst->peermac, frame->sa, ETH_ALEN);
+                                    set_pkex_peer(pinst, frame->sa);
                                     pkex_update_macs(pinst->handle, inf->bssid, frame->sa);
                                 }
                                 fprintf(stderr, "received PKEX frame from " MACSTR " to " MACSTR "\n",
@@ -443,7 +907,10 @@ process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame
                                 if (process_pkex_frame(frame->action.variable, left, pinst->handle) < 0) {
                                     fprintf(stderr, "error processing PKEX frame from " MACSTR "\n",
                                             MAC2STR(frame->sa));
+                                    remember_frame(0);
+                                    break;
                                 }
+                                remember_frame(1);
                                 break;
                             case DPP_CONFIG_RESULT:
                                 if ((instance = find_instance_by_mac(inf->bssid, frame->sa)) == NULL) {
@@ -466,38 +933,16 @@ process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame
                                     fprintf(stderr, "malformed though\n");
                                     return;
                                 }
-                                if ((fp = fopen(bootstrapfile, "r")) == NULL) {
-                                    return;
-                                }
-                                if ((mdctx = EVP_MD_CTX_new()) == NULL) {
-                                    fclose(fp);
-                                    return;
-                                }
-                                while (!feof(fp)) {
-                                    memset(pkey, 0, sizeof(pkey));
-                                    if (fscanf(fp, "%d %d %d %s %s", &ret, &oc, &chan, mac, pkey) < 0) {
-                                        continue;
-                                    }
-                                    if ((asn1len = EVP_DecodeBlock(keyasn1, pkey, strlen((char *)pkey))) < 0) {
-                                        continue;
-                                    }
-                                    fprintf(stderr, "checking %d...", ret);
-                                    EVP_DigestInit(mdctx, EVP_sha256());
-                                    EVP_DigestUpdate(mdctx, "chirp", strlen("chirp"));
-                                    EVP_DigestUpdate(mdctx, keyasn1, asn1len - 1);
-                                    EVP_DigestFinal(mdctx, keyhash, &mdlen);
-                                    /*
-                                     * if we have that bootstrap key, initiate to her!
-                                     */
-                                    if (memcmp(keyhash, TLV_value(rhash), SHA256_DIGEST_LENGTH) == 0) {
-                                        fprintf(stderr, "YES!!!\n");
-                                        create_dpp_instance(inf->bssid, frame->sa, pkey, 1, 0);
-                                        break;
-                                    } else {
-                                        fprintf(stderr, "no\n");
-                                    }
+                                /*
+                                 * if we have that bootstrap key, initiate to her!
+                                 */
+                                if ((TLV_length(rhash) != SHA256_DIGEST_LENGTH) ||
+                                    ((bk = bskeys_by_chirp(TLV_value(rhash))) == NULL)) {
+                                    fprintf(stderr, "not one of ours\n");
+                                    break;
                                 }
-                                fclose(fp);
+                                fprintf(stderr, "it's key %d!\n", bk->idx);
+                                create_dpp_instance(inf->bssid, frame->sa, bk, 1, 0);
                                 break;
                             default:
                                 fprintf(stderr, "unknown DPP frame %d\n", dpp->frame_type);
@@ -572,6 +1017,15 @@ process_incoming_mgmt_frame (struct interface *inf, struct ieee80211_mgmt_frame
                         if ((el_len == 0) || memcmp(ssid, our_ssid, strlen(ssid))) {
                             break;
                         }
+                        /*
+                         * if we already have a PMKSA with this AP there's no need to discover it
+                         */
+                        if (dpp_get_pmksa_by_mac(frame->sa, pmkid, pmk) > 0) {
+                            printf("reusing PMKSA with " MACSTR ", skip DPP Discovery\n",
+                                   MAC2STR(frame->sa));
+                            discovered = 1;
+                            break;
+                        }
                         if ((instance = create_discovery_instance(inf->bssid, frame->sa)) == NULL) {
                             break;
                         }
@@ -744,8 +1198,13 @@ mgmt_frame_in (struct nl_msg *msg, void *data)
     }
 #endif
     switch (gnlh->cmd) {
-        case NL80211_CMD_FRAME:
         case NL80211_CMD_FRAME_TX_STATUS:
+            if (tb[NL80211_ATTR_COOKIE]) {
+                nl_tx_status(inf, nla_get_u64(tb[NL80211_ATTR_COOKIE]),
+                             tb[NL80211_ATTR_ACK] != NULL);
+            }
+            /* fall through */
+        case NL80211_CMD_FRAME:
             frame = (struct ieee80211_mgmt_frame *)nla_data(tb[NL80211_ATTR_FRAME]);
             framesize = nla_len(tb[NL80211_ATTR_FRAME]);
             process_incoming_mgmt_frame(inf, frame, framesize);
@@ -753,6 +1212,16 @@ mgmt_frame_in (struct nl_msg *msg, void *data)
         case NL80211_CMD_FRAME_WAIT_CANCEL:
 //            fprintf(stderr, "mgmt_frame_in() got a wait cancel!\n");
             break;
+        case NL80211_CMD_NEW_SCAN_RESULTS:
+        case NL80211_CMD_SCAN_ABORTED:
+            /*
+             * scan events go to everyone, only look at ones for us
+             */
+            if (!tb[NL80211_ATTR_IFINDEX] ||
+                (nla_get_u32(tb[NL80211_ATTR_IFINDEX]) == inf->ifindex)) {
+                nl_scan_done(inf, gnlh->cmd == NL80211_CMD_SCAN_ABORTED);
+            }
+            break;
         default:
             fprintf(stderr, "mgmt_frame_in() got a %s\n",
                     nl80211_command_to_string(gnlh->cmd));
@@ -772,16 +1241,271 @@ nl_sock_in (int fd, void *data)
     }
 }
 
+/*
+ * classic BPF program for the loopback socket. Everyone on "lo" sees
+ * everything written to it, so let the kernel throw away our own frames,
+ * frames addressed to someone else, and anything that isn't a beacon, a
+ * DPP/PKEX public action frame, or a GAS frame before we're woken up for it.
+ */
 static void
-bpf_frame_in (int fd, void *data)
+attach_frame_filter (struct interface *inf)
 {
-    struct interface *inf = (struct interface *)data;
-    unsigned char buf[WIRELESS_MTU];
-    struct ieee80211_mgmt_frame *frame;
-    struct sockaddr_ll from;
-    socklen_t fromlen;
-    int framesize;
+    unsigned int bw, bh;
+    enum { FC = 13, ACCEPT = 24, DROP = 25 };
+    struct sock_fprog prog;
+
+    bw = (inf->bssid[0] << 24) | (inf->bssid[1] << 16) | (inf->bssid[2] << 8) | inf->bssid[3];
+    bh = (inf->bssid[4] << 8) | inf->bssid[5];
+    {
+        struct sock_filter code[] = {
+            /* 0: drop our copy of outgoing frames */
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_OUTGOING, DROP - 2, 0),
+            /* 2: drop frames we sent */
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, sa)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, bw, 0, 2),
+            BPF_STMT(BPF_LD|BPF_H|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, sa) + 4),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, bh, DROP - 6, 0),
+            /* 6: must be broadcast or for us */
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, da)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0xffffffff, 0, 2),
+            BPF_STMT(BPF_LD|BPF_H|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, da) + 4),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0xffff, FC - 10, DROP - 10),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, bw, 0, DROP - 11),
+            BPF_STMT(BPF_LD|BPF_H|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, da) + 4),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, bh, 0, DROP - 13),
+            /* 13: beacons and public action frames */
+            BPF_STMT(BPF_LD|BPF_B|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, frame_control)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IEEE802_11_FC_TYPE_MGMT << 2 | IEEE802_11_FC_STYPE_BEACON << 4,
+                     ACCEPT - 15, 0),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IEEE802_11_FC_TYPE_MGMT << 2 | IEEE802_11_FC_STYPE_ACTION << 4,
+                     0, DROP - 16),
+            BPF_STMT(BPF_LD|BPF_B|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, action.category)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ACTION_PUBLIC, 0, DROP - 18),
+            /* 18: vendor specific with the WFA DPP OUI/type, or GAS */
+            BPF_STMT(BPF_LD|BPF_B|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, action.field)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PUB_ACTION_VENDOR, 0, 2),
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, offsetof(struct ieee80211_mgmt_frame, action.variable)),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x506f9a1a, ACCEPT - 22, DROP - 22),
+            BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, GAS_INITIAL_REQUEST, 0, DROP - 23),
+            BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, GAS_COMEBACK_RESPONSE, DROP - 24, ACCEPT - 24),
+            /* 24: */
+            BPF_STMT(BPF_RET|BPF_K, 0xffffffff),
+            /* 25: */
+            BPF_STMT(BPF_RET|BPF_K, 0),
+        };
+
+        prog.len = sizeof(code)/sizeof(code[0]);
+        prog.filter = code;
+        /*
+         * not fatal, bpf_frame_in and process_incoming_mgmt_frame still
+         * do all these checks themselves
+         */
+        if (setsockopt(inf->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+            fprintf(stderr, "unable to attach frame filter to %s\n", inf->ifname);
+            perror("setsockopt");
+        }
+    }
+}
+
+/*
+ * map TPACKET_V3 rings over the loopback socket so frames are read in
+ * blocks straight out of shared memory instead of one recvfrom() each
+ */
+static int
+setup_packet_ring (struct interface *inf)
+{
+    int version = TPACKET_V3, loss = 1;
+    char junk[WIRELESS_MTU];
+
+    if (setsockopt(inf->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("setsockopt: PACKET_VERSION");
+        return -1;
+    }
+    /*
+     * every send goes through the TX ring once there is one, have the
+     * kernel skip a bad frame rather than wedge the ring on it. This
+     * can't be changed once a ring is set up.
+     */
+    if (setsockopt(inf->fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) < 0) {
+        perror("setsockopt: PACKET_LOSS");
+    }
+    memset(&inf->rxreq, 0, sizeof(struct tpacket_req3));
+    inf->rxreq.tp_block_size = RING_BLOCK_SIZE;
+    inf->rxreq.tp_block_nr = RING_RX_BLOCKS;
+    inf->rxreq.tp_frame_size = RING_FRAME_SIZE;
+    inf->rxreq.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_RX_BLOCKS;
+    inf->rxreq.tp_retire_blk_tov = RING_RETIRE_MS;
+    if (setsockopt(inf->fd, SOL_PACKET, PACKET_RX_RING, &inf->rxreq, sizeof(struct tpacket_req3)) < 0) {
+        perror("setsockopt: PACKET_RX_RING");
+        return -1;
+    }
+    /*
+     * the TX ring is nice to have, older kernels can't do it with V3
+     */
+    memset(&inf->txreq, 0, sizeof(struct tpacket_req3));
+    inf->txreq.tp_block_size = RING_BLOCK_SIZE;
+    inf->txreq.tp_block_nr = RING_TX_BLOCKS;
+    inf->txreq.tp_frame_size = RING_FRAME_SIZE;
+    inf->txreq.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_TX_BLOCKS;
+    if (setsockopt(inf->fd, SOL_PACKET, PACKET_TX_RING, &inf->txreq, sizeof(struct tpacket_req3)) < 0) {
+        fprintf(stderr, "no TX ring on %s, sending with write()\n", inf->ifname);
+        memset(&inf->txreq, 0, sizeof(struct tpacket_req3));
+    }
+    inf->ringlen = (inf->rxreq.tp_block_size * inf->rxreq.tp_block_nr) +
+        (inf->txreq.tp_block_size * inf->txreq.tp_block_nr);
+    if ((inf->ring = mmap(NULL, inf->ringlen, PROT_READ|PROT_WRITE, MAP_SHARED,
+                          inf->fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        /*
+         * give the rings back or nothing will ever be read again
+         */
+        inf->ring = NULL;
+        memset(&inf->rxreq, 0, sizeof(struct tpacket_req3));
+        setsockopt(inf->fd, SOL_PACKET, PACKET_RX_RING, &inf->rxreq, sizeof(struct tpacket_req3));
+        if (inf->txreq.tp_block_nr) {
+            memset(&inf->txreq, 0, sizeof(struct tpacket_req3));
+            setsockopt(inf->fd, SOL_PACKET, PACKET_TX_RING, &inf->txreq, sizeof(struct tpacket_req3));
+        }
+        return -1;
+    }
+    inf->rxblock = inf->txframe = 0;
+    inf->txkick = 0;
+    /*
+     * anything that was queued before the ring went up would keep the
+     * socket readable forever, toss it
+     */
+    while (recv(inf->fd, junk, sizeof(junk), MSG_DONTWAIT) > 0);
 
+    printf("mapped %d RX and %d TX blocks on %s\n", inf->rxreq.tp_block_nr,
+           inf->txreq.tp_block_nr, inf->ifname);
+    return 0;
+}
+
+/*
+ * have the kernel send everything that's been put in the TX ring
+ */
+static void
+flush_packet_ring (struct interface *inf, int flags)
+{
+    if (!inf->txkick) {
+        return;
+    }
+    inf->txkick = 0;
+    if ((send(inf->fd, NULL, 0, flags) < 0) && (errno != EAGAIN)) {
+        perror("send");
+    }
+}
+
+static struct tpacket3_hdr *
+tx_ring_frame (struct interface *inf)
+{
+    unsigned int perblock = inf->txreq.tp_block_size / inf->txreq.tp_frame_size;
+
+    return (struct tpacket3_hdr *)(inf->ring +
+                                   (inf->rxreq.tp_block_size * inf->rxreq.tp_block_nr) +
+                                   ((inf->txframe / perblock) * inf->txreq.tp_block_size) +
+                                   ((inf->txframe % perblock) * inf->txreq.tp_frame_size));
+}
+
+/*
+ * send a frame out the BPF socket. With a TX ring the frame is put in the
+ * ring and, if we're in the middle of processing a batch of received
+ * frames, everything gets sent with one syscall when the batch is done.
+ */
+static int
+raw_frame_out (struct interface *inf, unsigned char *buf, int len)
+{
+    struct tpacket3_hdr *hdr;
+
+    if ((inf->ring == NULL) || (inf->txreq.tp_block_nr == 0)) {
+        return write(inf->fd, buf, len);
+    }
+    if (len > (int)(RING_FRAME_SIZE - (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll)))) {
+        fprintf(stderr, "%d byte frame is too big for the TX ring\n", len);
+        return -1;
+    }
+    hdr = tx_ring_frame(inf);
+    if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+        /*
+         * ring's full, wait for the kernel to drain it
+         */
+        flush_packet_ring(inf, 0);
+        if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+            fprintf(stderr, "TX ring on %s is full, dropping frame\n", inf->ifname);
+            return -1;
+        }
+    }
+    memcpy((unsigned char *)hdr + TPACKET3_HDRLEN - sizeof(struct sockaddr_ll), buf, len);
+    hdr->tp_len = len;
+    hdr->tp_next_offset = 0;
+    __sync_synchronize();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+    inf->txframe = (inf->txframe + 1) % inf->txreq.tp_frame_nr;
+    inf->txkick = 1;
+    if (!in_rx_batch) {
+        flush_packet_ring(inf, MSG_DONTWAIT);
+    }
+    return len;
+}
+
+/*
+ * process every block the kernel has handed over in the RX ring
+ */
+static void
+ring_frame_in (struct interface *inf)
+{
+    struct tpacket_block_desc *block;
+    struct tpacket3_hdr *hdr;
+    struct sockaddr_ll *from;
+    struct interface *out;
+    unsigned int i;
+
+    in_rx_batch = 1;
+    for (;;) {
+        block = (struct tpacket_block_desc *)(inf->ring + (inf->rxblock * inf->rxreq.tp_block_size));
+        if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+            break;
+        }
+        __sync_synchronize();
+        hdr = (struct tpacket3_hdr *)((unsigned char *)block + block->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < block->hdr.bh1.num_pkts; i++) {
+            from = (struct sockaddr_ll *)((unsigned char *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+            if (from->sll_pkttype != PACKET_OUTGOING) {
+                process_incoming_mgmt_frame(inf, (struct ieee80211_mgmt_frame *)((unsigned char *)hdr + hdr->tp_mac),
+                                            hdr->tp_snaplen);
+            }
+            hdr = (struct tpacket3_hdr *)((unsigned char *)hdr + hdr->tp_next_offset);
+        }
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        inf->rxblock = (inf->rxblock + 1) % inf->rxreq.tp_block_nr;
+    }
+    in_rx_batch = 0;
+    /*
+     * send whatever got generated in response
+     */
+    TAILQ_FOREACH(out, &interfaces, entry) {
+        if (out->ring != NULL) {
+            flush_packet_ring(out, MSG_DONTWAIT);
+        }
+    }
+}
+
+static void
+bpf_frame_in (int fd, void *data)
+{
+    struct interface *inf = (struct interface *)data;
+    unsigned char buf[WIRELESS_MTU];
+    struct ieee80211_mgmt_frame *frame;
+    struct sockaddr_ll from;
+    socklen_t fromlen;
+    int framesize;
+
+    if (inf->ring != NULL) {
+        ring_frame_in(inf);
+        return;
+    }
     fromlen = sizeof(from);
     if ((framesize = recvfrom(fd, buf, sizeof(buf), MSG_TRUNC,
                               (struct sockaddr *)&from, &fromlen)) < 0) {
@@ -837,20 +1561,6 @@ no_seq_check (struct nl_msg *msg, void *arg)
     return NL_OK;
 }
 
-static int
-cookie_handler(struct nl_msg *msg, void *arg)
-{
-    struct nlattr *tb[NL80211_ATTR_MAX + 1];
-    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
-    unsigned long long *cookie = arg;
-
-    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
-              genlmsg_attrlen(gnlh, 0), NULL);
-    if (tb[NL80211_ATTR_COOKIE])
-        *cookie = nla_get_u64(tb[NL80211_ATTR_COOKIE]);
-    return NL_SKIP;
-}
-
 static void
 nlmsg_clear(struct nl_msg *msg)
 {
@@ -903,7 +1613,7 @@ send_nl_msg (struct nl_msg *msg, struct interface *inf,
              int (*handler)(struct nl_msg *, void *), void *data)
 {
     struct nl_cb *cb;
-    int opt, err = 0;
+    int err = 0;
     
     if ((cb = nl_cb_clone(inf->nl_cb)) == NULL) {
         fprintf(stderr, "can't clone an nl_cb!\n");
@@ -911,13 +1621,6 @@ send_nl_msg (struct nl_msg *msg, struct interface *inf,
         return -1;
     }
 
-    opt = 1;
-    setsockopt(nl_socket_get_fd(inf->nl_sock), SOL_NETLINK,
-               NETLINK_EXT_ACK, &opt, sizeof(opt));
-    opt = 1;
-    setsockopt(nl_socket_get_fd(inf->nl_sock), SOL_NETLINK,
-               NETLINK_CAP_ACK, &opt, sizeof(opt));
-
     if (nl_send_auto_complete(inf->nl_sock, msg) < 0) {
         fprintf(stderr, "can't send an nl_msg!\n");
         nlmsg_free(msg);
@@ -972,26 +1675,438 @@ get_nl_msg (struct interface *inf, int flags, unsigned char cmd)
 }
 
 /*
- * cons up an action frame and send it out the interface
+ * the asynchronous side of nl80211: once the service loop is running
+ * commands are sent and forgotten, the kernel's replies come in through
+ * nl_sock_in() and get matched back up to the request by sequence number.
+ */
+static struct nl_request *
+send_nl_msg_async (struct nl_msg *msg, struct interface *inf,
+                   int (*handler)(struct nl_msg *, void *),
+                   void (*done)(struct nl_request *, int), void *data)
+{
+    struct nl_request *req;
+
+    if ((req = (struct nl_request *)malloc(sizeof(struct nl_request))) == NULL) {
+        fprintf(stderr, "can't allocate an nl request!\n");
+        nlmsg_free(msg);
+        return NULL;
+    }
+    memset(req, 0, sizeof(struct nl_request));
+    if (nl_send_auto_complete(inf->nl_sock, msg) < 0) {
+        fprintf(stderr, "can't send an nl_msg!\n");
+        nlmsg_free(msg);
+        free(req);
+        return NULL;
+    }
+    req->inf = inf;
+    req->seq = nlmsg_hdr(msg)->nlmsg_seq;
+    req->cmd = ((struct genlmsghdr *)nlmsg_data(nlmsg_hdr(msg)))->cmd;
+    req->handler = handler;
+    req->done = done;
+    req->data = data;
+    gettimeofday(&req->sent, NULL);
+    TAILQ_INSERT_TAIL(&inf->nlpending, req, entry);
+    nlmsg_free(msg);
+
+    return req;
+}
+
+static struct nl_request *
+find_nl_request (struct interface *inf, unsigned int seq)
+{
+    struct nl_request *req;
+
+    TAILQ_FOREACH(req, &inf->nlpending, entry) {
+        if (req->seq == seq) {
+            break;
+        }
+    }
+    return req;
+}
+
+static void
+finish_nl_request (struct nl_request *req, int err)
+{
+    struct interface *inf = req->inf;
+
+    TAILQ_REMOVE(&inf->nlpending, req, entry);
+    if (req->done != NULL) {
+        req->done(req, err);
+    }
+    /*
+     * a frame the driver took hangs around until its TX status comes back
+     */
+    if (!err && (req->cmd == NL80211_CMD_FRAME) && req->cookie) {
+        /*
+         * don't let the ones the driver never told us about pile up
+         */
+        nl_tx_status(inf, 0, 0);
+        TAILQ_INSERT_TAIL(&inf->nltx, req, entry);
+        inf->ntx++;
+        return;
+    }
+    free(req);
+}
+
+/*
+ * NL_CB_VALID for the interface: replies to our requests go to whoever
+ * asked, everything else is an event from the kernel
+ */
+static int
+nl_msg_in (struct nl_msg *msg, void *data)
+{
+    struct interface *inf = (struct interface *)data;
+    struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+    struct nl_request *req;
+
+    if ((nlmsg_hdr(msg)->nlmsg_seq == 0) ||
+        ((req = find_nl_request(inf, nlmsg_hdr(msg)->nlmsg_seq)) == NULL)) {
+        return mgmt_frame_in(msg, data);
+    }
+    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+              genlmsg_attrlen(gnlh, 0), NULL);
+    if (tb[NL80211_ATTR_COOKIE]) {
+        req->cookie = nla_get_u64(tb[NL80211_ATTR_COOKIE]);
+    }
+    if (req->handler != NULL) {
+        return req->handler(msg, req->data);
+    }
+    return NL_SKIP;
+}
+
+static int
+nl_ack_in (struct nl_msg *msg, void *data)
+{
+    struct interface *inf = (struct interface *)data;
+    struct nl_request *req;
+
+    if ((req = find_nl_request(inf, nlmsg_hdr(msg)->nlmsg_seq)) != NULL) {
+        finish_nl_request(req, 0);
+    }
+    return NL_OK;
+}
+
+static int
+nl_error_in (struct sockaddr_nl *nla, struct nlmsgerr *err, void *data)
+{
+    struct interface *inf = (struct interface *)data;
+    struct nl_request *req;
+
+    if ((req = find_nl_request(inf, err->msg.nlmsg_seq)) != NULL) {
+        finish_nl_request(req, err->error);
+    } else {
+        fprintf(stderr, "error %d (%s) for unknown nl request %d\n",
+                err->error, nl_geterror(err->error), err->msg.nlmsg_seq);
+    }
+    return NL_SKIP;
+}
+
+/*
+ * find the frame with this cookie, or if cookie is 0 just toss the ones
+ * old enough that the driver isn't going to tell us about them
+ */
+static void
+nl_tx_status (struct interface *inf, unsigned long long cookie, int acked)
+{
+    struct nl_request *req, *next;
+    struct timeval now;
+    long age;
+
+    gettimeofday(&now, NULL);
+    for (req = TAILQ_FIRST(&inf->nltx); req != NULL; req = next) {
+        next = TAILQ_NEXT(req, entry);
+        age = (now.tv_sec - req->sent.tv_sec) * 1000 +
+            (now.tv_usec - req->sent.tv_usec) / 1000;
+        if (cookie && (req->cookie == cookie)) {
+            printf("frame %llx %s after %ldms, %d still in flight\n", cookie,
+                   acked ? "acked" : "not acked", age, inf->ntx - 1);
+        } else if (age <= (long)(inf->max_roc + 1000)) {
+            continue;
+        }
+        TAILQ_REMOVE(&inf->nltx, req, entry);
+        inf->ntx--;
+        free(req);
+    }
+}
+
+static void
+frame_sent (struct nl_request *req, int err)
+{
+    if (err) {
+        fprintf(stderr, "unable to send mgmt frame: %d (%s)\n",
+                err, nl_geterror(err));
+    }
+}
+
+static long
+tv_diff_ms (struct timeval *a, struct timeval *b)
+{
+    return ((a->tv_sec - b->tv_sec) * 1000) + ((a->tv_usec - b->tv_usec) / 1000);
+}
+
+static void
+tv_add_ms (struct timeval *tv, long ms)
+{
+    tv->tv_sec += ms / 1000;
+    tv->tv_usec += (ms % 1000) * 1000;
+    if (tv->tv_usec >= 1000000) {
+        tv->tv_sec++;
+        tv->tv_usec -= 1000000;
+    }
+}
+
+static struct chan_stats *
+get_chan_stats (struct interface *inf, unsigned long freq)
+{
+    int i;
+
+    for (i = 0; i < inf->nchstats; i++) {
+        if (inf->chstats[i].freq == freq) {
+            return &inf->chstats[i];
+        }
+    }
+    if (inf->nchstats == TX_MAX_CHANNELS) {
+        return NULL;
+    }
+    memset(&inf->chstats[i], 0, sizeof(struct chan_stats));
+    inf->chstats[i].freq = freq;
+    inf->nchstats++;
+    return &inf->chstats[i];
+}
+
+static void
+tx_stats_report (timerid id, void *data)
+{
+    struct interface *inf = (struct interface *)data;
+    int i;
+
+    printf("TX scheduler on %s:\n", inf->ifname);
+    for (i = 0; i < inf->nchstats; i++) {
+        printf("\t%ld: %ld frames, %ld switches, %ldms airtime\n",
+               inf->chstats[i].freq, inf->chstats[i].frames,
+               inf->chstats[i].switches, inf->chstats[i].airtime);
+    }
+    inf->statstimer = srv_add_timeout(srvctx, SRV_SEC(60), tx_stats_report, inf);
+}
+
+static int
+send_mgmt_frame (struct interface *inf, struct tx_frame *txf, long dwell)
+{
+    struct nl_msg *msg;
+
+    if ((msg = get_nl_msg(inf, 0, NL80211_CMD_FRAME)) == NULL) {
+        fprintf(stderr, "can't create an nl msg!\n");
+        return -1;
+    }
+    nla_put_u32(msg, NL80211_ATTR_WIPHY_FREQ, txf->freq);
+    nla_put_u32(msg, NL80211_ATTR_DURATION, dwell);
+    if (inf->offchan_tx_ok) {
+        nla_put_flag(msg, NL80211_ATTR_OFFCHANNEL_TX_OK);
+    }
+    nla_put(msg, NL80211_ATTR_FRAME, txf->len, txf->buf);
+    printf("sending %d byte frame on %ld, %d in flight\n", txf->len,
+           txf->freq, inf->ntx);
+    if (send_nl_msg_async(msg, inf, NULL, frame_sent, NULL) == NULL) {
+        fprintf(stderr, "can't send nl msg!\n");
+        return -1;
+    }
+    return txf->len;
+}
+
+static void tx_window_end(timerid, void *);
+static void tx_schedule(struct interface *);
+
+static void
+tx_frame_out (struct interface *inf, struct tx_frame *txf, long dwell)
+{
+    struct chan_stats *cs;
+
+    if ((send_mgmt_frame(inf, txf, dwell) > 0) &&
+        ((cs = get_chan_stats(inf, txf->freq)) != NULL)) {
+        cs->frames++;
+    }
+    TAILQ_REMOVE(&inf->txq, txf, entry);
+    free(txf);
+}
+
+static void
+roc_started (struct nl_request *req, int err)
+{
+    struct interface *inf = req->inf;
+    struct chan_stats *cs;
+
+    if (req != inf->rocreq) {
+        return;                 /* that window's already over */
+    }
+    inf->rocreq = NULL;
+    if (err) {
+        /*
+         * frames still go out, the driver just won't stay to listen
+         */
+        fprintf(stderr, "unable to remain on %ld: %d (%s)\n", inf->txfreq,
+                err, nl_geterror(err));
+    } else {
+        inf->roccookie = req->cookie;
+        gettimeofday(&inf->winstart, NULL);
+        if ((cs = get_chan_stats(inf, inf->txfreq)) != NULL) {
+            cs->switches++;
+        }
+    }
+    tx_schedule(inf);
+}
+
+static void
+roc_cancelled (struct nl_request *req, int err)
+{
+    if (err) {
+        fprintf(stderr, "unable to cancel remain on channel: %d (%s)\n",
+                err, nl_geterror(err));
+    }
+}
+
+/*
+ * ask the driver to go to the channel of the oldest frame waiting and
+ * stay long enough to hear the answer to everything queued for it
+ */
+static void
+tx_window_open (struct interface *inf, unsigned long freq)
+{
+    struct nl_msg *msg;
+    struct tx_frame *txf;
+    unsigned long duration = 0;
+
+    TAILQ_FOREACH(txf, &inf->txq, entry) {
+        if ((txf->freq == freq) && (txf->dwell > duration)) {
+            duration = txf->dwell;
+        }
+    }
+    if (duration > inf->max_roc) {
+        duration = inf->max_roc;
+    }
+    inf->txfreq = freq;
+    inf->roccookie = 0;
+    gettimeofday(&inf->winstart, NULL);
+    inf->winend = inf->winstart;
+    tv_add_ms(&inf->winend, duration);
+    inf->rocend = inf->winend;
+    if (((msg = get_nl_msg(inf, 0, NL80211_CMD_REMAIN_ON_CHANNEL)) == NULL) ||
+        (nla_put_u32(msg, NL80211_ATTR_WIPHY_FREQ, freq) < 0) ||
+        (nla_put_u32(msg, NL80211_ATTR_DURATION, duration) < 0) ||
+        ((inf->rocreq = send_nl_msg_async(msg, inf, NULL, roc_started, NULL)) == NULL)) {
+        fprintf(stderr, "can't ask to remain on %ld!\n", freq);
+        inf->rocreq = NULL;
+    }
+    if (inf->statstimer == 0) {
+        inf->statstimer = srv_add_timeout(srvctx, SRV_SEC(60), tx_stats_report, inf);
+    }
+    inf->wintimer = srv_add_timeout(srvctx, SRV_MSEC(duration ? duration : 1), tx_window_end, inf);
+}
+
+/*
+ * frames for our own channel go now unless the radio is somewhere else.
+ * Frames for the channel of the open window go once the driver is there.
+ * If other channels are waiting the window is cut to TX_WINDOW_BUSY so a
+ * long GAS exchange doesn't hold up everyone else; otherwise when it
+ * closes the oldest frame waiting picks the next channel and everyone on
+ * that channel goes with it.
+ */
+static void
+tx_schedule (struct interface *inf)
+{
+    struct tx_frame *txf, *next;
+    struct timeval now, end;
+    long left;
+    int others = 0;
+
+    gettimeofday(&now, NULL);
+    if (inf->txfreq == 0) {
+        for (txf = TAILQ_FIRST(&inf->txq); txf != NULL; txf = next) {
+            next = TAILQ_NEXT(txf, entry);
+            if (txf->freq != inf->freq) {
+                continue;
+            }
+            tx_frame_out(inf, txf, txf->dwell);
+        }
+        if ((txf = TAILQ_FIRST(&inf->txq)) == NULL) {
+            return;
+        }
+        tx_window_open(inf, txf->freq);
+    }
+    if (inf->rocreq != NULL) {
+        return;
+    }
+    if ((left = tv_diff_ms(&inf->winend, &now)) < 1) {
+        left = 1;
+    }
+    for (txf = TAILQ_FIRST(&inf->txq); txf != NULL; txf = next) {
+        next = TAILQ_NEXT(txf, entry);
+        if (txf->freq != inf->txfreq) {
+            others++;
+            continue;
+        }
+        tx_frame_out(inf, txf, left);
+    }
+    if (others) {
+        end = inf->winstart;
+        tv_add_ms(&end, TX_WINDOW_BUSY);
+        if (tv_diff_ms(&inf->winend, &end) > 0) {
+            inf->winend = end;
+            if ((left = tv_diff_ms(&inf->winend, &now)) < 1) {
+                left = 1;
+            }
+            srv_rem_timeout(srvctx, inf->wintimer);
+            inf->wintimer = srv_add_timeout(srvctx, SRV_MSEC(left), tx_window_end, inf);
+        }
+    }
+}
+
+static void
+tx_window_end (timerid id, void *data)
+{
+    struct interface *inf = (struct interface *)data;
+    struct chan_stats *cs;
+    struct nl_msg *msg;
+    struct timeval now;
+
+    inf->wintimer = 0;
+    gettimeofday(&now, NULL);
+    if (inf->roccookie) {
+        if ((cs = get_chan_stats(inf, inf->txfreq)) != NULL) {
+            cs->airtime += tv_diff_ms(&now, &inf->winstart);
+        }
+        /*
+         * if we're leaving early tell the driver it can go home now
+         */
+        if ((tv_diff_ms(&inf->rocend, &inf->winend) > 0) &&
+            ((msg = get_nl_msg(inf, 0, NL80211_CMD_CANCEL_REMAIN_ON_CHANNEL)) != NULL)) {
+            nla_put_u64(msg, NL80211_ATTR_COOKIE, inf->roccookie);
+            if (send_nl_msg_async(msg, inf, NULL, roc_cancelled, NULL) == NULL) {
+                fprintf(stderr, "can't cancel remain on channel!\n");
+            }
+        }
+    }
+    inf->txfreq = 0;
+    inf->rocreq = NULL;
+    inf->roccookie = 0;
+    tx_schedule(inf);
+}
+
+/*
+ * cons up an action frame and queue it up for the interface
  */
 static int
 cons_action_frame (unsigned char field, unsigned char *mymac, unsigned char *peermac,
-                   char *data, int len)
+                   unsigned long freq, char *data, int len)
 {
     char buf[WIRELESS_MTU];
     struct interface *inf = NULL;
     struct ieee80211_mgmt_frame *frame;
+    struct tx_frame *txf;
     size_t framesize;
-    struct nl_msg *msg;
-    unsigned long long cookie;
     unsigned char broadcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
-    TAILQ_FOREACH(inf, &interfaces, entry) {
-        if (memcmp(mymac, inf->bssid, ETH_ALEN) == 0) {
-            break;
-        }
-    }
-    if (inf == NULL) {
+    if ((inf = find_interface_by_mac(mymac)) == NULL) {
         fprintf(stderr, "can't find " MACSTR " to send mgmt frame!\n",
                 MAC2STR(mymac));
         return -1;
@@ -1010,32 +2125,31 @@ cons_action_frame (unsigned char field, unsigned char *mymac, unsigned char *pee
     frame->action.category = ACTION_PUBLIC;
     frame->action.field = field;
     memcpy(frame->action.variable, data, len);
+    save_answer(mymac, peermac, field, freq, data, len);
     if (inf->is_loopback) {
-        if (write(inf->fd, buf, framesize) < 0) {
+        if (raw_frame_out(inf, (unsigned char *)buf, framesize) < 0) {
             fprintf(stderr, "unable to write management frame!\n");
             return -1;
         }
     } else {
-        if ((msg = get_nl_msg(inf, 0, NL80211_CMD_FRAME)) == NULL) {
-            fprintf(stderr, "can't create an nl msg!\n");
+        if ((txf = (struct tx_frame *)malloc(sizeof(struct tx_frame))) == NULL) {
+            fprintf(stderr, "can't allocate a frame to send!\n");
             return -1;
         }
-        nla_put_u32(msg, NL80211_ATTR_WIPHY_FREQ, inf->freq);
-        if (field == PUB_ACTION_VENDOR) {
-            nla_put_u32(msg, NL80211_ATTR_DURATION, 500);
+        txf->freq = freq ? freq : inf->freq;
+        /*
+         * a chirp is answered whenever a configurator gets around to it
+         */
+        if ((field == PUB_ACTION_VENDOR) && ((len < (int)sizeof(dpp_action_frame)) ||
+                                             (((dpp_action_frame *)data)->frame_type != DPP_CHIRP))) {
+            txf->dwell = 500;
         } else {
-            nla_put_u32(msg, NL80211_ATTR_DURATION, inf->max_roc);
-        }
-        if (inf->offchan_tx_ok) {
-            nla_put_flag(msg, NL80211_ATTR_OFFCHANNEL_TX_OK);
-        }
-        nla_put(msg, NL80211_ATTR_FRAME, framesize, buf);
-        printf("sending %ld byte frame on %ld\n", framesize, inf->freq);
-        cookie = 0;
-        if (send_nl_msg(msg, inf, cookie_handler, &cookie) < 0) {
-            fprintf(stderr, "can't send nl msg!\n");
-            return -1;
+            txf->dwell = inf->max_roc;
         }
+        txf->len = framesize;
+        memcpy(txf->buf, buf, framesize);
+        TAILQ_INSERT_TAIL(&inf->txq, txf, entry);
+        tx_schedule(inf);
     }
     return len;
 }
@@ -1055,19 +2169,21 @@ chan2freq (unsigned int chan)
     return 5000 + (chan * 5);
 }
 
+static void
+channel_set (struct nl_request *req, int err)
+{
+    if (err) {
+        fprintf(stderr, "unable to change channel!\n");
+    }
+}
+
 static int
 change_freq (unsigned char *mac, unsigned long freak)
 {
     struct nl_msg *msg;
-    unsigned long long cookie;
     struct interface *inf;
     
-    TAILQ_FOREACH(inf, &interfaces, entry) {
-        if (memcmp(mac, inf->bssid, ETH_ALEN) == 0) {
-            break;
-        }
-    }
-    if (inf == NULL) {
+    if ((inf = find_interface_by_mac(mac)) == NULL) {
         fprintf(stderr, "can't find " MACSTR " to change channel!\n",
                 MAC2STR(mac));
         return -1;
@@ -1083,9 +2199,8 @@ change_freq (unsigned char *mac, unsigned long freak)
     nla_put_u32(msg, NL80211_ATTR_WIPHY_FREQ, freak);
     nla_put_u32(msg, NL80211_ATTR_WIPHY_CHANNEL_TYPE, NL80211_CHAN_NO_HT);
     nla_put_u32(msg, NL80211_ATTR_DURATION, inf->max_roc);
-    cookie = 0;
 
-    if (send_nl_msg(msg, inf, cookie_handler, &cookie)) {
+    if (send_nl_msg_async(msg, inf, NULL, channel_set, NULL) == NULL) {
         fprintf(stderr, "unable to change channel!\n");
 //        return -1;
     }
@@ -1102,7 +2217,11 @@ change_dpp_freq (dpp_handle handle, unsigned long freq)
     if ((instance = find_instance_by_handle(handle)) == NULL) {
         return -1;
     }
-    return change_freq(instance->mymac, freq);
+    /*
+     * the radio goes there when the TX scheduler has something for this peer
+     */
+    instance->freq = freq;
+    return 1;
 }
 
 int
@@ -1131,8 +2250,9 @@ change_dpp_channel (dpp_handle handle, unsigned char class, unsigned char channe
         return -1;
     }
     freak = chan2freq(channel);
-    printf("trying to change to channel %d (%ld)\n", channel, freak);
-    return change_freq(instance->mymac, freak);
+    printf("peer changing to channel %d (%ld)\n", channel, freak);
+    instance->freq = freak;
+    return 1;
 }
 
 int
@@ -1144,7 +2264,7 @@ transmit_config_frame (dpp_handle handle, unsigned char field, char *data, int l
         return -1;
     }
 //    nl_debug = 4;
-    return cons_action_frame(field, instance->mymac, instance->peermac, data, len);
+    return cons_action_frame(field, instance->mymac, instance->peermac, instance->freq, data, len);
 }
 
 int
@@ -1155,7 +2275,7 @@ transmit_auth_frame (dpp_handle handle, char *data, int len)
     if ((instance = find_instance_by_handle(handle)) == NULL) {
         return -1;
     }
-    return cons_action_frame(PUB_ACTION_VENDOR, instance->mymac, instance->peermac, data, len);
+    return cons_action_frame(PUB_ACTION_VENDOR, instance->mymac, instance->peermac, instance->freq, data, len);
 }
 
 int
@@ -1166,7 +2286,7 @@ transmit_discovery_frame (unsigned char tid, char *data, int len)
     if ((instance = find_instance_by_tid(tid)) == NULL) {
         return -1;
     }
-    return cons_action_frame(PUB_ACTION_VENDOR, instance->mymac, instance->peermac, data, len);
+    return cons_action_frame(PUB_ACTION_VENDOR, instance->mymac, instance->peermac, instance->freq, data, len);
 }
 
 int
@@ -1177,7 +2297,7 @@ transmit_pkex_frame (pkex_handle handle, char *data, int len)
     if ((instance = find_pkex_instance_by_handle(handle)) == NULL) {
         return -1;
     }
-    return cons_action_frame(PUB_ACTION_VENDOR, instance->mymac, instance->peermac, data, len);
+    return cons_action_frame(PUB_ACTION_VENDOR, instance->mymac, instance->peermac, 0, data, len);
 }
 
 static int
@@ -1240,7 +2360,7 @@ send_beacon (timerid tid, void *data)
     el += strlen(our_ssid);
 
     len = el - buf;
-    blen = write(inf->fd, buf, len);
+    blen = raw_frame_out(inf, buf, len);
     if (blen < 0) {
         perror("write");
     }
@@ -1251,6 +2371,7 @@ static struct nl_sock *
 create_nl_socket (struct nl_cb *cb)
 {
     struct nl_sock *sock;
+    int opt;
     
     if ((sock = nl_socket_alloc_cb(cb)) == NULL) {
         fprintf(stderr, "unable to alloc an nl socket\n");
@@ -1260,6 +2381,12 @@ create_nl_socket (struct nl_cb *cb)
         fprintf(stderr, "unable to connect an nl socket!\n");
         return NULL;
     }
+    opt = 1;
+    setsockopt(nl_socket_get_fd(sock), SOL_NETLINK,
+               NETLINK_EXT_ACK, &opt, sizeof(opt));
+    opt = 1;
+    setsockopt(nl_socket_get_fd(sock), SOL_NETLINK,
+               NETLINK_CAP_ACK, &opt, sizeof(opt));
     return sock;
 }
 
@@ -1314,126 +2441,265 @@ nl_get_multicast_id (struct interface *inf, const char *family, const char *grou
     return res.id;
 }
 
+/*
+ * pull out what we care about from a BSS's IEs in one pass: its SSID
+ * and whether it's beaconing out the DPP Configurator Connectivity IE
+ */
+static void
+parse_bss_ies (struct bss_entry *bss, unsigned char *ie, int ielen)
+{
+    const unsigned char dpp_config_conn[6] = {
+        0xdd, 0x04, 0x50, 0x6f, 0x9a, 0x1e
+    };
+
+    memset(bss->ssid, 0, sizeof(bss->ssid));
+    bss->conie = 0;
+    while (ielen >= 2 && ielen >= ie[1] + 2) {
+        if (ie[0] == IEEE802_11_IE_SSID && ie[1] <= 32) {
+            memcpy(bss->ssid, ie + 2, ie[1]);
+        }
+        if ((ie[1] + 2 >= sizeof(dpp_config_conn)) &&
+            (memcmp(ie, dpp_config_conn, sizeof(dpp_config_conn)) == 0)) {
+            bss->conie = 1;
+        }
+        ielen -= ie[1] + 2;
+        ie += ie[1] + 2;
+    }
+}
+
+static unsigned char
+freq2chan (unsigned long freq)
+{
+    if (freq == 2484) {                 /* chan 14 */
+        return 14;
+    }
+    if (freq < 2473) {                  /* chan 0-13 */
+        return ((freq - 2407)/5);
+    }
+    if (freq < 2733) {                  /* chan 15-26 */
+        return (((freq - 2512)/20) + 15);
+    }
+    return ((freq - 5000)/5);
+}
+
+/*
+ * one BSS from a scan dump, add it to the cache or refresh what we
+ * already know about it
+ */
 static int
-scan_callback_trigger (struct nl_msg *msg, void *arg) 
+bss_in (struct nl_msg *msg, void *arg)
 {
     struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
-    struct trigger_results *results = arg;
+    struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    struct nlattr *bss[NL80211_BSS_MAX + 1];
+    static struct nla_policy bss_policy[NL80211_BSS_MAX + 1] = {
+        [NL80211_BSS_TSF] = { .type = NLA_U64 },
+        [NL80211_BSS_FREQUENCY] = { .type = NLA_U32 },
+        [NL80211_BSS_BSSID] = { },
+        [NL80211_BSS_BEACON_INTERVAL] = { .type = NLA_U16 },
+        [NL80211_BSS_CAPABILITY] = { .type = NLA_U16 },
+        [NL80211_BSS_INFORMATION_ELEMENTS] = { },
+        [NL80211_BSS_SIGNAL_MBM] = { .type = NLA_U32 },
+        [NL80211_BSS_SIGNAL_UNSPEC] = { .type = NLA_U8 },
+        [NL80211_BSS_STATUS] = { .type = NLA_U32 },
+        [NL80211_BSS_SEEN_MS_AGO] = { .type = NLA_U32 },
+        [NL80211_BSS_BEACON_IES] = { },
+    };
+    struct interface *inf = (struct interface *)arg;
+    struct bss_entry *cached;
+    unsigned char *bssid;
 
-    switch (gnlh->cmd) {
-        case NL80211_CMD_SCAN_ABORTED:
-            results->done = 1;
-            results->aborted = 1;
-            break;
-        case NL80211_CMD_NEW_SCAN_RESULTS:
-            results->done = 1;
-            results->aborted = 0;
-            break;
-        default:
-//            printf("weird multicast message\n");
+    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0), genlmsg_attrlen(gnlh, 0), NULL);
+    if (!tb[NL80211_ATTR_BSS]) {
+        printf("bss info missing!\n");
+        return NL_SKIP;
+    }
+    if (nla_parse_nested(bss, NL80211_BSS_MAX, tb[NL80211_ATTR_BSS], bss_policy)) {
+        printf("failed to parse nested attributes!\n");
+        return NL_SKIP;
+    }
+    if (!bss[NL80211_BSS_BSSID]) return NL_SKIP;
+    if (!bss[NL80211_BSS_INFORMATION_ELEMENTS]) return NL_SKIP;
+
+    bssid = nla_data(bss[NL80211_BSS_BSSID]);
+    TAILQ_FOREACH(cached, &inf->bsscache, entry) {
+        if (memcmp(cached->bssid, bssid, ETH_ALEN) == 0) {
             break;
+        }
+    }
+    if (cached == NULL) {
+        if ((cached = (struct bss_entry *)malloc(sizeof(struct bss_entry))) == NULL) {
+            fprintf(stderr, "can't allocate a BSS to cache!\n");
+            return NL_SKIP;
+        }
+        memset(cached, 0, sizeof(struct bss_entry));
+        memcpy(cached->bssid, bssid, ETH_ALEN);
+        TAILQ_INSERT_TAIL(&inf->bsscache, cached, entry);
     }
+    cached->freq = bss[NL80211_BSS_FREQUENCY] ? nla_get_u32(bss[NL80211_BSS_FREQUENCY]) : 0;
+    cached->seen = time(NULL);
+    if (bss[NL80211_BSS_SEEN_MS_AGO]) {
+        cached->seen -= nla_get_u32(bss[NL80211_BSS_SEEN_MS_AGO])/1000;
+    }
+    cached->gen = inf->bssgen;
+    parse_bss_ies(cached, nla_data(bss[NL80211_BSS_INFORMATION_ELEMENTS]),
+                  nla_len(bss[NL80211_BSS_INFORMATION_ELEMENTS]));
 
     return NL_SKIP;
 }
 
-int
-find_dpp_conie (unsigned char *ie, int ielen) {
-    uint8_t len;
-    uint8_t *data;
-    char blah[33];
-    const uint8_t dpp_config_conn[6] = {
-        0xdd, 0x04, 0x50, 0x6f, 0x9a, 0x1e
-    };
+/*
+ * if an AP is beaconing out the DPP Configurator Connectivity IE
+ * then add its frequency to the chirp list
+ */
+static void
+add_chirp_freqs (struct interface *inf)
+{
+    struct bss_entry *bss;
+
+    TAILQ_FOREACH(bss, &inf->bsscache, entry) {
+        if (bss->conie) {
+            printf("FOUND THE DPP CONFIGURATOR CONNECTIVITY IE on %s, "
+                   "on frequency %ld, channel %d\n",
+                   bss->ssid, bss->freq, freq2chan(bss->freq));
+            dpp_add_chirp_freq(inf->bssid, bss->freq);
+        }
+    }
+}
+
+/*
+ * a chirping responder waits for the scan for APs so its first round of
+ * chirps goes to all their channels
+ */
+static int chirp_waiting = 0;
+static unsigned char chirp_peer[ETH_ALEN];
+static int chirp_mauth;
+
+static void
+chirp_scanned (struct interface *inf)
+{
+    add_chirp_freqs(inf);
+    if (chirp_waiting &&
+        (create_dpp_instance(inf->bssid, chirp_peer, NULL, 0, chirp_mauth) == NULL)) {
+        fprintf(stderr, "unable to create DPP instance to chirp on %s!\n", inf->ifname);
+    }
+}
+
+static void dump_scan(struct interface *);
+
+static void
+scan_finished (struct interface *inf)
+{
+    void (*done)(struct interface *) = inf->scan_done;
+
+    inf->scan_done = NULL;
+    if (done != NULL) {
+        done(inf);
+    }
+}
 
-    memset(blah, 0, 33);
-    while (ielen >= 2 && ielen >= ie[1]) {
-        if (ie[0] == 0 && ie[1] >= 0 && ie[1] <= 32) {
-            len = ie[1];
-            data = ie + 2;
-            memcpy(blah, data, len);
-        }
-        if (memcmp(ie, dpp_config_conn, sizeof(dpp_config_conn)) == 0) {
-            printf("FOUND THE DPP CONFIGURATOR CONNECTIVITY IE on %s, ", blah);
-            return 1;
+static void
+scan_triggered (struct nl_request *req, int err)
+{
+    if (err) {
+        fprintf(stderr, "unable to trigger scan: %d (%s)\n", err, nl_geterror(err));
+        req->inf->scanning = 0;
+        /*
+         * let whoever asked make do with what's in the cache
+         */
+        if (!req->inf->dumping) {
+            scan_finished(req->inf);
         }
-        ielen -= ie[1] + 2;
-        ie += ie[1] + 2;
     }
-    printf("didn't find the DPP Configurator connectivity IE on %s\n", blah);
-    return 0;
 }
 
-static unsigned char
-freq2chan (unsigned long freq)
+static void
+scan_dumped (struct nl_request *req, int err)
 {
-    if (freq == 2484) {                 /* chan 14 */
-        return 14;
-    }
-    if (freq < 2473) {                  /* chan 0-13 */
-        return ((freq - 2407)/5);
+    struct interface *inf = req->inf;
+    struct bss_entry *bss, *next;
+
+    inf->dumping = 0;
+    if (err) {
+        fprintf(stderr, "can't get scan info from kernel: %d (%s)\n",
+                err, nl_geterror(err));
+    } else {
+        /*
+         * anything not in the dump has been expired by the kernel
+         */
+        for (bss = TAILQ_FIRST(&inf->bsscache); bss != NULL; bss = next) {
+            next = TAILQ_NEXT(bss, entry);
+            if (bss->gen != inf->bssgen) {
+                TAILQ_REMOVE(&inf->bsscache, bss, entry);
+                free(bss);
+            }
+        }
     }
-    if (freq < 2733) {                  /* chan 15-26 */
-        return (((freq - 2512)/20) + 15);
+    if (inf->redump) {
+        inf->redump = 0;
+        dump_scan(inf);
+    } else if (!inf->scanning) {
+        scan_finished(inf);
     }
-    return ((freq - 5000)/5);
 }
 
-static int
-callback_dump(struct nl_msg *msg, void *arg)
+static void
+dump_scan (struct interface *inf)
 {
-    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
-    struct nlattr *tb[NL80211_ATTR_MAX + 1];
-    struct nlattr *bss[NL80211_BSS_MAX + 1];
-    static struct nla_policy bss_policy[NL80211_BSS_MAX + 1] = {
-        [NL80211_BSS_TSF] = { .type = NLA_U64 },
-        [NL80211_BSS_FREQUENCY] = { .type = NLA_U32 },
-        [NL80211_BSS_BSSID] = { },
-        [NL80211_BSS_BEACON_INTERVAL] = { .type = NLA_U16 },
-        [NL80211_BSS_CAPABILITY] = { .type = NLA_U16 },
-        [NL80211_BSS_INFORMATION_ELEMENTS] = { },
-        [NL80211_BSS_SIGNAL_MBM] = { .type = NLA_U32 },
-        [NL80211_BSS_SIGNAL_UNSPEC] = { .type = NLA_U8 },
-        [NL80211_BSS_STATUS] = { .type = NLA_U32 },
-        [NL80211_BSS_SEEN_MS_AGO] = { .type = NLA_U32 },
-        [NL80211_BSS_BEACON_IES] = { },
-    };
-    struct interface *inf = (struct interface *)arg;
-    uint32_t freq;
+    struct nl_msg *msg;
 
-    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0), genlmsg_attrlen(gnlh, 0), NULL);
-    if (!tb[NL80211_ATTR_BSS]) {
-        printf("bss info missing!\n");
-        return NL_SKIP;
+    inf->bssgen++;
+    if (((msg = get_nl_msg(inf, NLM_F_DUMP, NL80211_CMD_GET_SCAN)) == NULL) ||
+        (send_nl_msg_async(msg, inf, bss_in, scan_dumped, inf) == NULL)) {
+        fprintf(stderr, "can't get scan info from kernel!\n");
+        if (!inf->scanning) {
+            scan_finished(inf);
+        }
+        return;
     }
-    if (nla_parse_nested(bss, NL80211_BSS_MAX, tb[NL80211_ATTR_BSS], bss_policy)) {
-        printf("failed to parse nested attributes!\n");
-        return NL_SKIP;
+    inf->dumping = 1;
+}
+
+/*
+ * the kernel has new scan results, ours or anyone else's on this
+ * interface, so bring the BSS cache up to date. Whoever asked for a
+ * scan is told once the cache has its results.
+ */
+static void
+nl_scan_done (struct interface *inf, int aborted)
+{
+    if (inf->scanning) {
+        inf->scanning = 0;
+        if (aborted) {
+            fprintf(stderr, "kernel aborted our scan :-(\n");
+        } else {
+            printf("scan finished.\n");
+        }
+    } else if (aborted) {
+        return;
     }
-    if (!bss[NL80211_BSS_BSSID]) return NL_SKIP;
-    if (!bss[NL80211_BSS_INFORMATION_ELEMENTS]) return NL_SKIP;
-    /*
-     * if an AP is beaconing out the DPP Configurator Connectivity IE
-     * then add its frequency to the chirp list
-     */
-    if (find_dpp_conie(nla_data(bss[NL80211_BSS_INFORMATION_ELEMENTS]),
-                       nla_len(bss[NL80211_BSS_INFORMATION_ELEMENTS])) > 0) {
-        freq = nla_get_u32(bss[NL80211_BSS_FREQUENCY]);
-        printf("on frequency %d, channel %d\n", freq, freq2chan(freq));
-        dpp_add_chirp_freq(inf->bssid, freq);
+    if (inf->dumping) {
+        inf->redump = 1;
+        return;
     }
-    
-    return NL_SKIP;
+    dump_scan(inf);
 }
 
+/*
+ * ask the kernel to scan, for one SSID or all of them and on one
+ * frequency or all of them, done() is called when the results are
+ * in the BSS cache
+ */
 int
-trigger_scan (struct interface *inf, char *lookfor)
+trigger_scan (struct interface *inf, char *lookfor, unsigned long freq,
+              void (*done)(struct interface *))
 {
-    struct trigger_results results = { .done = 0, .aborted = 0 };
     struct nl_msg *msg;
-    struct nl_cb *cb;
-    int err = 0;
-    
+
+    if (inf->scanning || (inf->scan_done != NULL)) {
+        printf("already scanning on %s\n", inf->ifname);
+        return -1;
+    }
     if ((msg = get_nl_msg(inf, 0, NL80211_CMD_TRIGGER_SCAN)) == NULL) {
         fprintf(stderr, "can't create nlmsg to trigger a scan!\n");
         return -1;
@@ -1448,137 +2714,158 @@ trigger_scan (struct interface *inf, char *lookfor)
     } else {
         printf("scanning for all SSIDs\n");
     }
+    if (freq != 0) {
+        struct nlattr *freqs;
 
-    if ((cb = nl_cb_clone(inf->nl_cb)) == NULL) {
-        fprintf(stderr, "can't clone an nl_cb!\n");
-        nlmsg_free(msg);
-        return -1;
+        printf("\ton frequency %ld only\n", freq);
+        freqs = nla_nest_start(msg, NL80211_ATTR_SCAN_FREQUENCIES);
+        nla_put_u32(msg, 1, freq);
+        nla_nest_end(msg, freqs);
     }
-
-    if (nl_send_auto_complete(inf->nl_sock, msg) < 0) {
-        fprintf(stderr, "can't send an nl_msg!\n");
-        nlmsg_free(msg);
+    inf->scan_done = done;
+    inf->scanning = 1;
+    if (send_nl_msg_async(msg, inf, NULL, scan_triggered, NULL) == NULL) {
+        inf->scan_done = NULL;
+        inf->scanning = 0;
         return -1;
     }
-    nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &err);
-    nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
-    nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &err);
-    nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
-    nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, scan_callback_trigger, &results);
-
-    err = 1;
-    while (err > 0) {
-        int res;
-        if ((res = nl_recvmsgs(inf->nl_sock, cb)) < 0) {
-            fprintf(stderr, "nl_recvmsgs failed: %d\n", res);
-        }
-    }
-    if (err < 0) {
-        fprintf(stderr, "send_nl_msg: error receiving nl_msgs: %d\n", err);
-    }
-    while (!results.done) {
-        nl_recvmsgs(inf->nl_sock, cb);
-    }
-    if (results.aborted) {
-        fprintf(stderr, "kernel aborted our scan :-(\n");
-    } else {
-        printf("scan finished.\n");
-    }
-    
-    nl_cb_put(cb);
-    nlmsg_free(msg);
 
     return 0;
 }
 
-int
-find_dpp_ap (unsigned char *ie, int ielen, char *ssid) {
-    uint8_t len;
-    uint8_t *data;
-
-    while (ielen >= 2 && ielen >= ie[1]) {
-        if (ie[0] == 0 && ie[1] >= 0 && ie[1] <= 32) {
-            len = ie[1];
-            data = ie + 2;
-            if ((strlen(ssid) == len) && (memcmp(ssid, data, len) == 0)) {
-                printf("found %s!\n", ssid);
-                return 1;
-            }
-        }
-        ielen -= ie[1] + 2;
-        ie += ie[1] + 2;
-    }
-    return 0;
-}
-
-int
-find_dpp_access_point (struct nl_msg *msg, void *arg)
+/*
+ * start DPP Discovery with every AP recently seen beaconing out our SSID,
+ * unless we already have a PMKSA with it
+ */
+static void
+discover_cached_ssid (struct interface *inf)
 {
-    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
-    struct nlattr *tb[NL80211_ATTR_MAX + 1];
-    struct nlattr *bss[NL80211_BSS_MAX + 1];
-    static struct nla_policy bss_policy[NL80211_BSS_MAX + 1] = {
-        [NL80211_BSS_TSF] = { .type = NLA_U64 },
-        [NL80211_BSS_FREQUENCY] = { .type = NLA_U32 },
-        [NL80211_BSS_BSSID] = { },
-        [NL80211_BSS_BEACON_INTERVAL] = { .type = NLA_U16 },
-        [NL80211_BSS_CAPABILITY] = { .type = NLA_U16 },
-        [NL80211_BSS_INFORMATION_ELEMENTS] = { },
-        [NL80211_BSS_SIGNAL_MBM] = { .type = NLA_U32 },
-        [NL80211_BSS_SIGNAL_UNSPEC] = { .type = NLA_U8 },
-        [NL80211_BSS_STATUS] = { .type = NLA_U32 },
-        [NL80211_BSS_SEEN_MS_AGO] = { .type = NLA_U32 },
-        [NL80211_BSS_BEACON_IES] = { },
-    };
-    struct interface *inf = (struct interface *)arg;
+    struct bss_entry *bss;
     struct dpp_instance *instance;
+    unsigned char pmk[PMK_LEN], pmkid[PMKID_LEN];
+    time_t now = time(NULL);
 
-    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0), genlmsg_attrlen(gnlh, 0), NULL);
-    if (!tb[NL80211_ATTR_BSS]) {
-        printf("bss info missing!\n");
-        return NL_SKIP;
-    }
-    if (nla_parse_nested(bss, NL80211_BSS_MAX, tb[NL80211_ATTR_BSS], bss_policy)) {
-        printf("failed to parse nested attributes!\n");
-        return NL_SKIP;
-    }
-    if (!bss[NL80211_BSS_BSSID]) return NL_SKIP;
-    if (!bss[NL80211_BSS_INFORMATION_ELEMENTS]) return NL_SKIP;
-
-    /*
-     * find a DPP AP beaconing out this SSID
-     */
-    if (find_dpp_ap(nla_data(bss[NL80211_BSS_INFORMATION_ELEMENTS]),
-                    nla_len(bss[NL80211_BSS_INFORMATION_ELEMENTS]), our_ssid) > 0) {
+    TAILQ_FOREACH(bss, &inf->bsscache, entry) {
+        if ((now - bss->seen > BSS_FRESH) || strcmp(bss->ssid, our_ssid)) {
+            continue;
+        }
+        printf("found %s at " MACSTR "!\n", our_ssid, MAC2STR(bss->bssid));
+        if (dpp_get_pmksa_by_mac(bss->bssid, pmkid, pmk) > 0) {
+            printf("reusing PMKSA with " MACSTR ", skip DPP Discovery\n",
+                   MAC2STR(bss->bssid));
+            discovered = 1;
+            continue;
+        }
         /*
          * create a new instance since the DPP AP might not be the peer
          * to whom we spoke DPP Auth and provisioning
          */
-        if ((instance = create_discovery_instance(inf->bssid, nla_data(bss[NL80211_BSS_BSSID]))) != NULL) {
+        if ((instance = create_discovery_instance(inf->bssid, bss->bssid)) != NULL) {
+            instance->freq = bss->freq;
             if (dpp_begin_discovery(instance->tid) > 0) {
                 discovered = 1;
             }
         }
     }
-    
-    return NL_SKIP;
+}
+
+/*
+ * the frequency our SSID was last seen on, however long ago
+ */
+static unsigned long
+ssid_hint (struct interface *inf)
+{
+    struct bss_entry *bss, *latest = NULL;
+
+    TAILQ_FOREACH(bss, &inf->bsscache, entry) {
+        if (strcmp(bss->ssid, our_ssid) == 0) {
+            if ((latest == NULL) || (bss->seen > latest->seen)) {
+                latest = bss;
+            }
+        }
+    }
+    return latest != NULL ? latest->freq : 0;
+}
+
+static void scan_for_ssid(timerid, void *);
+
+/*
+ * there's only ever one scan for our SSID waiting to happen on an interface
+ */
+static void
+schedule_ssid_scan (struct interface *inf, int secs)
+{
+    if (inf->scantimer) {
+        srv_rem_timeout(srvctx, inf->scantimer);
+    }
+    inf->scantimer = srv_add_timeout(srvctx, SRV_SEC(secs), scan_for_ssid, inf);
+}
+
+/*
+ * back off each time we miss, and eventually stop
+ */
+static void
+rescan_for_ssid (struct interface *inf)
+{
+    int secs;
+
+    if (++inf->scantries >= SCAN_TRIES) {
+        fprintf(stderr, "%s not found after %d scans, giving up\n", our_ssid, inf->scantries);
+        return;
+    }
+    secs = SCAN_RETRY << (inf->scantries - 1);
+    if (secs > SCAN_RETRY_MAX) {
+        secs = SCAN_RETRY_MAX;
+    }
+    printf("%s not found, scanning again in %d seconds\n", our_ssid, secs);
+    schedule_ssid_scan(inf, secs);
+}
+
+static void
+ssid_scanned (struct interface *inf)
+{
+    if (discovered != 0) {
+        return;
+    }
+    discover_cached_ssid(inf);
+    if (discovered == 0) {
+        rescan_for_ssid(inf);
+    }
 }
 
 static void
 scan_for_ssid (timerid id, void *data)
 {
     struct interface *inf = (struct interface *)data;
-    struct nl_msg *msg;
+    unsigned long freq = 0;
 
     if (inf == NULL) {
         fprintf(stderr, "bad data on callback-- no interface! Can't scan\n");
         return;
     }
-    if (trigger_scan(inf, our_ssid) == 0) {
-        msg = get_nl_msg(inf, NLM_F_DUMP, NL80211_CMD_GET_SCAN);
-        if (send_nl_msg(msg, inf, find_dpp_access_point, inf)) {
-            fprintf(stderr, "unable to register for action frame!\n");
+    inf->scantimer = 0;
+    if (discovered != 0) {
+        return;
+    }
+    /*
+     * a scan done for someone else may have already found our SSID,
+     * otherwise if we've seen it before just look on that channel,
+     * falling back to a scan of every channel if it's not there
+     */
+    discover_cached_ssid(inf);
+    if (discovered != 0) {
+        return;
+    }
+    if (inf->hinted < SCAN_HINT_TRIES) {
+        if ((freq = ssid_hint(inf)) != 0) {
+            inf->hinted++;
         }
+    } else {
+        inf->hinted = 0;
+    }
+    if (trigger_scan(inf, our_ssid, freq, ssid_scanned) < 0) {
+        fprintf(stderr, "unable to scan for %s!\n", our_ssid);
+        rescan_for_ssid(inf);
     }
     return;
 }    
@@ -1605,12 +2892,7 @@ provision_connector (char *role, unsigned char *ssid, int ssidlen,
     memset(our_ssid, 0, 33);
     memcpy(our_ssid, ssid, ssidlen);
     if (strncmp(role, "ap", 2) == 0) {
-        TAILQ_FOREACH(inf, &interfaces, entry) {
-            if (memcmp(instance->mymac, inf->bssid, ETH_ALEN) == 0) {
-                break;
-            }
-        }
-        if (inf == NULL) {
+        if ((inf = find_interface_by_mac(instance->mymac)) == NULL) {
             fprintf(stderr, "can't find " MACSTR " to send mgmt frame!\n",
                     MAC2STR(instance->mymac));
             return -1;
@@ -1621,12 +2903,7 @@ provision_connector (char *role, unsigned char *ssid, int ssidlen,
             srv_add_timeout(srvctx, SRV_MSEC(1), send_beacon, inf);
         }
     } else if (strncmp(role, "sta", 3) == 0) {
-        TAILQ_FOREACH(inf, &interfaces, entry) {
-            if (memcmp(instance->mymac, inf->bssid, ETH_ALEN) == 0) {
-                break;
-            }
-        }
-        if (inf == NULL) {
+        if ((inf = find_interface_by_mac(instance->mymac)) == NULL) {
             fprintf(stderr, "can't find " MACSTR " to send mgmt frame!\n",
                     MAC2STR(instance->mymac));
             return -1;
@@ -1635,7 +2912,8 @@ provision_connector (char *role, unsigned char *ssid, int ssidlen,
             /*
              * let DPP finish before we go off and start scanning for SSIDs!
              */
-            srv_add_timeout(srvctx, SRV_SEC(1), scan_for_ssid, inf);
+            inf->hinted = inf->scantries = 0;
+            schedule_ssid_scan(inf, 1);
         }
         discovered = 0;
     } else {
@@ -1649,10 +2927,10 @@ save_bootstrap_key (pkex_handle handle, void *param)
 {
     EC_KEY *peerbskey = (EC_KEY *)param;
     BIO *bio = NULL;
-    FILE *fp = NULL;
-    char newone[1024], existing[1024], b64bskey[1024];
-    unsigned char *ptr, mac[2*ETH_ALEN];
-    int ret = -1, len, octets, opc, chan;
+    char newone[1024], b64bskey[1024];
+    unsigned char *ptr, keyhash[SHA256_DIGEST_LENGTH];
+    unsigned int mdlen = SHA256_DIGEST_LENGTH;
+    int ret = -1, len, octets;
     struct pkex_instance *instance;
     
     if ((instance = find_pkex_instance_by_handle(handle)) == NULL) {
@@ -1669,38 +2947,27 @@ save_bootstrap_key (pkex_handle handle, void *param)
     (void)BIO_flush(bio);
     len = BIO_get_mem_data(bio, &ptr);
     octets = EVP_EncodeBlock((unsigned char *)newone, ptr, len);
+    if (!EVP_Digest(ptr, len, keyhash, &mdlen, EVP_sha256(), NULL)) {
+        BIO_free(bio);
+        goto fin;
+    }
     BIO_free(bio);
 
     memset(b64bskey, 0, 1024);
     strncpy(b64bskey, newone, octets);
 
-    if ((fp = fopen(bootstrapfile, "r+")) == NULL) {
-        fprintf(stderr, "unable to open %s as bootstrapping file\n", bootstrapfile);
-        goto fin;
-    }
-    ret = 0;
-    while (!feof(fp)) {
-        if (fscanf(fp, "%d %d %d %s %s", &ret, &opc, &chan, mac, existing) < 0) {
-            continue;
-        }
 // TODO: stop appending everything!
-        if (strcmp(existing, newone) == 0) {
-            fprintf(stderr, "bootstrapping key is trusted already\n");
-        }
+    if (bskeys_by_hash(keyhash) != NULL) {
+        fprintf(stderr, "bootstrapping key is trusted already\n");
     }
-    ret++;
     /*
      * bootstrapping file is index opclass channel macaddr key
      */
+    if ((ret = bskeys_add(opclass, channel, instance->peermac, b64bskey)) < 0) {
+        goto fin;
+    }
     printf("it'll be %d, and it's %d long and it's %s\n", ret, octets, b64bskey);
-    fprintf(fp, "%d %d %d %02x%02x%02x%02x%02x%02x %s\n", ret, opclass, channel,
-            instance->peermac[0], instance->peermac[1], instance->peermac[2], 
-            instance->peermac[3], instance->peermac[4], instance->peermac[5], 
-            b64bskey);
   fin:
-    if (fp != NULL) {
-        fclose(fp);
-    }
     return ret;
 }
 
@@ -1764,6 +3031,24 @@ add_interface (char *ptr)
         return;
     }
     strcpy(inf->ifname, ptr);
+    TAILQ_INIT(&inf->nlpending);
+    TAILQ_INIT(&inf->nltx);
+    inf->ntx = 0;
+    inf->scanning = 0;
+    inf->scan_done = NULL;
+    inf->dumping = inf->redump = 0;
+    TAILQ_INIT(&inf->bsscache);
+    inf->bssgen = 0;
+    inf->hinted = inf->scantries = 0;
+    inf->scantimer = 0;
+    TAILQ_INIT(&inf->txq);
+    inf->txfreq = 0;
+    inf->rocreq = NULL;
+    inf->roccookie = 0;
+    inf->wintimer = inf->statstimer = 0;
+    inf->ring = NULL;
+    inf->ringlen = 0;
+    inf->nchstats = 0;
 
     /*
      * see if this is a loopback interface
@@ -1865,7 +3150,10 @@ add_interface (char *ptr)
         inf->fd = nl_socket_get_fd(inf->nl_sock);
 
         nl_cb_set(inf->nl_cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
-        nl_cb_set(inf->nl_cb, NL_CB_VALID, NL_CB_CUSTOM, mgmt_frame_in, inf);
+        nl_cb_set(inf->nl_cb, NL_CB_VALID, NL_CB_CUSTOM, nl_msg_in, inf);
+        nl_cb_set(inf->nl_cb, NL_CB_ACK, NL_CB_CUSTOM, nl_ack_in, inf);
+        nl_cb_set(inf->nl_cb, NL_CB_FINISH, NL_CB_CUSTOM, nl_ack_in, inf);
+        nl_cb_err(inf->nl_cb, NL_CB_CUSTOM, nl_error_in, inf);
 
         if (get_driver_capabilities(inf) < 0) {
             printf("can't get driver capabilities!\n");
@@ -1934,10 +3222,12 @@ add_interface (char *ptr)
         if (!RAND_bytes(&inf->bssid[0], ETH_ALEN)) {
             fprintf(stderr, "unable to make a fake BSSID on %s!\n", inf->ifname);
         }
+        attach_frame_filter(inf);
         srv_add_input(srvctx, inf->fd, inf, bpf_frame_in);
     }
     
     TAILQ_INSERT_TAIL(&interfaces, inf, entry);
+    TAILQ_INSERT_TAIL(&if_by_mac[mac_bucket(inf->bssid, NULL, INTERFACE_BUCKETS)], inf, macentry);
     return;
 }
 
@@ -1949,10 +3239,9 @@ int
 bootstrap_peer (pkex_handle handle, int keyidx, int is_initiator, int mauth)
 {
     struct pkex_instance *instance;
-    FILE *fp;
-    int n, opclass, channel, ret = -1;
-    unsigned char keyb64[1024], peermac[ETH_ALEN];
-    char mac[20], *ptr;
+    struct dpp_instance *dinst;
+    struct bskey *bk;
+    int ret = -1;
 
     if ((instance = find_pkex_instance_by_handle(handle)) == NULL) {
         fprintf(stderr, "cannot find PKEX instance with handle %x\n", handle);
@@ -1969,57 +3258,27 @@ bootstrap_peer (pkex_handle handle, int keyidx, int is_initiator, int mauth)
      * TODO: delete PKEX instance and clean up state inside pkex.c
      */
     printf("looking for bootstrap key index %d\n", keyidx);
-    if ((fp = fopen(bootstrapfile, "r")) == NULL) {
-        goto fin;
-    }
-    while (!feof(fp)) {
-        memset(keyb64, 0, sizeof(keyb64));
-        if (fscanf(fp, "%d %d %d %s %s", &n, &opclass, &channel, mac, keyb64) < 1) {
-            fclose(fp);
-            goto fin;
-        }
-        if (n == keyidx) {
-            break;
-        }
-    }
-    if (feof(fp)) {
+    if ((bk = bskeys_by_index(keyidx)) == NULL) {
         fprintf(stderr, "unable to find bootstrap key with index %d\n", keyidx);
-        fclose(fp);
-        goto fin;
-    }
-    fclose(fp);
-    printf("peer is on operating class %d and channel %d, checking...\n", opclass, channel);
-    printf("peer's bootstrapping key is %s\n", keyb64);
-
-    ptr = &mac[10];
-    sscanf(ptr, "%hhx", &peermac[5]); mac[10] = '\0';
-    ptr = &mac[8];
-    sscanf(ptr, "%hhx", &peermac[4]); mac[8] = '\0';
-    ptr = &mac[6];
-    sscanf(ptr, "%hhx", &peermac[3]); mac[6] = '\0';
-    ptr = &mac[4];
-    sscanf(ptr, "%hhx", &peermac[2]); mac[4] = '\0';
-    ptr = &mac[2];
-    sscanf(ptr, "%hhx", &peermac[1]); mac[2] = '\0';
-    ptr = &mac[0];
-    sscanf(ptr, "%hhx", &peermac[0]); 
-
-    if (change_freq(instance->mymac, chan2freq(channel)) < 0) {
-        fprintf(stderr, "peer's channel and operating class is not supported!\n");
         goto fin;
     }
+    printf("peer is on operating class %d and channel %d, checking...\n", bk->opclass, bk->channel);
+    printf("peer's bootstrapping key is %s\n", bk->b64);
 
-    if (create_dpp_instance(instance->mymac, peermac, keyb64, is_initiator, mauth) == NULL) {
+    if ((dinst = create_dpp_instance(instance->mymac, bk->mac, bk, is_initiator, mauth)) == NULL) {
         fprintf(stderr, "unable to create peer!\n");
     } else {
-        printf("new peer is at " MACSTR "\n", MAC2STR(instance->peermac));
+        /*
+         * talk to this peer on its channel, not necessarily ours
+         */
+        dinst->freq = chan2freq(bk->channel);
+        printf("new peer is at " MACSTR " on %ld\n", MAC2STR(instance->peermac), dinst->freq);
     }
 fin:
     /*
      * clean up this state regardless of whether we successfully bootstrapped
      */
-    TAILQ_REMOVE(&pkex_instances, instance, entry);
-    free(instance);
+    delete_pkex_instance(instance);
     return ret;
 }
 
@@ -2042,12 +3301,13 @@ int
 main (int argc, char **argv)
 {
     int c, debug = 0, is_initiator = 0, config_or_enroll = 0, mutual = 1, do_pkex = 0, do_dpp = 1, keyidx = 0;
-    int chchandpp = 0, chirp = 0, ver, newgroup = 0;
+    int chchandpp = 0, chirp = 0, ver, newgroup = 0, pmksa_lifetime = -1;
+    int chirpmin = 0, chirpmax = 0;
+    char chirphistory[80];
     struct interface *inf;
     char interface[IFNAMSIZ], password[80], keyfile[80], signkeyfile[80], enrollee_role[10], mudurl[80];
-    char *ptr, *endptr, identifier[80], pkexinfo[80], caip[40];
+    char *ptr, *endptr, identifier[80], pkexinfo[80], caip[40], codefile[80];
     unsigned char targetmac[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
-    struct nl_msg *msg;
     
     if ((srvctx = srv_create_context()) == NULL) {
         fprintf(stderr, "%s: cannot create service context!\n", argv[0]);
@@ -2055,18 +3315,31 @@ main (int argc, char **argv)
     }
     TAILQ_INIT(&interfaces);
     TAILQ_INIT(&dpp_instances);
+    TAILQ_INIT(&pkex_instances);
+    for (c = 0; c < INSTANCE_BUCKETS; c++) {
+        TAILQ_INIT(&dpp_by_mac[c]);
+        TAILQ_INIT(&dpp_by_handle[c]);
+        TAILQ_INIT(&pkex_by_mac[c]);
+        TAILQ_INIT(&pkex_by_handle[c]);
+    }
+    for (c = 0; c < INTERFACE_BUCKETS; c++) {
+        TAILQ_INIT(&if_by_mac[c]);
+    }
     ver = DPP_VERSION;
     
     memset(bootstrapfile, 0, 80);
     memset(signkeyfile, 0, 80);
     memset(mudurl, 0, 80);
     memset(identifier, 0, 80);
+    memset(password, 0, 80);
+    memset(codefile, 0, 80);
     memset(pkexinfo, 0, 80);
     memset(caip, 0, 40);
+    memset(chirphistory, 0, sizeof(chirphistory));
     for (;;) {
-        c = getopt(argc, argv, "hirm:k:I:B:x:b:yase:c:d:p:n:z:qf:g:u:tw:v:");
+        c = getopt(argc, argv, "hirm:k:I:B:x:b:yase:c:d:p:n:o:z:qf:g:u:tw:v:l:H:T:R");
         /*
-         * left: l, o
+         * left: none
          */
         if (c < 0) {
             break;
@@ -2094,6 +3367,10 @@ main (int argc, char **argv)
             case 'n':           /* pkex identifier */
                 strcpy(identifier, optarg);
                 break;
+            case 'o':           /* file of pkex identifiers and codes */
+                strcpy(codefile, optarg);
+                do_pkex = 1;
+                break;
             case 'w':
                 strcpy(caip, optarg);
                 break;
@@ -2167,10 +3444,25 @@ main (int argc, char **argv)
             case 'q':
                 quit_at_fin = 1;
                 break;
+            case 'l':
+                pmksa_lifetime = atoi(optarg);
+                break;
+            case 'H':           /* chirp history */
+                strcpy(chirphistory, optarg);
+                break;
+            case 'R':           /* PACKET_MMAP rings on loopback */
+                use_ring = 1;
+                break;
+            case 'T':           /* chirp backoff */
+                if (sscanf(optarg, "%d,%d", &chirpmin, &chirpmax) < 1) {
+                    fprintf(stderr, "%s: chirp backoff is <min>,<max> seconds\n", argv[0]);
+                    exit(1);
+                }
+                break;
             default:
             case 'h':
                 fprintf(stderr, 
-                        "USAGE: %s [-hIBapkceirdfgst]\n"
+                        "USAGE: %s [-hIBapkceirdfgstloHTR]\n"
                         "\t-h  show usage, and exit\n"
                         "\t-c <signkey> run DPP as the configurator, sign connectors with <signkey>\n"
                         "\t-e <role> run DPP as the enrollee in the role of <role> (sta or ap)\n"
@@ -2184,6 +3476,7 @@ main (int argc, char **argv)
                         "\t-g <opclass> operating class to use with DPP\n"
                         "\t-z <info> to pass along with public key in PKEX\n"
                         "\t-n <identifier> for the code used in PKEX\n"
+                        "\t-o <filename> of PKEX identifiers and codes, reread when changed\n"
                         "\t-b <curve> Configurator asks for a new protocol key\n"
                         "\t-k <filename> my bootstrapping key\n"
                         "\t-y  bootstrapping (PKEX) only, don't run DPP\n"
@@ -2192,8 +3485,12 @@ main (int argc, char **argv)
                         "\t-s  change opclass/channel to what was set with -f and -g during DPP\n"
                         "\t-u <url> to find a MUD file (enrollee only)\n"
                         "\t-t  send DPP chirps (responder only)\n"
+                        "\t-H <filename> remember where configurators answered chirps\n"
+                        "\t-T <min>,<max> seconds to back off between rounds of chirps\n"
+                        "\t-R  read and write loopback frames through memory mapped rings\n"
                         "\t-q  terminate the process upon completion (enrollee only)\n"
                         "\t-w <ipaddr> IP address of CA (for enterprise-only Configurators)\n"
+                        "\t-l <seconds> lifetime of PMKSAs from DPP Discovery (0 to not cache)\n"
                         "\t-j  enable mdns (client queries, configurator publishes)\n"
                         "\t-d <debug> set debugging mask\n",
                         argv[0], IFNAMSIZ);
@@ -2209,6 +3506,9 @@ main (int argc, char **argv)
         fprintf(stderr, "%s: specify a peer bootstrapping key file with -B <filename>\n", argv[0]);
         exit(1);
     }
+    if (bootstrapfile[0] != 0) {
+        bskeys_load(bootstrapfile, srvctx);
+    }
     if (is_initiator && !do_pkex && (keyidx == 0)) {
         fprintf(stderr, "%s: either do PKEX or specify an index into bootstrapping file with -x\n",
                 argv[0]);
@@ -2218,6 +3518,13 @@ main (int argc, char **argv)
         fprintf(stderr, "%s: no interfaces defined!\n", argv[0]);
         add_interface("lo");
     }
+    if (use_ring) {
+        TAILQ_FOREACH(inf, &interfaces, entry) {
+            if (inf->is_loopback && (setup_packet_ring(inf) < 0)) {
+                fprintf(stderr, "%s: can't map rings on %s, using recvfrom()\n", argv[0], inf->ifname);
+            }
+        }
+    }
     if (is_initiator) {
         printf("initiating to " MACSTR "\n", MAC2STR(targetmac));
     }
@@ -2233,6 +3540,10 @@ main (int argc, char **argv)
             fprintf(stderr, "%s: cannot configure PKEX/DPP, check config file!\n", argv[0]);
             exit(1);
         }
+        if ((codefile[0] != 0) && (pkex_load_codes(codefile) < 0)) {
+            fprintf(stderr, "%s: cannot load PKEX codes from %s\n", argv[0], codefile);
+            exit(1);
+        }
     }
     if (do_dpp) {
         if (dpp_initialize(config_or_enroll, keyfile,
@@ -2242,6 +3553,13 @@ main (int argc, char **argv)
             fprintf(stderr, "%s: cannot configure DPP, check config file!\n", argv[0]);
             exit(1);
         }
+        if (pmksa_lifetime >= 0) {
+            dpp_set_pmksa_lifetime(pmksa_lifetime);
+        }
+        if (chirp) {
+            dpp_set_chirp_schedule(chirphistory[0] == 0 ? NULL : chirphistory,
+                                   chirpmin, chirpmax);
+        }
     }
     
     /*
@@ -2261,12 +3579,7 @@ main (int argc, char **argv)
                  * then add all the APs that are beaconing out a DPP ConfigConn IE
                  */
                 printf("chirping, so scan for APs\n");
-                if (trigger_scan(inf, NULL) == 0) {
-                    msg = get_nl_msg(inf, NLM_F_DUMP, NL80211_CMD_GET_SCAN);
-                    if (send_nl_msg(msg, inf, callback_dump, inf)) {
-                        printf("can't get scan info from kernel!\n");
-                    }
-                } else {
+                if (trigger_scan(inf, NULL, 0, chirp_scanned) < 0) {
                     printf("can't scan to find chirping channel :-(\n");
                 }
             }
@@ -2315,6 +3628,12 @@ main (int argc, char **argv)
              * otherwise create a DPP peer and wait.
              */
             if (!do_pkex) {
+                if (inf->scan_done == chirp_scanned) {
+                    chirp_waiting = 1;
+                    memcpy(chirp_peer, targetmac, ETH_ALEN);
+                    chirp_mauth = mutual;
+                    continue;
+                }
                 create_dpp_instance(inf->bssid, targetmac, NULL, is_initiator, mutual);
             }
         }
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/types.h>
@@ -45,6 +46,7 @@
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <sys/queue.h>
 #include <net/if.h>
 #include <openssl/bn.h>
@@ -60,6 +62,7 @@
 #include "tlv.h"
 #include "hkdf.h"
 #include "os_glue.h"
+#include "utils.h"
 
 /*
  * PKEX debugging bitmasks
@@ -78,6 +81,8 @@
 #define STATUS_OK               0
 #define ERROR_BAD_GROUP         4
 
+#define P521_COORD_LEN          66      /* the biggest prime we support */
+
 typedef dpp_action_frame pkex_frame;
 
 static pkex_handle next_handle = 0;
@@ -114,8 +119,26 @@ struct pkex_peer {
 #define PKEX_SEND_COMREV        3
 #define PKEX_FINISHED           4
     unsigned short state;
+    unsigned long poolgets;     /* scratch point counts when we started */
+    unsigned long poolallocs;
     unsigned char peernonce[SHA512_DIGEST_LENGTH];
     unsigned char mynonce[SHA512_DIGEST_LENGTH];
+    /*
+     * the code this peer is using, the default unless the peer
+     * asked for one in the code table
+     */
+    char password[80];
+    char identifier[80];
+    int adds_identifier;
+    /*
+     * the Exchange frame we sent and, for a responder, a digest of the
+     * request it answered so retransmissions don't redo the crypto
+     */
+    unsigned char exchframe[1024];
+    int exchlen;
+    unsigned char exchversion;
+    unsigned char exchstatus;
+    unsigned char reqdigest[SHA256_DIGEST_LENGTH];
 };
 
 #define state_to_string(x) (x) == PKEX_NOTHING ? "PKEX NOTHING" : \
@@ -147,6 +170,7 @@ struct _pkex_instance {
     int group_num;              /* these are handy to keep around */
     int primelen;               /* and not have to continually */
     int digestlen;              /* compute them from "bootstrap" */
+    int sivmode;                /* SIV key size that goes with digestlen */
     int nid;                    /* ditto */
 } pkex_instance;
 
@@ -154,6 +178,8 @@ struct _pkex_instance {
  * global variables
  */
 static BN_CTX *bnctx = NULL;
+static struct point_pool *ppool = NULL;
+static EC_GROUP *pkexgroup = NULL;      /* with precomputed generator multiples */
 static int debug = 0;
 static int init_or_resp;
 
@@ -709,13 +735,407 @@ send_pkex_frame (pkex_handle handle, unsigned char *buf, int len)
     return transmit_pkex_frame(handle, buf, len);
 }
 
+//----------------------------------------------------------------------
+// cache of the password-derived points
+//----------------------------------------------------------------------
+
+/*
+ * Qi and Qr are H([MAC |] [identifier |] password) * P for one of the
+ * fixed elements. They only depend on the code and the MAC address (for
+ * v1) so remember them, keyed by that hash, instead of doing a scalar
+ * multiplication for every exchange and retransmission. The cache is
+ * flushed whenever a code goes away or changes.
+ */
+#define QCACHE_SIZE     64
+
+struct qcache {
+    unsigned char hash[SHA512_DIGEST_LENGTH];
+    int mine;                   /* Q on Pme (mine) or Ppeer */
+    EC_POINT *Q;
+};
+static struct qcache qcache[QCACHE_SIZE];
+
+static void
+flush_qcache (void)
+{
+    int i;
+
+    for (i = 0; i < QCACHE_SIZE; i++) {
+        if (qcache[i].Q != NULL) {
+            EC_POINT_free(qcache[i].Q);
+        }
+    }
+    memset(qcache, 0, sizeof(qcache));
+}
+
+/*
+ * return Q for the hash of the code, the cache owns it so don't free it!
+ */
+static const EC_POINT *
+get_q (unsigned char *hash, int hashlen, int mine)
+{
+    struct qcache *qc;
+    BIGNUM *hmul = NULL, *order = NULL;
+    EC_POINT *Q = NULL;
+    const EC_POINT *ret = NULL;
+
+    qc = &qcache[(((hash[0] << 8) | hash[1]) ^ mine) % QCACHE_SIZE];
+    if ((qc->Q != NULL) && (qc->mine == mine) && (memcmp(qc->hash, hash, hashlen) == 0)) {
+        return qc->Q;
+    }
+    if (((hmul = BN_new()) == NULL) || ((order = BN_new()) == NULL) ||
+        ((Q = EC_POINT_new(pkex_instance.group)) == NULL)) {
+        goto fin;
+    }
+    if (!EC_GROUP_get_order(pkex_instance.group, order, bnctx)) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to obtain order from the group! Order! Order!!\n");
+        goto fin;
+    }
+    BN_bin2bn(hash, hashlen, hmul);
+    BN_mod(hmul, hmul, order, bnctx);
+    pp_a_bignum(DPP_DEBUG_TRACE, "H([mac |] [identifier | ] password)", hmul);
+    if (!EC_POINT_mul(pkex_instance.group, Q, NULL,
+                      mine ? pkex_instance.Pme : pkex_instance.Ppeer, hmul, bnctx)) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to create Q for PKEX!\n");
+        goto fin;
+    }
+    if (qc->Q != NULL) {
+        EC_POINT_free(qc->Q);
+    }
+    memset(qc->hash, 0, sizeof(qc->hash));
+    memcpy(qc->hash, hash, hashlen);
+    qc->mine = mine;
+    qc->Q = Q;
+    ret = Q;
+    Q = NULL;
+fin:
+    if (hmul != NULL) {
+        BN_free(hmul);
+    }
+    if (order != NULL) {
+        BN_free(order);
+    }
+    if (Q != NULL) {
+        EC_POINT_free(Q);
+    }
+    return ret;
+}
+
+//----------------------------------------------------------------------
+// the PKEX code table
+//----------------------------------------------------------------------
+
+/*
+ * codes beyond the one given to pkex_initialize(), hashed on the code
+ * identifier so an Exchange Request can find its code right away. Codes
+ * can expire and can be good for only one run of PKEX, after which they
+ * are spent (but remembered so a reload of the code file doesn't bring
+ * them back).
+ */
+#define PKEX_CODE_BUCKETS       64
+#define PKEX_CODE_CHECK         5       /* seconds between looks at the code file */
+
+struct pkex_code {
+    TAILQ_ENTRY(pkex_code) entry;
+    char identifier[80];
+    char password[80];
+    time_t expires;             /* 0 means never */
+    int onetime;
+    int spent;
+    int fromfile;
+    int stale;                  /* used when reloading the code file */
+    pkex_handle owner;          /* peer holding a one-time code */
+};
+TAILQ_HEAD(codelist, pkex_code);
+
+static struct codelist pkex_codes[PKEX_CODE_BUCKETS];
+static int pkex_codes_init = 0;
+static char codefile[256];
+static time_t codefile_mtime = 0;
+
+static void
+init_pkex_codes (void)
+{
+    int i;
+
+    if (pkex_codes_init) {
+        return;
+    }
+    for (i = 0; i < PKEX_CODE_BUCKETS; i++) {
+        TAILQ_INIT(&pkex_codes[i]);
+    }
+    pkex_codes_init = 1;
+}
+
+static struct codelist *
+code_bucket (char *identifier, int len)
+{
+    unsigned int h = 5381;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        h = ((h << 5) + h) + (unsigned char)identifier[i];
+    }
+    return &pkex_codes[h % PKEX_CODE_BUCKETS];
+}
+
+static struct pkex_code *
+find_pkex_code (char *identifier, int len)
+{
+    struct pkex_code *code;
+
+    if (!pkex_codes_init) {
+        return NULL;
+    }
+    TAILQ_FOREACH(code, code_bucket(identifier, len), entry) {
+        if ((strlen(code->identifier) == len) &&
+            (memcmp(code->identifier, identifier, len) == 0)) {
+            return code;
+        }
+    }
+    return NULL;
+}
+
+static int
+set_pkex_code (char *identifier, char *password, int lifetime, int onetime, int fromfile)
+{
+    struct pkex_code *code;
+    int len;
+
+    if (((len = strlen(identifier)) == 0) || (len > 79) ||
+        (strlen(password) == 0) || (strlen(password) > 79)) {
+        dpp_debug(DPP_DEBUG_ERR, "bad PKEX code for '%s'\n", identifier);
+        return -1;
+    }
+    init_pkex_codes();
+    if ((code = find_pkex_code(identifier, len)) != NULL) {
+        code->stale = 0;
+        /*
+         * restating a code that hasn't changed leaves its state alone,
+         * a spent one-time code stays spent
+         */
+        if (fromfile && code->fromfile && (strcmp(code->password, password) == 0) &&
+            (code->onetime == onetime)) {
+            return 0;
+        }
+    } else {
+        if ((code = (struct pkex_code *)malloc(sizeof(struct pkex_code))) == NULL) {
+            return -1;
+        }
+        memset(code, 0, sizeof(struct pkex_code));
+        strcpy(code->identifier, identifier);
+        TAILQ_INSERT_HEAD(code_bucket(identifier, len), code, entry);
+    }
+    if (code->password[0] != 0) {
+        flush_qcache();
+    }
+    strcpy(code->password, password);
+    code->expires = lifetime > 0 ? time(NULL) + lifetime : 0;
+    code->onetime = onetime;
+    code->spent = 0;
+    code->owner = 0;
+    code->fromfile = fromfile;
+    dpp_debug(DPP_DEBUG_TRACE, "adding PKEX code for '%s'%s\n", identifier,
+              onetime ? " (one time)" : "");
+    return 1;
+}
+
+int
+pkex_add_code (char *identifier, char *password, int lifetime, int onetime)
+{
+    return set_pkex_code(identifier, password, lifetime, onetime, 0);
+}
+
+int
+pkex_remove_code (char *identifier)
+{
+    struct pkex_code *code;
+    int len = strlen(identifier);
+
+    if ((code = find_pkex_code(identifier, len)) == NULL) {
+        return -1;
+    }
+    TAILQ_REMOVE(code_bucket(identifier, len), code, entry);
+    free(code);
+    flush_qcache();
+    return 1;
+}
+
+/*
+ * read a code file, each line is:
+ *
+ *     <identifier> <password> [<lifetime in seconds> [once]]
+ *
+ * codes that were read from the file before but aren't there anymore
+ * are removed
+ */
+static int
+read_pkex_codes (char *file)
+{
+    FILE *fp;
+    struct pkex_code *code, *next;
+    char line[256], id[80], pw[80], once[10];
+    int i, lifetime, count = 0;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to open PKEX code file %s\n", file);
+        return -1;
+    }
+    init_pkex_codes();
+    for (i = 0; i < PKEX_CODE_BUCKETS; i++) {
+        TAILQ_FOREACH(code, &pkex_codes[i], entry) {
+            if (code->fromfile) {
+                code->stale = 1;
+            }
+        }
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#') {
+            continue;
+        }
+        lifetime = 0;
+        once[0] = 0;
+        if ((sscanf(line, "%79s %79s %d %9s", id, pw, &lifetime, once)) < 2) {
+            continue;
+        }
+        if (set_pkex_code(id, pw, lifetime, strcmp(once, "once") == 0, 1) >= 0) {
+            count++;
+        }
+    }
+    fclose(fp);
+
+    for (i = 0; i < PKEX_CODE_BUCKETS; i++) {
+        for (code = TAILQ_FIRST(&pkex_codes[i]); code != NULL; code = next) {
+            next = TAILQ_NEXT(code, entry);
+            if (code->stale) {
+                TAILQ_REMOVE(&pkex_codes[i], code, entry);
+                free(code);
+                flush_qcache();
+            }
+        }
+    }
+    dpp_debug(DPP_DEBUG_TRACE, "%d PKEX codes in %s\n", count, file);
+    return count;
+}
+
+static void
+check_pkex_codes (timerid id, void *data)
+{
+    struct stat st;
+
+    if ((stat(codefile, &st) == 0) && (st.st_mtime != codefile_mtime)) {
+        codefile_mtime = st.st_mtime;
+        (void)read_pkex_codes(codefile);
+    }
+    srv_add_timeout(srvctx, SRV_SEC(PKEX_CODE_CHECK), check_pkex_codes, NULL);
+}
+
+/*
+ * load a code file and keep an eye on it, when it changes it's read again
+ */
+int
+pkex_load_codes (char *file)
+{
+    struct stat st;
+    int ret, rearm;
+
+    if (strlen(file) >= sizeof(codefile)) {
+        return -1;
+    }
+    rearm = (codefile[0] == 0);
+    strcpy(codefile, file);
+    if (stat(codefile, &st) == 0) {
+        codefile_mtime = st.st_mtime;
+    }
+    if ((ret = read_pkex_codes(codefile)) < 0) {
+        return ret;
+    }
+    if (rearm) {
+        srv_add_timeout(srvctx, SRV_SEC(PKEX_CODE_CHECK), check_pkex_codes, NULL);
+    }
+    return ret;
+}
+
+/*
+ * a responder got a code identifier, find the code it refers to and
+ * have the peer use it
+ */
+static int
+select_pkex_code (struct pkex_peer *peer, char *identifier, int len)
+{
+    struct pkex_code *code;
+
+    if ((code = find_pkex_code(identifier, len)) != NULL) {
+        if (code->spent || (code->expires && (code->expires < time(NULL)))) {
+            dpp_debug(DPP_DEBUG_ERR, "PKEX code for '%s' is no longer valid\n", code->identifier);
+            return -1;
+        }
+        if (code->onetime) {
+            if (code->owner && (code->owner != peer->handle)) {
+                dpp_debug(DPP_DEBUG_ERR, "PKEX code for '%s' is being used by another peer\n",
+                          code->identifier);
+                return -1;
+            }
+            code->owner = peer->handle;
+        }
+        strcpy(peer->identifier, code->identifier);
+        strcpy(peer->password, code->password);
+        peer->adds_identifier = 1;
+        return 1;
+    }
+    /*
+     * otherwise it has to be the default code
+     */
+    if (pkex_instance.adds_identifier && (strlen(pkex_instance.identifier) == len) &&
+        (memcmp(pkex_instance.identifier, identifier, len) == 0)) {
+        strcpy(peer->identifier, pkex_instance.identifier);
+        strcpy(peer->password, pkex_instance.password);
+        peer->adds_identifier = 1;
+        return 1;
+    }
+    return -1;
+}
+
+/*
+ * the peer has tried its code, if it was a one-time code then it's spent
+ * whether it worked or not; if it didn't try then let someone else have it
+ */
+static void
+release_pkex_code (struct pkex_peer *peer, int used)
+{
+    struct pkex_code *code;
+
+    if (!peer->adds_identifier ||
+        ((code = find_pkex_code(peer->identifier, strlen(peer->identifier))) == NULL) ||
+        (code->owner != peer->handle)) {
+        return;
+    }
+    if (used) {
+        dpp_debug(DPP_DEBUG_TRACE, "one-time PKEX code for '%s' is spent\n", code->identifier);
+        code->spent = 1;
+    }
+    code->owner = 0;
+}
+
+static EC_KEY *
+new_pkex_key (void)
+{
+    if (pkexgroup != NULL) {
+        return new_key_on_group(pkexgroup);
+    }
+    return EC_KEY_new_by_curve_name(pkex_instance.nid);
+}
+
 static int
 find_fixed_elements (int is_initiator)
 {
-    BIGNUM *xme = NULL, *yme = NULL, *xpeer = NULL, *ypeer = NULL;
+    BIGNUM *xme, *yme, *xpeer, *ypeer;
     
-    if (((xme = BN_new()) == NULL) || ((yme = BN_new()) == NULL) ||
-        ((xpeer = BN_new()) == NULL) || ((ypeer = BN_new()) == NULL)) {
+    BN_CTX_start(bnctx);
+    xme = BN_CTX_get(bnctx);
+    yme = BN_CTX_get(bnctx);
+    xpeer = BN_CTX_get(bnctx);
+    if ((ypeer = BN_CTX_get(bnctx)) == NULL) {
         goto fin;
     }
 
@@ -806,47 +1226,23 @@ find_fixed_elements (int is_initiator)
                 break;
         }
     }
-    if ((pkex_instance.Pme = EC_POINT_new(pkex_instance.group)) == NULL) {
-        goto fin;
-    }
-    if (!EC_POINT_set_affine_coordinates_GFp(pkex_instance.group,
-                                             pkex_instance.Pme, xme, yme, bnctx)) {
-        EC_POINT_free(pkex_instance.Pme);
-        goto fin;
-    }
-    if (!EC_POINT_is_on_curve(pkex_instance.group, pkex_instance.Pme, bnctx)) {
-        EC_POINT_free(pkex_instance.Pme);
-        goto fin;
-    }
-        
-    if ((pkex_instance.Ppeer = EC_POINT_new(pkex_instance.group)) == NULL) {
-        EC_POINT_free(pkex_instance.Pme);
-        goto fin;
-    }
-    if (!EC_POINT_set_affine_coordinates_GFp(pkex_instance.group,
-                                             pkex_instance.Ppeer, xpeer, ypeer, bnctx)) {
-        EC_POINT_free(pkex_instance.Pme);
-        EC_POINT_free(pkex_instance.Ppeer);
-        goto fin;
-    }
-    if (!EC_POINT_is_on_curve(pkex_instance.group, pkex_instance.Ppeer, bnctx)) {
+    /*
+     * these live as long as we do so they're allocated, not scratch
+     */
+    if (((pkex_instance.Pme = EC_POINT_new(pkex_instance.group)) == NULL) ||
+        !EC_POINT_set_affine_coordinates_GFp(pkex_instance.group,
+                                             pkex_instance.Pme, xme, yme, bnctx) ||
+        !EC_POINT_is_on_curve(pkex_instance.group, pkex_instance.Pme, bnctx) ||
+        ((pkex_instance.Ppeer = EC_POINT_new(pkex_instance.group)) == NULL) ||
+        !EC_POINT_set_affine_coordinates_GFp(pkex_instance.group,
+                                             pkex_instance.Ppeer, xpeer, ypeer, bnctx) ||
+        !EC_POINT_is_on_curve(pkex_instance.group, pkex_instance.Ppeer, bnctx)) {
         EC_POINT_free(pkex_instance.Pme);
         EC_POINT_free(pkex_instance.Ppeer);
-        goto fin;
+        pkex_instance.Pme = pkex_instance.Ppeer = NULL;
     }
 fin:
-    if (xme != NULL) {
-        BN_free(xme);
-    }
-    if (yme != NULL) {
-        BN_free(yme);
-    }
-    if (xpeer != NULL) {
-        BN_free(xpeer);
-    }
-    if (ypeer != NULL) {
-        BN_free(ypeer);
-    }
+    BN_CTX_end(bnctx);
     
     return ((pkex_instance.Pme != NULL) && (pkex_instance.Ppeer != NULL));
 }
@@ -855,13 +1251,16 @@ static int
 compute_z (struct pkex_peer *peer)
 {
     int ret = -1, offset;
-    unsigned char *ptr, *context = NULL, *ikm = NULL;
-    BIGNUM *x = NULL, *y = NULL;
-    EC_POINT *Z = NULL;
+    unsigned char *ptr, ikm[P521_COORD_LEN];
+    unsigned char context[2 * P521_COORD_LEN + 2 * ETH_ALEN + sizeof(peer->password)];
+    BIGNUM *x;
+    EC_POINT *Z;
     const BIGNUM *ephem = NULL;
 
-    if (((Z = EC_POINT_new(pkex_instance.group)) == NULL) ||
-        ((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
+    BN_CTX_start(bnctx);
+    point_pool_start(ppool);
+    if (((Z = point_pool_get(ppool)) == NULL) ||
+        ((x = BN_CTX_get(bnctx)) == NULL) ||
         ((ephem = EC_KEY_get0_private_key(peer->X)) == NULL) ||
         !EC_POINT_mul(pkex_instance.group, Z, NULL, peer->Y, ephem, bnctx) ||
         !EC_POINT_get_affine_coordinates_GFp(pkex_instance.group, Z, x, NULL, bnctx)) {
@@ -870,13 +1269,6 @@ compute_z (struct pkex_peer *peer)
     }
     pp_a_bignum(DPP_DEBUG_TRACE, peer->initiator ? "x" : "y", (BIGNUM *)ephem);
     pp_a_point(DPP_DEBUG_TRACE, 1, peer->initiator ? "Y.x" : "X.x", peer->Y);
-    
-    if (((context = (unsigned char *)malloc(2 * pkex_instance.primelen + 2 * ETH_ALEN +
-                                            strlen(pkex_instance.password))) == NULL) ||
-        ((ikm = (unsigned char *)malloc(pkex_instance.primelen)) == NULL)) {
-        dpp_debug(DPP_DEBUG_ERR, "unable to allocate context for HKDF!\n");
-        goto fin;
-    }
 
     /*
      * the input key to the kdf is Z.x where Z = x*Y
@@ -886,7 +1278,7 @@ compute_z (struct pkex_peer *peer)
     BN_bn2bin(x, ikm + offset);
     pp_a_bignum(DPP_DEBUG_TRACE, peer->initiator ? "Z.x = (x*Y).x" : "Z.x = (y*X).x", x);
 
-    memset(context, 0, 2 * pkex_instance.primelen + 2 * ETH_ALEN + strlen(pkex_instance.password));
+    memset(context, 0, 2 * pkex_instance.primelen + 2 * ETH_ALEN + strlen(peer->password));
     ptr = context;
     /*
      * the context is the initiator mac address followed by the responder mac address...
@@ -958,39 +1350,28 @@ compute_z (struct pkex_peer *peer)
     /*
      * ...concatenated with the password
      */
-    memcpy(ptr, pkex_instance.password, strnlen(pkex_instance.password, 80));
-    print_buffer(DPP_DEBUG_TRACE, "password", (unsigned char *)pkex_instance.password, strlen(pkex_instance.password));
+    memcpy(ptr, peer->password, strnlen(peer->password, 80));
+    print_buffer(DPP_DEBUG_TRACE, "password", (unsigned char *)peer->password, strlen(peer->password));
 
     if (peer->version == 1) {
         hkdf(pkex_instance.hashfcn, 0, ikm, pkex_instance.primelen,
              NULL, 0,
-             context, (2 * pkex_instance.primelen + 2 * ETH_ALEN + strlen(pkex_instance.password)),
+             context, (2 * pkex_instance.primelen + 2 * ETH_ALEN + strlen(peer->password)),
              peer->z, pkex_instance.digestlen);
     } else {
         hkdf(pkex_instance.hashfcn, 0, ikm, pkex_instance.primelen,
              NULL, 0,
-             context, (2 * pkex_instance.primelen + 2 * sizeof(unsigned char) + strlen(pkex_instance.password)),
+             context, (2 * pkex_instance.primelen + 2 * sizeof(unsigned char) + strlen(peer->password)),
              peer->z, pkex_instance.digestlen);
     }
     ret = 1;
     print_buffer(DPP_DEBUG_TRACE, "z", peer->z, pkex_instance.digestlen);
     
 fin:
-    if (context != NULL) {
-        free(context);
-    }
-    if (ikm != NULL) {
-        free(ikm);
-    }
-    if (x != NULL) {
-        BN_free(x);
-    }
-    if (y != NULL) {
-        BN_free(y);
-    }
-    if (Z != NULL) {
-        EC_POINT_free(Z);
-    }
+    OPENSSL_cleanse(ikm, sizeof(ikm));
+    OPENSSL_cleanse(context, sizeof(context));
+    point_pool_end(ppool);
+    BN_CTX_end(bnctx);
     return ret;
 }
 
@@ -1001,7 +1382,7 @@ fin:
 int
 pkex_reveal_to_peer (struct pkex_peer *peer) 
 {
-    unsigned char buf[1024], *ptr, *keyx = NULL, *ikm = NULL, direction;
+    unsigned char buf[1024], *ptr, keyx[P521_COORD_LEN], ikm[P521_COORD_LEN], direction;
     pkex_frame *frame;
     int ret = -1, offset, datalen = 0;
     unsigned int mdlen = pkex_instance.digestlen;
@@ -1019,17 +1400,12 @@ pkex_reveal_to_peer (struct pkex_peer *peer)
 
     if (((s = BN_new()) == NULL) || ((S = EC_POINT_new(pkex_instance.group)) == NULL) ||
         ((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
-        ((hctx = HMAC_CTX_new()) == NULL) ||
+        ((hctx = scratch_hmac_ctx()) == NULL) ||
         ((Pub = EC_KEY_get0_public_key(pkex_instance.bootstrap)) == NULL) ||
         ((priv = EC_KEY_get0_private_key(pkex_instance.bootstrap)) == NULL)) {
         dpp_debug(DPP_DEBUG_ERR, "unable to get private key from bootstrapped key\n");
         goto fin;
     }
-    if (((ikm = (unsigned char *)malloc(pkex_instance.primelen)) == NULL) ||
-        ((keyx = (unsigned char *)malloc(pkex_instance.primelen)) == NULL)) {
-        dpp_debug(DPP_DEBUG_ERR, "unable to malloc context to create confirm\n");
-        goto fin;
-    }
     /*
      * S = x * Y
      */
@@ -1143,20 +1519,7 @@ pkex_reveal_to_peer (struct pkex_peer *peer)
     print_buffer(DPP_DEBUG_TRACE, peer->initiator ? "u" : "v", tlv->value, mdlen);
     ptr = tlv->value + mdlen;
     
-    switch (pkex_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->z, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->z, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->z, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", pkex_instance.digestlen);
-            goto fin;
-    }
+    siv_init(&ctx, peer->z, pkex_instance.sivmode);
     datalen = (int)(ptr - (frame->attributes + sizeof(TLV) + AES_BLOCK_SIZE));
     tlv = (TLV *)frame->attributes;
     ptr = TLV_value(tlv);
@@ -1175,12 +1538,8 @@ pkex_reveal_to_peer (struct pkex_peer *peer)
     peer->state = PKEX_SEND_COMREV;
     ret = sizeof(pkex_frame) + datalen + AES_BLOCK_SIZE;
 fin:
-    if (keyx != NULL) {
-        free(keyx);
-    }
-    if (ikm != NULL) {
-        free(ikm);
-    }
+    OPENSSL_cleanse(keyx, sizeof(keyx));
+    OPENSSL_cleanse(ikm, sizeof(ikm));
     if (s != NULL) {
         BN_free(s);
     }
@@ -1193,9 +1552,6 @@ fin:
     if (S != NULL) {
         EC_POINT_free(S);
     }
-    if (hctx != NULL) {
-        HMAC_CTX_free(hctx);
-    }
     return ret;
 }
 
@@ -1206,13 +1562,24 @@ pkex_exchange_to_peer (struct pkex_peer *peer, unsigned char status)
     unsigned int mdlen = pkex_instance.digestlen;
     pkex_frame *frame = (pkex_frame *)buf;
     unsigned short grp;
-    BIGNUM *x = NULL, *y = NULL, *hmul = NULL, *order = NULL;
+    BIGNUM *x = NULL, *y = NULL;
     TLV *tlv;
     EC_POINT *Q = NULL;
-    const EC_POINT *Xpt;
+    const EC_POINT *Xpt, *Qpw;
     EVP_MD_CTX *mdctx = NULL;
     int offset, framelen, ret = -1;
 
+    /*
+     * a retransmission of what we already sent, nothing has changed
+     * so just send it again
+     */
+    if ((peer->exchlen > 0) && (peer->exchversion == peer->version) && (peer->exchstatus == status)) {
+        dpp_debug(DPP_DEBUG_PROTOCOL_MSG,
+                  peer->initiator ? "resending PKEX Exchange Request\n" : "resending PKEX Exchange Response\n");
+        send_pkex_frame(peer->handle, peer->exchframe, peer->exchlen);
+        peer->state = PKEX_SEND_EXCHANGE;
+        return 1;
+    }
     memset(buf, 0, sizeof(buf));
     if (peer->initiator) {
         construct_pkex_frame(frame, peer, peer->version == 1 ? PKEX_SUB_EXCH_V1REQ : PKEX_SUB_EXCH_REQ);
@@ -1226,10 +1593,13 @@ pkex_exchange_to_peer (struct pkex_peer *peer, unsigned char status)
         goto fin;
     }
 
+    if ((peer->m == NULL) && ((peer->m = BN_new()) == NULL)) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to create key for PKEX\n");
+        goto fin;
+    }
     if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
-        ((order = BN_new()) == NULL) || ((hmul = BN_new()) == NULL) ||
-        ((mdctx = EVP_MD_CTX_new()) == NULL) ||
-        ((peer->m = BN_new()) == NULL) || ((Q = EC_POINT_new(pkex_instance.group)) == NULL)) {
+        ((mdctx = scratch_md_ctx()) == NULL) ||
+        ((Q = EC_POINT_new(pkex_instance.group)) == NULL)) {
         dpp_debug(DPP_DEBUG_ERR, "unable to create key for PKEX\n");
         goto fin;
     }
@@ -1237,17 +1607,13 @@ pkex_exchange_to_peer (struct pkex_peer *peer, unsigned char status)
      * if we're retransmitting we don't want to generate a new one
      */
     if (peer->X == NULL) {
-        if (((peer->X = EC_KEY_new_by_curve_name(pkex_instance.nid)) == NULL) ||
+        if (((peer->X = new_pkex_key()) == NULL) ||
             !EC_KEY_generate_key(peer->X)) {
             dpp_debug(DPP_DEBUG_ERR, "unable to generate key for PKEX!\n");
             goto fin;
         }
     }
 
-    if (!EC_GROUP_get_order(pkex_instance.group, order, bnctx)) {
-        dpp_debug(DPP_DEBUG_ERR, "unable to obtain order from the group! Order! Order!!\n");
-        goto fin;
-    }
     /*
      * Q = H(me | [identifier |] pw) * P
      */
@@ -1256,21 +1622,18 @@ pkex_exchange_to_peer (struct pkex_peer *peer, unsigned char status)
         print_buffer(DPP_DEBUG_TRACE, "adding mymac", peer->mymac, ETH_ALEN);
         EVP_DigestUpdate(mdctx, peer->mymac, ETH_ALEN);
     }
-    if (pkex_instance.adds_identifier) {
-        print_buffer(DPP_DEBUG_TRACE, "identifier", (unsigned char *)pkex_instance.identifier,
-                     strlen(pkex_instance.identifier));
-        EVP_DigestUpdate(mdctx, pkex_instance.identifier, strlen(pkex_instance.identifier));
+    if (peer->adds_identifier) {
+        print_buffer(DPP_DEBUG_TRACE, "identifier", (unsigned char *)peer->identifier,
+                     strlen(peer->identifier));
+        EVP_DigestUpdate(mdctx, peer->identifier, strlen(peer->identifier));
     }
-    print_buffer(DPP_DEBUG_TRACE, "password", (unsigned char *)pkex_instance.password, strlen(pkex_instance.password));
-    EVP_DigestUpdate(mdctx, pkex_instance.password, strlen(pkex_instance.password));
+    print_buffer(DPP_DEBUG_TRACE, "password", (unsigned char *)peer->password, strlen(peer->password));
+    EVP_DigestUpdate(mdctx, peer->password, strlen(peer->password));
     EVP_DigestFinal(mdctx, machash, &mdlen);
-    BN_bin2bn(machash, mdlen, hmul);
-    BN_mod(hmul, hmul, order, bnctx);
-    pp_a_bignum(DPP_DEBUG_TRACE, "H([mymac |] [identifier | ] password)", hmul);
 
     pp_a_point(DPP_DEBUG_TRACE, 1, peer->initiator ? "Pinit.x" : "Presp.x", pkex_instance.Pme);
     
-    if (!EC_POINT_mul(pkex_instance.group, Q, NULL, pkex_instance.Pme, hmul, bnctx)) {
+    if ((Qpw = get_q(machash, mdlen, 1)) == NULL) {
         dpp_debug(DPP_DEBUG_ERR, "unable to create Q for PKEX!\n");
         goto fin;
     }
@@ -1285,7 +1648,7 @@ pkex_exchange_to_peer (struct pkex_peer *peer, unsigned char status)
     }
     pp_a_point(DPP_DEBUG_TRACE, 1, peer->initiator ? "X.x" : "Y.x", (EC_POINT *)Xpt);
     
-    if (!EC_POINT_add(pkex_instance.group, Q, Xpt, Q, bnctx)) {
+    if (!EC_POINT_add(pkex_instance.group, Q, Xpt, Qpw, bnctx)) {
         dpp_debug(DPP_DEBUG_ERR, "unable to encrypt pubkey for PKEX!\n");
         goto fin;
     }
@@ -1326,10 +1689,10 @@ pkex_exchange_to_peer (struct pkex_peer *peer, unsigned char status)
     /*
      * ...if we're doing a PKEX identifier too then add that
      */
-    if (pkex_instance.adds_identifier) {
-        tlv = TLV_set_tlv(tlv, CODE_IDENTIFIER, strlen(pkex_instance.identifier),
-                          (unsigned char *)pkex_instance.identifier);
-        framelen += (strlen(pkex_instance.identifier) + sizeof(TLV));
+    if (peer->adds_identifier) {
+        tlv = TLV_set_tlv(tlv, CODE_IDENTIFIER, strlen(peer->identifier),
+                          (unsigned char *)peer->identifier);
+        framelen += (strlen(peer->identifier) + sizeof(TLV));
     }
     
     /*
@@ -1354,6 +1717,13 @@ pkex_exchange_to_peer (struct pkex_peer *peer, unsigned char status)
               peer->initiator ? "sending PKEX Exchange Request\n" : "sending PKEX Exchange Response\n");
     ret = send_pkex_frame(peer->handle, buf, framelen);
     peer->state = PKEX_SEND_EXCHANGE;
+    /*
+     * remember what was sent in case it has to be sent again
+     */
+    memcpy(peer->exchframe, buf, framelen);
+    peer->exchlen = framelen;
+    peer->exchversion = peer->version;
+    peer->exchstatus = status;
     ret = 1;
 fin:
     if (x != NULL) {
@@ -1362,15 +1732,6 @@ fin:
     if (y != NULL) {
         BN_free(y);
     }
-    if (mdctx != NULL) {
-        EVP_MD_CTX_free(mdctx);
-    }
-    if (order != NULL) {
-        BN_free(order);
-    }
-    if (hmul != NULL) {
-        BN_free(hmul);
-    }
     if (Q != NULL) {
         EC_POINT_free(Q);
     }
@@ -1424,7 +1785,7 @@ retransmit_pkex (timerid id, void *data)
 static int
 process_pkex_reveal (pkex_frame *frame, int len, struct pkex_peer *peer)
 {
-    unsigned char *ptr, *keyx = NULL, *ikm = NULL, direction;
+    unsigned char *ptr, keyx[P521_COORD_LEN], ikm[P521_COORD_LEN], direction;
     unsigned char tag[SHA512_DIGEST_LENGTH];
     unsigned int mdlen = pkex_instance.digestlen;
     int ret = -1;
@@ -1437,30 +1798,22 @@ process_pkex_reveal (pkex_frame *frame, int len, struct pkex_peer *peer)
     TLV *tlv;
     siv_ctx ctx;
 
-    if ((hctx = HMAC_CTX_new()) == NULL) {
+    if ((hctx = scratch_hmac_ctx()) == NULL) {
         dpp_debug(DPP_DEBUG_ERR, "unable to create HMAC context!\n");
         goto fin;
     }
-    switch (pkex_instance.digestlen) {
-        case SHA256_DIGEST_LENGTH:
-            siv_init(&ctx, peer->z, SIV_256);
-            break;
-        case SHA384_DIGEST_LENGTH:
-            siv_init(&ctx, peer->z, SIV_384);
-            break;
-        case SHA512_DIGEST_LENGTH:
-            siv_init(&ctx, peer->z, SIV_512);
-            break;
-        default:
-            dpp_debug(DPP_DEBUG_ERR, "unknown digest length %d!\n", pkex_instance.digestlen);
-            goto fin;
-    }
+    siv_init(&ctx, peer->z, pkex_instance.sivmode);
     tlv = (TLV *)frame->attributes;
     if (tlv->type != WRAPPED_DATA) {
         dpp_debug(DPP_DEBUG_ERR, "malformed PKEX reveal, no wrapped data!\n");
         goto fin;
     }
 
+    /*
+     * this is where the code gets tried, right or wrong
+     */
+    release_pkex_code(peer, 1);
+
     direction = peer->initiator ? 1 : 0;
     if (siv_decrypt(&ctx, TLV_value(tlv) + AES_BLOCK_SIZE, TLV_value(tlv) + AES_BLOCK_SIZE,
                     TLV_length(tlv) - AES_BLOCK_SIZE, TLV_value(tlv), 
@@ -1476,12 +1829,6 @@ process_pkex_reveal (pkex_frame *frame, int len, struct pkex_peer *peer)
         goto fin;
     }
 
-    if (((keyx = (unsigned char *)malloc(pkex_instance.primelen)) == NULL) ||
-        ((ikm = (unsigned char *)malloc(pkex_instance.primelen)) == NULL)) {
-        dpp_debug(DPP_DEBUG_ERR, "unable to malloc context to create confirm\n");
-        goto fin;
-    }
-
     tlv = (TLV *)(TLV_value(tlv) + AES_BLOCK_SIZE);
     if (TLV_type(tlv) != BOOTSTRAP_KEY) {
         dpp_debug(DPP_DEBUG_ERR, "malformed PKEX reveal, no bootstrap key!\n");
@@ -1497,7 +1844,7 @@ process_pkex_reveal (pkex_frame *frame, int len, struct pkex_peer *peer)
     BN_bin2bn(ptr, pkex_instance.primelen, y);
     ptr += pkex_instance.primelen;
 
-    peer->peer_bootstrap = EC_KEY_new_by_curve_name(pkex_instance.nid);
+    peer->peer_bootstrap = new_pkex_key();
     EC_KEY_set_public_key_affine_coordinates(peer->peer_bootstrap, x, y);
     EC_KEY_set_conv_form(peer->peer_bootstrap, POINT_CONVERSION_COMPRESSED);
     EC_KEY_set_asn1_flag(peer->peer_bootstrap, OPENSSL_EC_NAMED_CURVE);
@@ -1602,18 +1949,11 @@ process_pkex_reveal (pkex_frame *frame, int len, struct pkex_peer *peer)
     }
 
 fin:
-    if (ikm != NULL) {
-        free(ikm);
-    }
-    if (keyx != NULL) {
-        free(keyx);
-    }
+    OPENSSL_cleanse(ikm, sizeof(ikm));
+    OPENSSL_cleanse(keyx, sizeof(keyx));
     if (S != NULL) {
         EC_POINT_free(S);
     }
-    if (hctx != NULL) {
-        HMAC_CTX_free(hctx);
-    }
     if (x != NULL) {
         BN_free(x);
     }
@@ -1630,8 +1970,9 @@ process_pkex_exchange (pkex_frame *frame, int len, struct pkex_peer *peer)
     unsigned int mdlen = 0;
     unsigned short grp;
     int ret = -1;
-    BIGNUM *x = NULL, *y = NULL, *hmul = NULL, *order = NULL;
+    BIGNUM *x = NULL, *y = NULL;
     EC_POINT *Q = NULL;
+    const EC_POINT *Qpw;
     TLV *tlv;
     EVP_MD_CTX *mdctx = NULL;
 
@@ -1641,6 +1982,7 @@ process_pkex_exchange (pkex_frame *frame, int len, struct pkex_peer *peer)
     }
     if (peer->Y != NULL) {
         EC_POINT_free(peer->Y);
+        peer->Y = NULL;
     }
     tlv = (TLV *)frame->attributes;
 
@@ -1673,13 +2015,11 @@ process_pkex_exchange (pkex_frame *frame, int len, struct pkex_peer *peer)
          * next see if there's a code identifier
          */
         if ((tlv = find_tlv(CODE_IDENTIFIER, frame->attributes, len)) != NULL) {
-            if (!pkex_instance.adds_identifier ||
-                memcmp(pkex_instance.identifier, TLV_value(tlv),
-                       strlen(pkex_instance.identifier))) {
+            if (select_pkex_code(peer, (char *)TLV_value(tlv), TLV_length(tlv)) < 1) {
                 dpp_debug(DPP_DEBUG_ERR, "no matching code identifier\n");
                 goto fin;
             }
-        } else if (pkex_instance.adds_identifier) {
+        } else if (pkex_instance.adds_identifier || (pkex_instance.password[0] == 0)) {
             dpp_debug(DPP_DEBUG_ERR, "missing code identifier\n");
             goto fin;
         }
@@ -1712,17 +2052,15 @@ process_pkex_exchange (pkex_frame *frame, int len, struct pkex_peer *peer)
         }
     }
     
-    if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
-        ((mdctx = EVP_MD_CTX_new()) == NULL) || 
-        ((peer->n = BN_new()) == NULL) ||
-        ((peer->Y = EC_POINT_new(pkex_instance.group)) == NULL) ||
-        ((Q = EC_POINT_new(pkex_instance.group)) == NULL) ||
-        ((order = BN_new()) == NULL) || ((hmul = BN_new()) == NULL)) {
+    if ((peer->n == NULL) && ((peer->n = BN_new()) == NULL)) {
         dpp_debug(DPP_DEBUG_ERR, "unable to create key for PKEX\n");
         goto fin;
     }
-    if (!EC_GROUP_get_order(pkex_instance.group, order, bnctx)) {
-        dpp_debug(DPP_DEBUG_ERR, "unable to obtain order from the group! Order! Order!!\n");
+    if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
+        ((mdctx = scratch_md_ctx()) == NULL) || 
+        ((peer->Y = EC_POINT_new(pkex_instance.group)) == NULL) ||
+        ((Q = EC_POINT_new(pkex_instance.group)) == NULL)) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to create key for PKEX\n");
         goto fin;
     }
     /*
@@ -1761,21 +2099,19 @@ process_pkex_exchange (pkex_frame *frame, int len, struct pkex_peer *peer)
         print_buffer(DPP_DEBUG_TRACE, "adding peermac", peer->peermac, ETH_ALEN);
         EVP_DigestUpdate(mdctx, peer->peermac, ETH_ALEN);
     }
-    if (pkex_instance.adds_identifier) {
-        print_buffer(DPP_DEBUG_TRACE, "adding identifier", (unsigned char *)pkex_instance.identifier,
-                     strlen(pkex_instance.identifier));
-        EVP_DigestUpdate(mdctx, pkex_instance.identifier, strlen(pkex_instance.identifier));
+    if (peer->adds_identifier) {
+        print_buffer(DPP_DEBUG_TRACE, "adding identifier", (unsigned char *)peer->identifier,
+                     strlen(peer->identifier));
+        EVP_DigestUpdate(mdctx, peer->identifier, strlen(peer->identifier));
     }
-    EVP_DigestUpdate(mdctx, pkex_instance.password, strlen(pkex_instance.password));
-    print_buffer(DPP_DEBUG_TRACE, "password", (unsigned char *)pkex_instance.password, strlen(pkex_instance.password));
+    EVP_DigestUpdate(mdctx, peer->password, strlen(peer->password));
+    print_buffer(DPP_DEBUG_TRACE, "password", (unsigned char *)peer->password, strlen(peer->password));
     EVP_DigestFinal(mdctx, machash, &mdlen);
-    BN_bin2bn(machash, mdlen, hmul);
-    BN_mod(hmul, hmul, order, bnctx);
-    pp_a_bignum(DPP_DEBUG_TRACE, "H([peermac |] [identifier | ] password)", hmul);
 
     pp_a_point(DPP_DEBUG_TRACE, 1, peer->initiator ? "Presp.x" : "Pinit.x", pkex_instance.Ppeer);
 
-    if (!EC_POINT_mul(pkex_instance.group, Q, NULL, pkex_instance.Ppeer, hmul, bnctx) ||
+    if (((Qpw = get_q(machash, mdlen, 0)) == NULL) ||
+        !EC_POINT_copy(Q, Qpw) ||
         !EC_POINT_invert(pkex_instance.group, Q, bnctx)) {
         dpp_debug(DPP_DEBUG_ERR, "unable to create and invert Q' for PKEX!\n");
         goto fin;
@@ -1801,15 +2137,6 @@ fin:
     if (y != NULL) {
         BN_free(y);
     }
-    if (hmul != NULL) {
-        BN_free(hmul);
-    }
-    if (order != NULL) {
-        BN_free(order);
-    }
-    if (mdctx != NULL) {
-        EVP_MD_CTX_free(mdctx);
-    }
     if (Q != NULL) {
         EC_POINT_free(Q);
     }
@@ -1821,6 +2148,7 @@ process_pkex_frame (unsigned char *data, int len, pkex_handle handle)
 {
     pkex_frame *frame = (pkex_frame *)data;
     struct pkex_peer *peer = NULL;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
     int keyidx;
 
 
@@ -1853,6 +2181,7 @@ process_pkex_frame (unsigned char *data, int len, pkex_handle handle)
                     break;
                 }
                 if (process_pkex_exchange(frame, len, peer) > 0) {
+                    SHA256(data, len, peer->reqdigest);
                     pkex_exchange_to_peer(peer, STATUS_OK);
                     compute_z(peer);
                     peer->t0 = srv_add_timeout(srvctx, SRV_SEC(2), retransmit_pkex, peer);
@@ -1872,6 +2201,20 @@ process_pkex_frame (unsigned char *data, int len, pkex_handle handle)
                     peer->t0 = srv_add_timeout(srvctx, SRV_SEC(2), retransmit_pkex, peer);
                 }
             } else {
+                if ((frame->frame_type == PKEX_SUB_EXCH_V1REQ) || (frame->frame_type == PKEX_SUB_EXCH_REQ)) {
+                    /*
+                     * if the initiator didn't get our response it will send the same
+                     * request again, just resend what we already sent
+                     */
+                    SHA256(data, len, digest);
+                    if (memcmp(digest, peer->reqdigest, SHA256_DIGEST_LENGTH) == 0) {
+                        pkex_exchange_to_peer(peer, STATUS_OK);
+                    } else {
+                        dpp_debug(DPP_DEBUG_ERR, "responder got a different PKEX exchange request in SENT_EXCH\n");
+                    }
+                    peer->t0 = srv_add_timeout(srvctx, SRV_SEC(2), retransmit_pkex, peer);
+                    break;
+                }
                 if (frame->frame_type != PKEX_SUB_COM_REV_REQ) {
                     dpp_debug(DPP_DEBUG_ERR, "responder did not receive PKEX reveal request in SENT_EXCH\n");
                     peer->t0 = srv_add_timeout(srvctx, SRV_SEC(2), retransmit_pkex, peer);
@@ -1971,6 +2314,7 @@ void
 pkex_destroy_peer (pkex_handle handle)
 {
     struct pkex_peer *peer;
+    unsigned long gets, allocs;
 
     TAILQ_FOREACH(peer, &pkex_instance.peers, entry) {
         if (peer->handle == handle) {
@@ -1983,6 +2327,10 @@ pkex_destroy_peer (pkex_handle handle)
         return;
     }
     srv_rem_timeout(srvctx, peer->t0);  // just in case...
+    release_pkex_code(peer, 0);
+    point_pool_stats(ppool, &gets, &allocs);
+    dpp_debug(DPP_DEBUG_CRYPTO, "PKEX peer %d used %lu scratch points, %lu needed allocation\n",
+              handle, gets - peer->poolgets, allocs - peer->poolallocs);
     /*
      * cleanliness and order!
      */
@@ -2025,6 +2373,11 @@ pkex_create_peer (int version)
     peer->initiator = 0;
     peer->retrans = 0;
     peer->t0 = 0;
+    peer->exchlen = 0;
+    point_pool_stats(ppool, &peer->poolgets, &peer->poolallocs);
+    strcpy(peer->password, pkex_instance.password);
+    strcpy(peer->identifier, pkex_instance.identifier);
+    peer->adds_identifier = pkex_instance.adds_identifier;
     TAILQ_INSERT_HEAD(&pkex_instance.peers, peer, entry);
     printf("creating PKEX peer with version %d\n", peer->version);
 
@@ -2037,6 +2390,7 @@ pkex_initialize (int whatkind, char *password, char *id, char *info, char *keyfi
     FILE *fp;
     BIO *bio = NULL;
     int ret = 0;
+    long usecs, bytes;
     BIGNUM *prime = NULL;
     const BIGNUM *priv = NULL;
     const EC_POINT *Pub = NULL;
@@ -2051,11 +2405,16 @@ pkex_initialize (int whatkind, char *password, char *id, char *info, char *keyfi
     init_or_resp = whatkind;
     pkex_instance.group_num = 0;
     debug = verbosity;
+    init_pkex_codes();
+    /*
+     * this is the default code, others can be added to the code table
+     */
     strcpy(pkex_instance.password, password);
     if (id != NULL) {
         strcpy(pkex_instance.identifier, id);
         pkex_instance.adds_identifier = 1;
     } else {
+        memset(pkex_instance.identifier, 0, sizeof(pkex_instance.identifier));
         pkex_instance.adds_identifier = 0;
     }
     /*
@@ -2085,6 +2444,11 @@ pkex_initialize (int whatkind, char *password, char *id, char *info, char *keyfi
         ret = -1;
         goto fin;
     }
+    if ((ppool = point_pool_new(pkex_instance.group)) == NULL) {
+        fprintf(stderr, "PKEX: unable to create pool of scratch points\n");
+        ret = -1;
+        goto fin;
+    }
     pkex_instance.primelen = BN_num_bytes(prime);
     pkex_instance.nid = EC_GROUP_get_curve_name(pkex_instance.group);
     switch (pkex_instance.nid) {
@@ -2125,6 +2489,30 @@ pkex_initialize (int whatkind, char *password, char *id, char *info, char *keyfi
             ret = -1;
             goto fin;
     }
+    /*
+     * the AES-SIV mode follows from the digest so figure it out once
+     */
+    switch (pkex_instance.digestlen) {
+        case SHA256_DIGEST_LENGTH:
+            pkex_instance.sivmode = SIV_256;
+            break;
+        case SHA384_DIGEST_LENGTH:
+            pkex_instance.sivmode = SIV_384;
+            break;
+        default:
+            pkex_instance.sivmode = SIV_512;
+            break;
+    }
+    /*
+     * ephemeral keys are multiplications of the generator, keep a group
+     * with a table of multiples of it around for the life of the process
+     */
+    if ((pkexgroup = precomputed_group(pkex_instance.nid, bnctx, &usecs, &bytes)) == NULL) {
+        dpp_debug(DPP_DEBUG_ERR, "unable to precompute generator multiples\n");
+    } else {
+        dpp_debug(DPP_DEBUG_CRYPTO, "precomputed group %d generator in %ld usec, %ld bytes\n",
+                  pkex_instance.group_num, usecs, bytes);
+    }
     EVP_add_digest(pkex_instance.hashfcn);
     if (pkex_instance.hashfcn != EVP_sha256()) {
         EVP_add_digest(EVP_sha256());   /* to hash bootstrapping keys */
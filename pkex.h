@@ -41,5 +41,8 @@ pkex_handle pkex_create_peer(int);
 void pkex_destroy_peer(pkex_handle);
 void pkex_update_macs(pkex_handle, unsigned char *, unsigned char *);
 int process_pkex_frame(unsigned char *, int, pkex_handle);
+int pkex_add_code(char *, char *, int, int);
+int pkex_remove_code(char *);
+int pkex_load_codes(char *);
 
 #endif  /* _DPP_H_ */
@@ -35,12 +35,20 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <sys/time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 #include <openssl/bn.h>
 #include <openssl/ec.h>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <openssl/ecdsa.h>
 #include "jsmn.h"
+#include "hkdf.h"
 #include "utils.h"
 
 static int skip_object(jsmntok_t *t);
@@ -49,6 +57,7 @@ static int skip_string(jsmntok_t *t);
 static int skip_primitive(jsmntok_t *t);
 
 #define BIGGEST_POSSIBLE_SIGNATURE      140
+#define BIGGEST_COORDINATE              66      /* P-521 */
 
 static int
 skip_single (jsmntok_t *t)
@@ -96,7 +105,7 @@ skip_object (jsmntok_t *t)
      * an object is followed by another token and it's attributes...
      */
     for (j = 0; j < t->size; j++) {
-        i += skip_single(t+1);
+        i += skip_single(t+1+i);
         i += skip_single(t+1+i);
     }
     return i+1;
@@ -112,7 +121,7 @@ skip_array (jsmntok_t *t)
      * an array is a series of tokens
      */
     for (j = 0; j < t->size; j++) {
-        i += skip_single(t+1);
+        i += skip_single(t+1+i);
     }
     return i+1;
 }
@@ -171,250 +180,394 @@ find_token (jsmntok_t *toks, int *n, int ntoks, char *buffer, char *str)
     return -1;
 }
 
+/*
+ * parse a JSON object once so any number of json_get()s can be done on
+ * it. The tokens live in the doc itself, usually on the caller's stack,
+ * so there's nothing to free afterwards.
+ */
 int
-get_json_data (char *buf, int buflen, char **start, char **end,
-               const int nlab, ...)
+json_parse (struct json_doc *doc, char *buf, int buflen)
 {
-    va_list labs;
-    char *lab;
-    int i =0, ntoks, numlab = nlab, ret = -1;
-    jsmntok_t *tok, *toks;
     jsmn_parser p;
-    
-    if (!nlab) {
-        return 0;
-    }
+    int ntoks;
+
+    doc->buf = buf;
+    doc->buflen = buflen;
+    doc->ntoks = 0;
+
     jsmn_init(&p);
-    if ((ntoks = jsmn_parse(&p, buf, buflen, NULL, 200)) == 0) {
-        return 0;
+    if ((ntoks = jsmn_parse(&p, buf, buflen, doc->toks, JSON_TOKENS)) < 1) {
+        return ntoks < 0 ? -1 : 0;
     }
-    if ((toks = (jsmntok_t *)malloc((ntoks+1) * sizeof(jsmntok_t))) == NULL) {
+    if (TOKTYPE(&doc->toks[0]) != JSMN_OBJECT) {
         return -1;
     }
-    memset(toks, 0, (ntoks+1)*sizeof(jsmntok_t));
-    jsmn_init(&p);
-    if ((ntoks = jsmn_parse(&p, buf, buflen, toks, ntoks)) == 0) {
-        goto fin;
-    }
-    tok = &toks[0];
-    if (TOKTYPE(tok) != JSMN_OBJECT) {
-        goto fin;
+    doc->ntoks = ntoks;
+    return ntoks;
+}
+
+static int
+json_getv (struct json_doc *doc, char **start, char **end, int nlab, va_list labs)
+{
+    char *lab;
+    int i = 0, ntoks;
+    jsmntok_t *tok;
+
+    if (!nlab || (doc->ntoks < 1)) {
+        return 0;
     }
+    tok = &doc->toks[0];
+    ntoks = tok->size;
     /*
      * run through all of the keywords searching through the JSON
      */
-    va_start(labs, nlab);
-    while (numlab) {
+    while (nlab) {
         lab = (char *)va_arg(labs, char *);
         i++;
-        if (find_token(toks, &i, ntoks, buf, lab) < 1) {
-            goto fin;
+        if (find_token(doc->toks, &i, ntoks, doc->buf, lab) < 1) {
+            return -1;
         }
         i++;
-        tok = &toks[i];
+        tok = &doc->toks[i];
         ntoks = tok->size;
-        numlab--;
+        nlab--;
     }
-    va_end(labs);
     /*
      * we have found what we're looking for!
      */
     switch (TOKTYPE(tok)) {
         case JSMN_OBJECT:
         case JSMN_ARRAY:
-            *start = buf + TOKSTART(tok) + 1;
+            *start = doc->buf + TOKSTART(tok) + 1;
             *end = *start + TOKLEN(tok) - 2;
-            ret = tok->size;
-            break;
+            return tok->size;
         case JSMN_PRIMITIVE:
         case JSMN_STRING:
-            *start = buf + TOKSTART(tok);
+            *start = doc->buf + TOKSTART(tok);
             *end = *start + TOKLEN(tok);
-            ret = 1;
-            break;
+            return 1;
         default:
             break;
     }
-fin:
-    free(toks);
-    return ret;
+    return -1;
 }
 
+/*
+ * find the value at a path of labels in a parsed doc, returns the number
+ * of elements if it's an object or array, 1 if it's a string or primitive
+ */
 int
-base64urlencode (unsigned char *burl, unsigned char *data, int len)
+json_get (struct json_doc *doc, char **start, char **end, const int nlab, ...)
 {
-    int octets, i;
+    va_list labs;
+    int ret;
 
-    /*
-     * b64 the data, replace the non-URL safe characters, and get rid of padding
-     */
-    octets = EVP_EncodeBlock(burl, data, len);
-    for (i = 0; i < octets; i++) {
-        if (burl[i] == '+') {
-            burl[i] = '-';
-        } else if (burl[i] == '/') {
-            burl[i] = '_';
-        }
-    }
-    while (burl[octets-1] == '=') {
-        burl[octets-1] = '\0';
-        octets--;
-    }
-    return octets;
+    va_start(labs, nlab);
+    ret = json_getv(doc, start, end, nlab, labs);
+    va_end(labs);
+    return ret;
 }
 
+/*
+ * a one-off lookup, to do more than one on the same buffer use
+ * json_parse() and json_get()
+ */
 int
-base64urldecode (unsigned char *data, unsigned char *burl, int len)
+get_json_data (char *buf, int buflen, char **start, char **end,
+               const int nlab, ...)
 {
-    int res, pad, i;
-    unsigned char *b64, *unb64;
+    struct json_doc doc;
+    va_list labs;
+    int ret;
 
-    /*
-     * allocate bigger buffers to b64 decode
-     */
-    pad = 0;
-    switch (len%4) {
-        case 2:
-            pad = 2;
-            break;
-        case 3:
-            pad = 1;
-            break;
-        case 0:
-            break;
-        default:
-            return -1;
+    if (!nlab) {
+        return 0;
     }
-    if ((b64 = (unsigned char *)malloc(len + pad)) == NULL) {
-        return -1;
+    if ((ret = json_parse(&doc, buf, buflen)) < 1) {
+        return ret;
     }
-    if ((unb64 = (unsigned char *)malloc(len)) == NULL) {
-        free(b64);
-        return -1;
+    va_start(labs, nlab);
+    ret = json_getv(&doc, start, end, nlab, labs);
+    va_end(labs);
+    return ret;
+}
+
+/*
+ * base64url (RFC 4648 section 5) done directly on the URL-safe alphabet,
+ * no padding on output and nothing to fix up afterwards.
+ */
+static const unsigned char b64url_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static const signed char b64url_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static int
+b64url_value (unsigned char c, int strict)
+{
+    if (b64url_values[c] >= 0) {
+        return b64url_values[c];
     }
-    memset(b64, '=', len + pad);
-    memcpy(b64, burl, len);
     /*
-     * make it URL unsafe again
+     * when not being strict, take the regular base64 alphabet too
      */
-    for (i = 0; i < len; i++) {
-        if (b64[i] == '-') {
-            b64[i] = '+';
-        } else if (b64[i] == '_') {
-            b64[i] = '/';
+    if (!strict) {
+        if (c == '+') {
+            return 62;
+        } else if (c == '/') {
+            return 63;
         }
     }
-    /*
-     * b64 decode the data now and copy it to the buffer
-     */
-    res = EVP_DecodeBlock(unb64, b64, len + pad);
-    memcpy(data, unb64, res - pad);
-    free(b64);
-    free(unb64);
+    return -1;
+}
 
-    return res - pad;
+#ifdef __SSSE3__
+/*
+ * 12 octets in, 16 characters out, per pass. Returns the number of octets
+ * consumed, the caller finishes whatever's left over.
+ */
+static int
+b64url_encode_ssse3 (unsigned char *burl, const unsigned char *data, int len)
+{
+    __m128i in, t0, t1, t2, t3, idx, res, less;
+    int i;
+
+    for (i = 0; (len - i) >= 16; i += 12, burl += 16) {
+        in = _mm_loadu_si128((const __m128i *)(data + i));
+        in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                                7, 6, 8, 7, 10, 9, 11, 10));
+        /*
+         * spread each 24 bits into four 6-bit indices...
+         */
+        t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+        t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+        t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        idx = _mm_or_si128(t1, t3);
+        /*
+         * ...and map them onto the alphabet by adding a per-range offset
+         */
+        res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+        less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+        res = _mm_or_si128(res, _mm_and_si128(less, _mm_set1_epi8(13)));
+        res = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52, '-' - 62,
+                                             '_' - 63, 'A', 0, 0), res);
+        _mm_storeu_si128((__m128i *)burl, _mm_add_epi8(res, idx));
+    }
+    return i;
 }
 
-int
-base64urlencode_verbose (unsigned char *burl, unsigned char *data, int len)
+/*
+ * 16 characters in, 12 octets out, per pass. Stops at the first block with
+ * anything outside the URL-safe alphabet and returns the number of
+ * characters consumed, the caller deals with the rest.
+ */
+static int
+b64url_decode_ssse3 (unsigned char *data, const unsigned char *burl, int len)
 {
-    int octets, i;
+    __m128i c, upper, lower, digit, dash, under, shift;
+    int i;
 
-    /*
-     * b64 the data, replace the non-URL safe characters, and get rid of padding
-     */
-    octets = EVP_EncodeBlock(burl, data, len);
-    printf("b64 encoded %d to get %d\n", len, octets);
-    for (i = 0; i < octets; i++) {
-        printf("%c", burl[i]);
-    }
-    printf("\n");
-    for (i = 0; i < octets; i++) {
-        if (burl[i] == '+') {
-            burl[i] = '-';
-        } else if (burl[i] == '/') {
-            burl[i] = '_';
+    for (i = 0; (len - i) >= 24; i += 16, data += 12) {
+        c = _mm_loadu_si128((const __m128i *)(burl + i));
+        upper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)),
+                              _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), c));
+        lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)),
+                              _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), c));
+        digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                              _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+        dash = _mm_cmpeq_epi8(c, _mm_set1_epi8('-'));
+        under = _mm_cmpeq_epi8(c, _mm_set1_epi8('_'));
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower),
+                                           _mm_or_si128(digit, _mm_or_si128(dash, under)))) != 0xffff) {
+            break;
         }
+        shift = _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                             _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+        shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+        shift = _mm_or_si128(shift, _mm_and_si128(dash, _mm_set1_epi8(62 - '-')));
+        shift = _mm_or_si128(shift, _mm_and_si128(under, _mm_set1_epi8(63 - '_')));
+        c = _mm_add_epi8(c, shift);
+        /*
+         * pack four 6-bit values into 24 bits, then pull out the octets
+         */
+        c = _mm_maddubs_epi16(c, _mm_set1_epi32(0x01400140));
+        c = _mm_madd_epi16(c, _mm_set1_epi32(0x00011000));
+        c = _mm_shuffle_epi8(c, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+                                              8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128((__m128i *)data, c);
     }
-    while (burl[octets-1] == '=') {
-        printf("removing a '=' at %d\n", octets-1);
-        burl[octets-1] = '\0';
-        octets--;
-    }
-    printf("returning %d octets\n", octets);
-    return octets;
+    return i;
 }
+#endif  /* __SSSE3__ */
 
 int
-base64urldecode_verbose (unsigned char *data, unsigned char *burl, int len)
+base64urlencode (unsigned char *burl, unsigned char *data, int len)
 {
-    int res, pad, i;
-    unsigned char *b64, *unb64;
+    unsigned int w;
+    int i = 0, octets = 0;
 
-    /*
-     * allocate a, possibly, bigger buffer to b64 decode
-     */
-    pad = 0;
-    switch (len%4) {
+#ifdef __SSSE3__
+    i = b64url_encode_ssse3(burl, data, len);
+    octets = (i/3) * 4;
+#endif
+    for (; (len - i) >= 3; i += 3) {
+        w = (data[i] << 16) | (data[i+1] << 8) | data[i+2];
+        burl[octets++] = b64url_alphabet[(w >> 18) & 0x3f];
+        burl[octets++] = b64url_alphabet[(w >> 12) & 0x3f];
+        burl[octets++] = b64url_alphabet[(w >> 6) & 0x3f];
+        burl[octets++] = b64url_alphabet[w & 0x3f];
+    }
+    switch (len - i) {
         case 2:
-            pad = 2;
-            break;
-        case 3:
-            pad = 1;
+            w = (data[i] << 16) | (data[i+1] << 8);
+            burl[octets++] = b64url_alphabet[(w >> 18) & 0x3f];
+            burl[octets++] = b64url_alphabet[(w >> 12) & 0x3f];
+            burl[octets++] = b64url_alphabet[(w >> 6) & 0x3f];
             break;
-        case 0:
+        case 1:
+            w = data[i] << 16;
+            burl[octets++] = b64url_alphabet[(w >> 18) & 0x3f];
+            burl[octets++] = b64url_alphabet[(w >> 12) & 0x3f];
             break;
         default:
-            return -1;
+            break;
     }
-    printf("data is %d, adding %d bytes of pad to decode data\n", len, pad);
-    if ((b64 = (unsigned char *)malloc(len + pad)) == NULL) {
+    burl[octets] = '\0';
+    return octets;
+}
+
+/*
+ * strict decoding takes only the URL-safe alphabet, no padding, and
+ * insists the unused bits at the end are zero so there's exactly one
+ * encoding of any value. Otherwise '+', '/', and trailing '='s are
+ * tolerated.
+ */
+static int
+b64url_decode (unsigned char *data, unsigned char *burl, int len, int strict)
+{
+    int i = 0, octets = 0, v0, v1, v2, v3;
+
+    if (len < 0) {
         return -1;
     }
-    if ((unb64 = (unsigned char *)malloc(len)) == NULL) {
-        free(b64);
+    if (!strict) {
+        for (v0 = 0; (v0 < 2) && len && (burl[len-1] == '='); v0++) {
+            len--;
+        }
+    }
+    if ((len % 4) == 1) {
         return -1;
     }
-    memset(b64, '=', len + pad);
-    memcpy(b64, burl, len);
-    /*
-     * make it URL unsafe again
-     */
-    for (i = 0; i < len; i++) {
-        if (b64[i] == '-') {
-            b64[i] = '+';
-        } else if (b64[i] == '_') {
-            b64[i] = '/';
+#ifdef __SSSE3__
+    i = b64url_decode_ssse3(data, burl, len);
+    octets = (i/4) * 3;
+#endif
+    for (; (len - i) >= 4; i += 4) {
+        v0 = b64url_values[burl[i]];
+        v1 = b64url_values[burl[i+1]];
+        v2 = b64url_values[burl[i+2]];
+        v3 = b64url_values[burl[i+3]];
+        if ((v0 | v1 | v2 | v3) < 0) {
+            if (((v0 = b64url_value(burl[i], strict)) < 0) ||
+                ((v1 = b64url_value(burl[i+1], strict)) < 0) ||
+                ((v2 = b64url_value(burl[i+2], strict)) < 0) ||
+                ((v3 = b64url_value(burl[i+3], strict)) < 0)) {
+                return -1;
+            }
         }
+        data[octets++] = (v0 << 2) | (v1 >> 4);
+        data[octets++] = (v1 << 4) | (v2 >> 2);
+        data[octets++] = (v2 << 6) | v3;
     }
-    /*
-     * b64 decode the data now
-     */
-    for (i = 0; i < (len + pad); i++) {
-        printf("%c", b64[i]);
+    switch (len - i) {
+        case 3:
+            if (((v0 = b64url_value(burl[i], strict)) < 0) ||
+                ((v1 = b64url_value(burl[i+1], strict)) < 0) ||
+                ((v2 = b64url_value(burl[i+2], strict)) < 0) ||
+                (strict && (v2 & 0x03))) {
+                return -1;
+            }
+            data[octets++] = (v0 << 2) | (v1 >> 4);
+            data[octets++] = (v1 << 4) | (v2 >> 2);
+            break;
+        case 2:
+            if (((v0 = b64url_value(burl[i], strict)) < 0) ||
+                ((v1 = b64url_value(burl[i+1], strict)) < 0) ||
+                (strict && (v1 & 0x0f))) {
+                return -1;
+            }
+            data[octets++] = (v0 << 2) | (v1 >> 4);
+            break;
+        default:
+            break;
     }
-    printf("\n");
-    res = EVP_DecodeBlock(unb64, b64, len + pad);
-    printf("b64 decoded %d to get %d\n", len + pad, res);
-    memcpy(data, unb64, res - pad);
-    free(b64);
-    free(unb64);
+    return octets;
+}
+
+int
+base64urldecode (unsigned char *data, unsigned char *burl, int len)
+{
+    return b64url_decode(data, burl, len, 0);
+}
+
+int
+base64urldecode_strict (unsigned char *data, unsigned char *burl, int len)
+{
+    return b64url_decode(data, burl, len, 1);
+}
+
+int
+base64urlencode_verbose (unsigned char *burl, unsigned char *data, int len)
+{
+    int octets;
+
+    octets = base64urlencode(burl, data, len);
+    printf("b64url encoded %d to get %d\n", len, octets);
+    printf("%.*s\n", octets, burl);
+    return octets;
+}
+
+int
+base64urldecode_verbose (unsigned char *data, unsigned char *burl, int len)
+{
+    int res;
 
-    return res - pad;
+    printf("b64url decoding %d characters:\n", len);
+    printf("%.*s\n", len, burl);
+    res = base64urldecode(data, burl, len);
+    printf("b64url decoded %d to get %d\n", len, res);
+    return res;
 }
 
 int
 get_kid_from_point (unsigned char *kid, const EC_GROUP *group, const EC_POINT *pt, BN_CTX *bnctx)
 {
-    BIGNUM *x = NULL, *y = NULL;
-    EVP_MD_CTX *mdctx = NULL;
+    EVP_MD_CTX *mdctx;
     unsigned int mdlen = SHA256_DIGEST_LENGTH;
     unsigned char digest[SHA256_DIGEST_LENGTH];
-    int burllen = -1, bnlen, nid, offset;
-    unsigned char *bn = NULL, *ptr;
+    int burllen = -1, bnlen, nid;
+    unsigned char bn[2*BIGGEST_COORDINATE + 1];
     
-    if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
-        ((mdctx = EVP_MD_CTX_new()) == NULL)) {
+    if ((mdctx = scratch_md_ctx()) == NULL) {
         goto fin;
     }
     nid = EC_GROUP_get_curve_name(group);
@@ -443,32 +596,19 @@ get_kid_from_point (unsigned char *kid, const EC_GROUP *group, const EC_POINT *p
             goto fin;
     }
     /*
-     * get the x- and y-coordinates of the point
-     */
-    if (!EC_POINT_get_affine_coordinates_GFp(group, pt, x, y, bnctx)) {
-        goto fin;
-    }
-
-    /*
-     * then make it "uncompressed form"....
+     * put the point in "uncompressed form", 0x04 | x | y with each
+     * coordinate padded to the length of the prime....
      */
-    if ((bn = (unsigned char *)malloc(2*bnlen + 1)) == NULL) {
+    if (EC_POINT_point2oct(group, pt, POINT_CONVERSION_UNCOMPRESSED,
+                           bn, sizeof(bn), bnctx) != (2*bnlen + 1)) {
         goto fin;
     }
-    memset(bn, 0, (2*bnlen + 1));
-    bn[0] = 0x04;
-    ptr = &bn[1];
-    offset = bnlen - BN_num_bytes(x);
-    BN_bn2bin(x, ptr + offset);
-    ptr = &bn[1+bnlen];
-    offset = bnlen - BN_num_bytes(y);
-    BN_bn2bin(y, ptr + offset);
     /*
      * hash it all up with SHA256
      */
-    EVP_DigestInit(mdctx, EVP_sha256());
+    EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
     EVP_DigestUpdate(mdctx, bn, 2*bnlen + 1);
-    EVP_DigestFinal(mdctx, digest, &mdlen);
+    EVP_DigestFinal_ex(mdctx, digest, &mdlen);
     /*
      * and the kid is the base64url of that hash
      */
@@ -478,19 +618,6 @@ get_kid_from_point (unsigned char *kid, const EC_GROUP *group, const EC_POINT *p
     kid[burllen] = '\0';
 
  fin:
-    if (x != NULL) {
-        BN_free(x);
-    }
-    if (y != NULL) {
-        BN_free(y);
-    }
-    if (bn != NULL) {
-        free(bn);
-    }
-    if (mdctx != NULL) {
-        EVP_MD_CTX_free(mdctx);
-    }
-
     return burllen;
 }
 
@@ -500,14 +627,13 @@ generate_connector (unsigned char *connector, int len, EC_GROUP *group, EC_POINT
 {
     unsigned char kid[KID_LENGTH];
     char buf[2048];
-    unsigned char burlx[256], burly[256], *bn = NULL;
+    unsigned char burlx[256], burly[256], bn[BIGGEST_COORDINATE];
     unsigned char digest[SHA512_DIGEST_LENGTH], sig[BIGGEST_POSSIBLE_SIGNATURE];
     int nid, primelen, burllen, bnlen, offset, buflen, sofar = 0;
     unsigned int siglen;
-    EVP_MD_CTX *mdctx = NULL;
+    EVP_MD_CTX *mdctx;
     unsigned int mdlen = SHA256_DIGEST_LENGTH;
-    BIGNUM *x = NULL, *y = NULL, *prime = NULL, *r = NULL, *s = NULL;
-    BIO *bio = NULL;
+    BIGNUM *x, *y, *prime, *r = NULL, *s = NULL;
     const EC_POINT *signpub;
     const EC_GROUP *signgroup;
     ECDSA_SIG *ecsig = NULL;
@@ -515,8 +641,10 @@ generate_connector (unsigned char *connector, int len, EC_GROUP *group, EC_POINT
     struct tm *bdt;
     
 
-    if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL) ||
-        ((prime = BN_new()) == NULL) || ((bio = BIO_new(BIO_s_mem())) == NULL)) {
+    BN_CTX_start(bnctx);
+    x = BN_CTX_get(bnctx);
+    y = BN_CTX_get(bnctx);
+    if ((prime = BN_CTX_get(bnctx)) == NULL) {
         goto fail;
     }
 
@@ -565,8 +693,7 @@ generate_connector (unsigned char *connector, int len, EC_GROUP *group, EC_POINT
     if (!EC_POINT_get_affine_coordinates_GFp(group, netackey, x, y, bnctx)) {
         goto fail;
     }
-    bnlen = BN_num_bytes(prime);
-    if ((bn = (unsigned char *)malloc(bnlen)) == NULL) {
+    if ((bnlen = BN_num_bytes(prime)) > (int)sizeof(bn)) {
         goto fail;
     }
     memset(bn, 0, bnlen);
@@ -629,7 +756,7 @@ generate_connector (unsigned char *connector, int len, EC_GROUP *group, EC_POINT
     /*
      * calculate the signature on the connector so far
      */
-    if ((mdctx = EVP_MD_CTX_new()) == NULL) {
+    if ((mdctx = scratch_md_ctx()) == NULL) {
         goto fail;
     }
 
@@ -639,23 +766,23 @@ generate_connector (unsigned char *connector, int len, EC_GROUP *group, EC_POINT
 #ifdef HAS_BRAINPOOL
         case NID_brainpoolP256r1:
 #endif  /* HAS_BRAINPOOL */
-            EVP_DigestInit(mdctx, EVP_sha256());
+            EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
             primelen = 32;
             break;
         case NID_secp384r1:
 #ifdef HAS_BRAINPOOL
         case NID_brainpoolP384r1:
 #endif  /* HAS_BRAINPOOL */
-            EVP_DigestInit(mdctx, EVP_sha384());
+            EVP_DigestInit_ex(mdctx, EVP_sha384(), NULL);
             primelen = 48;
             break;
         case NID_secp521r1:
-            EVP_DigestInit(mdctx, EVP_sha512());
+            EVP_DigestInit_ex(mdctx, EVP_sha512(), NULL);
             primelen = 66;
             break;
 #ifdef HAS_BRAINPOOL
         case NID_brainpoolP512r1:
-            EVP_DigestInit(mdctx, EVP_sha512());
+            EVP_DigestInit_ex(mdctx, EVP_sha512(), NULL);
             primelen = 64;
             break;
 #endif  /* HAS_BRAINPOOL */
@@ -664,7 +791,7 @@ generate_connector (unsigned char *connector, int len, EC_GROUP *group, EC_POINT
             goto fail;
     }
     EVP_DigestUpdate(mdctx, connector, sofar);
-    EVP_DigestFinal(mdctx, digest, &mdlen);
+    EVP_DigestFinal_ex(mdctx, digest, &mdlen);
 
     if ((ecsig = ECDSA_do_sign_ex(digest, mdlen, NULL, NULL, signkey)) == NULL) {
         goto fail;
@@ -691,24 +818,7 @@ generate_connector (unsigned char *connector, int len, EC_GROUP *group, EC_POINT
 fail:
         sofar = -1;
     }
-    if (bio != NULL) {
-        BIO_free(bio);
-    }
-    if (x != NULL) {
-        BN_free(x);
-    }
-    if (y != NULL) {
-        BN_free(y);
-    }
-    if (prime != NULL) {
-        BN_free(prime);
-    }
-    if (bn != NULL) {
-        free(bn);
-    }
-    if (mdctx != NULL) {
-        EVP_MD_CTX_free(mdctx);
-    }
+    BN_CTX_end(bnctx);
     if (ecsig != NULL) {
         ECDSA_SIG_free(ecsig);
     }
@@ -738,7 +848,7 @@ validate_connector (unsigned char *connector, int len, EC_KEY *signkey, BN_CTX *
         goto fail;
     }
     
-    if ((mdctx = EVP_MD_CTX_new()) == NULL) {
+    if ((mdctx = scratch_md_ctx()) == NULL) {
         goto fail;
     }
 
@@ -749,23 +859,23 @@ validate_connector (unsigned char *connector, int len, EC_KEY *signkey, BN_CTX *
 #ifdef HAS_BRAINPOOL
         case NID_brainpoolP256r1:
 #endif  /* HAS_BRAINPOOL */
-            EVP_DigestInit(mdctx, EVP_sha256());
+            EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
             primelen = 32;
             break;
         case NID_secp384r1:
 #ifdef HAS_BRAINPOOL
         case NID_brainpoolP384r1:
 #endif  /* HAS_BRAINPOOL */
-            EVP_DigestInit(mdctx, EVP_sha384());
+            EVP_DigestInit_ex(mdctx, EVP_sha384(), NULL);
             primelen = 48;
             break;
         case NID_secp521r1:
-            EVP_DigestInit(mdctx, EVP_sha512());
+            EVP_DigestInit_ex(mdctx, EVP_sha512(), NULL);
             primelen = 66;
             break;
 #ifdef HAS_BRAINPOOL
         case NID_brainpoolP512r1:
-            EVP_DigestInit(mdctx, EVP_sha512());
+            EVP_DigestInit_ex(mdctx, EVP_sha512(), NULL);
             primelen = 64;
             break;
 #endif  /* HAS_BRAINPOOL */
@@ -774,11 +884,17 @@ validate_connector (unsigned char *connector, int len, EC_KEY *signkey, BN_CTX *
             goto fail;
     }
     EVP_DigestUpdate(mdctx, connector, diglen);
-    EVP_DigestFinal(mdctx, digest, &mdlen);
+    EVP_DigestFinal_ex(mdctx, digest, &mdlen);
 
     dot2++;     // skip over '.'
 
-    siglen = base64urldecode(sig, dot2, len - (int)(dot2 - connector));
+    /*
+     * JWS signatures are unpadded base64url, anything else is bogus
+     */
+    if ((len - (int)(dot2 - connector)) > (((BIGGEST_POSSIBLE_SIGNATURE + 2)/3) * 4)) {
+        goto fail;
+    }
+    siglen = base64urldecode_strict(sig, dot2, len - (int)(dot2 - connector));
 
     if (siglen != (2 * primelen)) {
         goto fail;
@@ -796,9 +912,6 @@ fail:
     if (ecsig != NULL) {
         ECDSA_SIG_free(ecsig);
     }
-    if (mdctx != NULL) {
-        EVP_MD_CTX_free(mdctx);
-    }
     return ret;
 }
 
@@ -807,6 +920,7 @@ EC_POINT *get_point_from_connector (unsigned char *connector, int len, const EC_
     EC_POINT *P = NULL;
     BIGNUM *x = NULL, *y = NULL;
     unsigned char *unburl = NULL, *unbpt = NULL;
+    struct json_doc body;
     char *dot1, *dot2, *sstr, *estr;
     int unburllen, ntok, unbptlen, ptlen;
 
@@ -819,7 +933,10 @@ EC_POINT *get_point_from_connector (unsigned char *connector, int len, const EC_
     }
     dot1 = dot1+1;
     unburllen = base64urldecode(unburl, (unsigned char *)dot1, dot2 - dot1);
-    if ((ntok = get_json_data((char *)unburl, unburllen, &sstr, &estr, 2, "netAccessKey", "crv")) != 1) {
+    if (json_parse(&body, (char *)unburl, unburllen) < 1) {
+        goto fail;
+    }
+    if ((ntok = json_get(&body, &sstr, &estr, 2, "netAccessKey", "crv")) != 1) {
         goto fail;
     }
     if (strncmp(sstr, "P-256", 5) == 0) {
@@ -866,14 +983,14 @@ EC_POINT *get_point_from_connector (unsigned char *connector, int len, const EC_
         goto fail;
     }
 
-    if ((ntok = get_json_data((char *)unburl, unburllen, &sstr, &estr, 2, "netAccessKey", "x")) != 1) {
+    if ((ntok = json_get(&body, &sstr, &estr, 2, "netAccessKey", "x")) != 1) {
         goto fail;
     }
     memset(unbpt, 0xee, ptlen);
     unbptlen = base64urldecode(unbpt, (unsigned char *)sstr, (int)(estr - sstr));
     BN_bin2bn((unsigned char *)unbpt, unbptlen, x);
 
-    if ((ntok = get_json_data((char *)unburl, unburllen, &sstr, &estr, 2, "netAccessKey", "y")) != 1) {
+    if ((ntok = json_get(&body, &sstr, &estr, 2, "netAccessKey", "y")) != 1) {
         goto fail;
     }
     memset(unbpt, 0xee, ptlen);
@@ -908,3 +1025,166 @@ fail:
     
     return P;
 }
+
+/*
+ * a pool of scratch points on a single group, used like a BN_CTX: open a
+ * frame with point_pool_start(), take points with point_pool_get(), and
+ * point_pool_end() hands back everything taken since the matching start.
+ * Points are only ever allocated the first time a slot is needed so a
+ * protocol exchange, after the first one, does no heap allocation for its
+ * temporary points.
+ */
+#define POINT_POOL_SIZE         16
+#define POINT_POOL_DEPTH        8
+
+struct point_pool {
+    const EC_GROUP *group;
+    EC_POINT *pts[POINT_POOL_SIZE];
+    int used;
+    int depth;
+    int frames[POINT_POOL_DEPTH];
+    unsigned long allocs;
+    unsigned long gets;
+};
+
+struct point_pool *
+point_pool_new (const EC_GROUP *group)
+{
+    struct point_pool *pool;
+
+    if ((pool = (struct point_pool *)malloc(sizeof(struct point_pool))) == NULL) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(struct point_pool));
+    pool->group = group;
+    return pool;
+}
+
+void
+point_pool_free (struct point_pool *pool)
+{
+    int i;
+
+    if (pool == NULL) {
+        return;
+    }
+    for (i = 0; i < POINT_POOL_SIZE; i++) {
+        if (pool->pts[i] != NULL) {
+            EC_POINT_clear_free(pool->pts[i]);
+        }
+    }
+    free(pool);
+}
+
+void
+point_pool_start (struct point_pool *pool)
+{
+    /*
+     * frames nested too deeply aren't recorded, every get in them fails
+     * until they're unwound
+     */
+    if (pool->depth < POINT_POOL_DEPTH) {
+        pool->frames[pool->depth] = pool->used;
+    }
+    pool->depth++;
+}
+
+EC_POINT *
+point_pool_get (struct point_pool *pool)
+{
+    EC_POINT *pt;
+
+    if ((pool->depth < 1) || (pool->depth > POINT_POOL_DEPTH) ||
+        (pool->used == POINT_POOL_SIZE)) {
+        return NULL;
+    }
+    if ((pt = pool->pts[pool->used]) == NULL) {
+        if ((pt = EC_POINT_new(pool->group)) == NULL) {
+            return NULL;
+        }
+        pool->pts[pool->used] = pt;
+        pool->allocs++;
+    } else {
+        EC_POINT_set_to_infinity(pool->group, pt);
+    }
+    pool->used++;
+    pool->gets++;
+    return pt;
+}
+
+void
+point_pool_end (struct point_pool *pool)
+{
+    if (pool->depth < 1) {
+        return;
+    }
+    pool->depth--;
+    if (pool->depth < POINT_POOL_DEPTH) {
+        pool->used = pool->frames[pool->depth];
+    }
+}
+
+/*
+ * how many points have been handed out and how many of those needed an
+ * allocation, since the pool was created
+ */
+void
+point_pool_stats (struct point_pool *pool, unsigned long *gets, unsigned long *allocs)
+{
+    if (pool == NULL) {
+        *gets = *allocs = 0;
+        return;
+    }
+    *gets = pool->gets;
+    *allocs = pool->allocs;
+}
+
+/*
+ * build a group for a named curve along with a table of precomputed
+ * multiples of its generator. Keys made with new_key_on_group() share
+ * the group, and its table, instead of building a new group every time.
+ * Report how long that took and, if the allocator can tell us, how much
+ * memory the table took.
+ */
+EC_GROUP *
+precomputed_group (int nid, BN_CTX *bnctx, long *usecs, long *bytes)
+{
+    EC_GROUP *group;
+    struct timeval start, end;
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+    struct mallinfo2 before, after;
+
+    before = mallinfo2();
+#endif
+    *bytes = 0;
+    gettimeofday(&start, NULL);
+    if ((group = EC_GROUP_new_by_curve_name(nid)) == NULL) {
+        return NULL;
+    }
+    if (!EC_GROUP_precompute_mult(group, bnctx)) {
+        EC_GROUP_free(group);
+        return NULL;
+    }
+    gettimeofday(&end, NULL);
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+    after = mallinfo2();
+    *bytes = (long)after.uordblks - (long)before.uordblks;
+#endif
+    *usecs = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+    return group;
+}
+
+EC_KEY *
+new_key_on_group (const EC_GROUP *group)
+{
+    EC_KEY *key;
+
+    if ((key = EC_KEY_new()) == NULL) {
+        return NULL;
+    }
+    if (!EC_KEY_set_group(key, group)) {
+        EC_KEY_free(key);
+        return NULL;
+    }
+    return key;
+}
@@ -30,11 +30,15 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #ifndef _UTILS_H_
+#define _UTILS_H_
+
+#include "jsmn.h"
 
 #define KID_LENGTH      43      // ceil((SHA256_DIGEST_LENGTH*4)/3)+1 in bytes
 
 int base64urlencode (unsigned char *burl, unsigned char *data, int len);
 int base64urldecode (unsigned char *data, unsigned char *burl, int len);
+int base64urldecode_strict (unsigned char *data, unsigned char *burl, int len);
 int base64urlencode_verbose (unsigned char *burl, unsigned char *data, int len);
 int base64urldecode_verbose (unsigned char *data, unsigned char *burl, int len);
 int generate_connector (unsigned char *connector, int len, EC_GROUP *group,
@@ -44,8 +48,29 @@ int validate_connector (unsigned char *connector, int len, EC_KEY *signkey,
                         BN_CTX *bnctx);
 int get_json_data (char *buf, int buflen, char **start, char **end,
                    const int nlab, ...);
+
+#define JSON_TOKENS     256     /* way more than any DPP object needs */
+
+struct json_doc {
+    char *buf;
+    int buflen;
+    int ntoks;
+    jsmntok_t toks[JSON_TOKENS];
+};
+int json_parse (struct json_doc *doc, char *buf, int buflen);
+int json_get (struct json_doc *doc, char **start, char **end, const int nlab, ...);
 int get_kid_from_point (unsigned char *kid, const EC_GROUP *group, const EC_POINT *pt,
                         BN_CTX *bnctx);
 EC_POINT *get_point_from_connector (unsigned char *, int, const EC_GROUP *, BN_CTX *);
 
+struct point_pool;
+struct point_pool *point_pool_new (const EC_GROUP *group);
+void point_pool_free (struct point_pool *pool);
+void point_pool_start (struct point_pool *pool);
+EC_POINT *point_pool_get (struct point_pool *pool);
+void point_pool_end (struct point_pool *pool);
+void point_pool_stats (struct point_pool *pool, unsigned long *gets, unsigned long *allocs);
+EC_GROUP *precomputed_group (int nid, BN_CTX *bnctx, long *usecs, long *bytes);
+EC_KEY *new_key_on_group (const EC_GROUP *group);
+
 #endif  /* _UTILS_H_ */